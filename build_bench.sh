@@ -0,0 +1,18 @@
+cp CMakeLists_BENCH.txt CMakeLists.txt
+
+cd src/mmm_api/protobuf
+protoc --cpp_out . *.proto
+cd ../../..
+cd src/mmm_api
+python3 help.py
+cd ../..
+rm -rf build
+mkdir build
+cd build
+cmake -DCMAKE_PREFIX_PATH=`python3 -c 'import torch;print(torch.utils.cmake_prefix_path)'` ..
+cmake --build . --config Release
+cd ..
+
+# run with : ./build/mmm_bench --json bench.json
+# or with a model : sh scripts/make_test_models.sh build/test_models
+#                   ./build/mmm_bench --ckpt build/test_models/tiny.pt --filter sample
@@ -11,4 +11,9 @@ mkdir build
 cd build
 cmake -DCMAKE_PREFIX_PATH=`python3 -c 'import torch;print(torch.utils.cmake_prefix_path)'` ..
 cmake --build . --config Release
-cd ..
\ No newline at end of file
+cd ..
+
+# the models for the tests that need one, which are skipped without them
+sh scripts/make_test_models.sh build/test_models || echo "COULD NOT WRITE THE TEST MODELS"
+
+# run with : MMM_TEST_MODELS=build/test_models ./build/mmm_api
\ No newline at end of file
@@ -0,0 +1,16 @@
+# writes the tiny models used by the unit tests and the benchmarks into a
+# folder (build/test_models by default) : tiny.pt, tiny_static.pt and the
+# int8 variant tiny_int8.pt. the tests find them through MMM_TEST_MODELS,
+# see find_test_model in src/mmm_api/tests/unit.cpp. needs torch and the
+# mmm_api python module (build_python.sh).
+#
+# usage : sh scripts/make_test_models.sh [folder]
+#         MMM_TEST_MODELS=build/test_models ./build/mmm_api
+
+set -e
+SCRIPTS=$(dirname "$0")
+FOLDER=${1:-build/test_models}
+mkdir -p $FOLDER
+python3 $SCRIPTS/make_tiny_model.py --output $FOLDER/tiny.pt
+python3 $SCRIPTS/make_tiny_model.py --static_state --output $FOLDER/tiny_static.pt
+python3 $SCRIPTS/quantize_model.py --ckpt $FOLDER/tiny.pt
@@ -0,0 +1,160 @@
+import math
+import json
+import argparse
+from typing import Tuple
+import torch
+import torch.nn as nn
+import torch.nn.functional as F
+
+# writes a small randomly initialized gpt-style torchscript model with the
+# same interface as the production checkpoints, so that sampling can be run
+# and benchmarked end-to-end without them. the output is noise, but the
+# controller masks every step so the generated piece is still valid.
+#
+# the forward pass takes (tokens, past_key_values) and returns
+# (logits, past_key_values), with a (k,v) tuple of (batch, heads, length,
+# hidden) tensors per layer (new_state). with --static_state the cache is
+# preallocated to --max_length and the model takes the position of the
+# first token as a third input, writing the cache in place.
+#
+# usage : python3 make_tiny_model.py --output tiny.pt
+#         ./build/mmm_bench --ckpt tiny.pt --filter sample
+
+parser = argparse.ArgumentParser()
+parser.add_argument("--encoder", type=str, default="EL_VELOCITY_DURATION_POLYPHONY_YELLOW_FIXED_ENCODER")
+parser.add_argument("--vocab_size", type=int, default=None)
+parser.add_argument("--num_layers", type=int, default=2)
+parser.add_argument("--num_heads", type=int, default=2)
+parser.add_argument("--num_hidden", type=int, default=16)
+parser.add_argument("--model_dim", type=int, default=4)
+parser.add_argument("--max_length", type=int, default=4096)
+parser.add_argument("--static_state", action="store_true")
+parser.add_argument("--seed", type=int, default=0)
+parser.add_argument("--output", type=str, required=True)
+args = parser.parse_args()
+
+if args.vocab_size is None:
+  import mmm_api as mmm
+  args.vocab_size = mmm.getEncoderSize(mmm.getEncoderType(args.encoder))
+  if args.vocab_size == 0:
+    raise ValueError("unknown encoder {}".format(args.encoder))
+
+# the blocks are scripted, as the cache length and the causal mask depend
+# on the inputs. the model around them is traced.
+
+class Embedding(nn.Module):
+  __constants__ = ["static_state"]
+
+  def __init__(self, vocab_size: int, max_length: int, embed_dim: int, static_state: bool):
+    super().__init__()
+    self.static_state = static_state
+    self.tok = nn.Embedding(vocab_size, embed_dim)
+    self.pos = nn.Embedding(max_length, embed_dim)
+
+  def forward(self, x: torch.Tensor, k_cache: torch.Tensor, position: torch.Tensor) -> torch.Tensor:
+    start = k_cache.size(2)
+    if self.static_state:
+      start = int(position.item())
+    pos = torch.arange(start, start + x.size(1), device=x.device)
+    return self.tok(x) + self.pos(pos).unsqueeze(0)
+
+class Block(nn.Module):
+  __constants__ = ["static_state", "num_heads", "num_hidden"]
+
+  def __init__(self, num_heads: int, num_hidden: int, static_state: bool):
+    super().__init__()
+    self.static_state = static_state
+    self.num_heads = num_heads
+    self.num_hidden = num_hidden
+    embed_dim = num_heads * num_hidden
+    self.ln1 = nn.LayerNorm(embed_dim)
+    self.qkv = nn.Linear(embed_dim, 3 * embed_dim)
+    self.proj = nn.Linear(embed_dim, embed_dim)
+    self.ln2 = nn.LayerNorm(embed_dim)
+    self.fc = nn.Linear(embed_dim, 4 * embed_dim)
+    self.out = nn.Linear(4 * embed_dim, embed_dim)
+
+  def forward(self, h: torch.Tensor, k_cache: torch.Tensor, v_cache: torch.Tensor, position: torch.Tensor) -> Tuple[torch.Tensor, torch.Tensor, torch.Tensor]:
+    B, T, C = h.size()
+    q, k, v = self.qkv(self.ln1(h)).split(C, dim=2)
+    q = q.view(B, T, self.num_heads, self.num_hidden).transpose(1, 2)
+    k = k.view(B, T, self.num_heads, self.num_hidden).transpose(1, 2)
+    v = v.view(B, T, self.num_heads, self.num_hidden).transpose(1, 2)
+
+    if self.static_state:
+      start = int(position.item())
+      k_cache[:, :, start:start+T] = k
+      v_cache[:, :, start:start+T] = v
+      keys = k_cache[:, :, :start+T]
+      values = v_cache[:, :, :start+T]
+    else:
+      start = k_cache.size(2)
+      keys = torch.cat([k_cache, k], dim=2)
+      values = torch.cat([v_cache, v], dim=2)
+      k_cache = keys
+      v_cache = values
+
+    qpos = torch.arange(start, start + T, device=h.device).unsqueeze(1)
+    kpos = torch.arange(0, keys.size(2), device=h.device).unsqueeze(0)
+    att = torch.matmul(q, keys.transpose(-2, -1)) / math.sqrt(self.num_hidden)
+    att = att.masked_fill(kpos > qpos, float("-inf"))
+    y = torch.matmul(F.softmax(att, dim=-1), values)
+    h = h + self.proj(y.transpose(1, 2).reshape(B, T, C))
+    h = h + self.out(F.gelu(self.fc(self.ln2(h))))
+    return h, k_cache, v_cache
+
+class TinyModel(nn.Module):
+  def __init__(self, vocab_size: int, num_layers: int, num_heads: int, num_hidden: int, max_length: int, static_state: bool):
+    super().__init__()
+    embed_dim = num_heads * num_hidden
+    self.embed = torch.jit.script(
+      Embedding(vocab_size, max_length, embed_dim, static_state))
+    self.blocks = nn.ModuleList([torch.jit.script(
+      Block(num_heads, num_hidden, static_state)) for _ in range(num_layers)])
+    self.ln = nn.LayerNorm(embed_dim)
+    self.head = nn.Linear(embed_dim, vocab_size, bias=False)
+
+  def forward(self, x, past, position=None):
+    if position is None:
+      position = torch.zeros((), dtype=torch.int64)
+    h = self.embed(x, past[0][0], position)
+    state = []
+    for block, (k_cache, v_cache) in zip(self.blocks, past):
+      h, k_cache, v_cache = block(h, k_cache, v_cache, position)
+      state.append( (k_cache, v_cache) )
+    return self.head(self.ln(h)), tuple(state)
+
+torch.manual_seed(args.seed)
+model = TinyModel(args.vocab_size, args.num_layers, args.num_heads,
+  args.num_hidden, args.max_length, args.static_state)
+model.eval()
+
+def empty_state(length):
+  return tuple(
+    (torch.zeros(1, args.num_heads, length, args.num_hidden),
+    torch.zeros(1, args.num_heads, length, args.num_hidden))
+    for _ in range(args.num_layers))
+
+x = torch.zeros(1, 3, dtype=torch.int64)
+with torch.no_grad():
+  if args.static_state:
+    position = torch.tensor(0, dtype=torch.int64)
+    traced = torch.jit.trace(model, (x, empty_state(args.max_length), position), check_trace=False)
+  else:
+    traced = torch.jit.trace(model, (x, empty_state(0)))
+
+meta = {
+  "encoder" : args.encoder,
+  "num_layers" : args.num_layers,
+  "num_heads" : args.num_heads,
+  "num_hidden" : args.num_hidden,
+  "model_dim" : args.model_dim,
+  "new_state" : True,
+}
+if args.static_state:
+  meta["static_state"] = True
+  meta["max_length"] = args.max_length
+torch.jit.save(traced, args.output,
+  _extra_files={"metadata.json" : json.dumps(meta)})
+
+print("saved tiny model to {}".format(args.output))
@@ -0,0 +1,50 @@
+import os
+import json
+import argparse
+import torch
+
+# makes an int8 variant of a checkpoint by applying dynamic quantization to
+# its linear layers. load_model picks it up when
+# SampleParam.use_quantized_model is set, either from the _int8.pt sibling
+# of the checkpoint (the default output) or from the quantized_ckpt entry in
+# the metadata. the original checkpoint is never modified. with a custom
+# --output, pass --output_ckpt to write a copy of the original model that
+# declares it in quantized_ckpt.
+#
+# usage : python3 quantize_model.py --ckpt tiny.pt
+#         (writes tiny_int8.pt, which test_quantized in tests/unit.cpp uses)
+
+parser = argparse.ArgumentParser()
+parser.add_argument("--ckpt", type=str, required=True)
+parser.add_argument("--output", type=str, default=None)
+parser.add_argument("--output_ckpt", type=str, default=None)
+args = parser.parse_args()
+
+if args.output is None:
+  args.output = os.path.splitext(args.ckpt)[0] + "_int8.pt"
+for path in [args.output, args.output_ckpt]:
+  if (path is not None) and (os.path.abspath(path) == os.path.abspath(args.ckpt)):
+    raise ValueError("refusing to overwrite {}".format(args.ckpt))
+
+extra_files = {"metadata.json" : ""}
+model = torch.jit.load(args.ckpt, map_location="cpu", _extra_files=extra_files)
+meta = json.loads(extra_files["metadata.json"])
+model.eval()
+
+qmodel = torch.quantization.quantize_dynamic_jit(
+  model, {"" : torch.quantization.default_dynamic_qconfig})
+
+qmeta = dict(meta)
+qmeta["quantized"] = True
+qmeta.pop("quantized_ckpt", None)
+torch.jit.save(qmodel, args.output,
+  _extra_files={"metadata.json" : json.dumps(qmeta)})
+print("saved quantized model to {}".format(args.output))
+
+if args.output_ckpt is not None:
+  # the path is stored relative to the new checkpoint
+  meta["quantized_ckpt"] = os.path.relpath(
+    args.output, os.path.dirname(os.path.abspath(args.output_ckpt)))
+  torch.jit.save(model, args.output_ckpt,
+    _extra_files={"metadata.json" : json.dumps(meta)})
+  print("saved model declaring it to {}".format(args.output_ckpt))
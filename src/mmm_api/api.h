@@ -6,6 +6,14 @@ For a thorough description of each of midi::Piece, midi::Status and midi::Sample
 
 */
 
-void mmm_api_sample(midi::Piece *piece, midi::Status *status, midi::SampleParam *param, mmm::CallbackManager *callbacks=NULL) {
-  sample_w_debug(piece, status, param, NULL, callbacks);
+// returns early when cancel_token is cancelled from another thread or when
+// param->timeout_ms() has passed, see mmm::SAMPLE_STATUS. the timing
+// breakdown is written to metrics when param->collect_metrics() is set.
+mmm::SAMPLE_STATUS mmm_api_sample(midi::Piece *piece, midi::Status *status, midi::SampleParam *param, mmm::CallbackManager *callbacks=NULL, mmm::CancellationToken *cancel_token=NULL, midi::SampleMetrics *metrics=NULL) {
+  return sample_w_debug(
+    piece, status, param, NULL, callbacks, cancel_token, metrics);
+}
+
+void mmm_api_set_threads(int intra_op, int inter_op) {
+  mmm::set_inference_threads(intra_op, inter_op);
 }
\ No newline at end of file
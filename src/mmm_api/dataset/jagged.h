@@ -69,6 +69,7 @@ public:
     min_tracks = 2;
     max_tracks = 12;
     max_seq_len = 2048;
+    chunk_bars = 0;
 
     engine.seed(time(NULL));
 
@@ -96,6 +97,12 @@ public:
     max_seq_len = x;
   }
 
+  // when x > 0 pieces are appended in the chunked layout, with the events
+  // of each track stored in blocks of x bars
+  void set_chunk_bars(int x) {
+    chunk_bars = x;
+  }
+
   void enable_write() {
     assert(can_read == false);
     if (can_write) { return; }
@@ -119,26 +126,25 @@ public:
   void append(std::string &s, size_t split_id) {
     enable_write();
 
-    size_t start = fs.tellp();
-    // begin compress ===============================
-    size_t src_size = sizeof(char)*s.size();
-    size_t dst_capacity = LZ4_compressBound(src_size);
-    char* dst = new char[dst_capacity];
-    size_t dst_size = LZ4_compress_default(
-      (char*)s.c_str(), dst, src_size, dst_capacity);
-    fs.write(dst, dst_size);
-    delete[] dst;
-    // end compress =================================
-    size_t end = fs.tellp();
     midi::Dataset::Item *item;
     switch (split_id) {
       case 0: item = header.add_train(); break;
       case 1: item = header.add_valid(); break;
       case 2: item = header.add_test(); break;
     }
-    item->set_start(start);
-    item->set_end(end);
-    item->set_src_size(src_size);
+
+    if (chunk_bars > 0) {
+      midi::Piece p;
+      p.ParseFromString(s);
+      append_chunked(&p, item);
+    }
+    else {
+      size_t start, end;
+      write_compressed(s, &start, &end);
+      item->set_start(start);
+      item->set_end(end);
+      item->set_src_size(s.size());
+    }
     flush_count++;
 
     if (flush_count >= 1000) {
@@ -150,25 +156,47 @@ public:
   std::string read(size_t index, size_t split_id) {
     enable_read();
 
-    midi::Dataset::Item item;
-    switch (split_id) {
-      case 0: item = header.train(index); break;
-      case 1: item = header.valid(index); break;
-      case 2: item = header.test(index); break;
+    const midi::Dataset::Item &item = get_item(index, split_id);
+    if (item.chunks_size() > 0) {
+      // reassemble the entire piece from the chunks
+      midi::Piece p;
+      load_chunked_segment(item, {}, {}, &p);
+      return p.SerializeAsString();
+    }
+    return read_compressed(item.start(), item.end(), item.src_size());
+  }
+
+  // parse only the chunks covering the requested tracks and bars. when
+  // tracks or bars is empty all of them are kept. for pieces stored in
+  // the flat layout this falls back to parsing and pruning the piece.
+  void load_segment(size_t index, size_t split_id, std::vector<int> tracks, std::vector<int> bars, midi::Piece *p) {
+    enable_read();
+
+    const midi::Dataset::Item &item = get_item(index, split_id);
+    if (item.chunks_size() > 0) {
+      load_chunked_segment(item, tracks, bars, p);
+    }
+    else {
+      p->ParseFromString(
+        read_compressed(item.start(), item.end(), item.src_size()));
+      if (tracks.size() == 0) {
+        tracks = arange(0,p->tracks_size(),1);
+      }
+      prune_tracks_dev2(p, tracks, bars);
     }
-    size_t csize = item.end() - item.start();
-    char* src = new char[csize/sizeof(char)];
-    fs.seekg(item.start());
-    fs.read(src, csize);
-    std::string x(item.src_size(), ' ');
-    LZ4_decompress_safe(src,(char*)x.c_str(),csize,item.src_size());
-    delete[] src;
-    return x;
+  }
+
+  #ifdef PYBIND
+  py::bytes read_segment_bytes(size_t index, size_t split_id, std::vector<int> tracks, std::vector<int> bars) {
+    midi::Piece p;
+    load_segment(index, split_id, tracks, bars, &p);
+    return py::bytes(p.SerializeAsString());
   }
 
   py::bytes read_bytes(size_t index, size_t split_id) {
     return py::bytes(read(index, split_id));
   }
+  #endif
 
   std::string read_json(size_t index, size_t split_id) {
     midi::Piece p;
@@ -200,10 +228,30 @@ public:
 
   void load_random_segment(midi::Piece *p, size_t split_id, ENCODER *enc, TrainConfig *tc) {
 
-    load_random_piece(p, split_id);
-    select_random_segment(
-      p, tc->num_bars, tc->min_tracks, tc->max_tracks, 
-      enc->config->te, &engine);
+    int nitems = get_split_size(split_id);
+    int index = random_on_range(nitems, &engine);
+    const midi::Dataset::Item &item = get_item(index, split_id);
+    if (item.chunks_size() > 0) {
+      // select the segment using the skeleton, then only decompress
+      // and parse the chunks that overlap with it
+      midi::Piece skeleton;
+      skeleton.ParseFromString(
+        read_compressed(item.start(), item.end(), item.src_size()));
+      int start;
+      std::vector<int> valid_tracks;
+      select_random_segment_indices(
+        &skeleton, tc->num_bars, tc->min_tracks, tc->max_tracks, 
+        enc->config->te, &engine, valid_tracks, &start, true);
+      std::vector<int> bars = arange(start,start+tc->num_bars,1);
+      assemble_chunked_segment(item, skeleton, valid_tracks, bars, p);
+    }
+    else {
+      p->ParseFromString(
+        read_compressed(item.start(), item.end(), item.src_size()));
+      select_random_segment(
+        p, tc->num_bars, tc->min_tracks, tc->max_tracks, 
+        enc->config->te, &engine);
+    }
     enc->config->transpose = select_random_transpose(p);
 
     // 75 % of the time we do bar infill
@@ -242,29 +290,35 @@ public:
           throw std::runtime_error("ENCODER TYPE DOES NOT EXIST");
         }
 
-        midi::Piece p;
-        load_random_piece(&p, split_id);
+        // the piece and its two halves are freed together with the arena
+        google::protobuf::Arena arena;
+        midi::Piece *p =
+          google::protobuf::Arena::CreateMessage<midi::Piece>(&arena);
+        load_random_piece(p, split_id);
 
         int start;
         std::vector<int> valid_tracks;
-        select_random_segment_indices(&p, tc->num_bars*2, tc->min_tracks, tc->max_tracks, enc->config->te, &engine, valid_tracks, &start);
+        select_random_segment_indices(p, tc->num_bars*2, tc->min_tracks, tc->max_tracks, enc->config->te, &engine, valid_tracks, &start);
 
-        midi::Piece a(p);
+        midi::Piece *a =
+          google::protobuf::Arena::CreateMessage<midi::Piece>(&arena);
+        a->CopyFrom(*p);
         std::vector<int> abars = arange(start,start+tc->num_bars,1);
-        prune_tracks_dev2(&a, valid_tracks, abars);
+        prune_tracks_dev2(a, valid_tracks, abars);
 
         shuffle(valid_tracks.begin(), valid_tracks.end(), engine);
         if ((valid_tracks.size()>1) && (random_on_unit(&engine)<.5)) {
           valid_tracks.resize((int)valid_tracks.size() - 1);
         }
 
-        midi::Piece b(p);
+        // b is the last use of p, so it takes p over instead of a copy
+        midi::Piece *b = p;
         std::vector<int> bbars = arange(
           start+tc->num_bars,start+tc->num_bars*2,1);
-        prune_tracks_dev2(&b, valid_tracks, bbars);
+        enc->config->transpose = select_random_transpose(p);
+        prune_tracks_dev2(b, valid_tracks, bbars);
 
-        enc->config->transpose = select_random_transpose(&p);
-        return make_tuple(enc->encode(&a), enc->encode(&b));
+        return make_tuple(enc->encode(a), enc->encode(b));
       }
       catch (const std::exception &exc)
       {
@@ -313,9 +367,13 @@ public:
       }
 
       try {
-        midi::Piece p;
-        load_random_segment(&p, split_id, enc.get(), tc);
-        std::vector<int> tokens = enc->encode(&p);
+        // the piece is freed with the arena at the end of the iteration,
+        // so at most one piece is alive even when segments are retried
+        google::protobuf::Arena arena;
+        midi::Piece *p =
+          google::protobuf::Arena::CreateMessage<midi::Piece>(&arena);
+        load_random_segment(p, split_id, enc.get(), tc);
+        std::vector<int> tokens = enc->encode(p);
         std::vector<int> mask(tokens.size(),1);
         batch.add( tokens );
         att_mask.add( mask );
@@ -343,9 +401,12 @@ public:
 
     while(batch.batch_size < batch_size) {
       try {
-        midi::Piece p;
-        load_random_segment(&p, split_id, enc.get(), tc);
-        auto out = enc->encode_w_embeds(&p);
+        // one arena per iteration, as in read_batch_v2
+        google::protobuf::Arena arena;
+        midi::Piece *p =
+          google::protobuf::Arena::CreateMessage<midi::Piece>(&arena);
+        load_random_segment(p, split_id, enc.get(), tc);
+        auto out = enc->encode_w_embeds(p);
         std::vector<int> mask(std::get<0>(out).size(),1);
         batch.add( std::get<0>(out) );
         att_mask.add( mask );
@@ -491,8 +552,163 @@ public:
     can_read = false;
     can_write = false;
   }
-  
+
 private:
+  const midi::Dataset::Item &get_item(size_t index, size_t split_id) {
+    switch (split_id) {
+      case 0: return header.train(index);
+      case 1: return header.valid(index);
+      case 2: return header.test(index);
+    }
+    throw std::runtime_error("INVALID SPLIT ID");
+  }
+
+  void write_compressed(const std::string &s, size_t *start, size_t *end) {
+    *start = fs.tellp();
+    size_t src_size = sizeof(char)*s.size();
+    size_t dst_capacity = LZ4_compressBound(src_size);
+    char* dst = new char[dst_capacity];
+    size_t dst_size = LZ4_compress_default(
+      (char*)s.c_str(), dst, src_size, dst_capacity);
+    fs.write(dst, dst_size);
+    delete[] dst;
+    *end = fs.tellp();
+  }
+
+  std::string read_compressed(size_t start, size_t end, size_t src_size) {
+    size_t csize = end - start;
+    char* src = new char[csize/sizeof(char)];
+    fs.seekg(start);
+    fs.read(src, csize);
+    std::string x(src_size, ' ');
+    LZ4_decompress_safe(src,(char*)x.c_str(),csize,src_size);
+    delete[] src;
+    return x;
+  }
+
+  // the skeleton is the piece with all the events removed, which is
+  // enough to select a segment. each chunk is a piece with a single
+  // track holding the bars [bar_start,bar_end) and their events. chunks
+  // are written in (track,bar_start) order, which get_chunk relies on.
+  void append_chunked(midi::Piece *p, midi::Dataset::Item *item) {
+    update_has_notes(p);
+    // throws unless every track has the same number of bars
+    int num_bars = get_num_bars(p);
+
+    midi::Piece skeleton(*p);
+    skeleton.clear_events();
+    for (int track_num=0; track_num<skeleton.tracks_size(); track_num++) {
+      for (auto &bar : *skeleton.mutable_tracks(track_num)->mutable_bars()) {
+        bar.clear_events();
+      }
+    }
+    size_t start, end;
+    std::string s = skeleton.SerializeAsString();
+    write_compressed(s, &start, &end);
+    item->set_start(start);
+    item->set_end(end);
+    item->set_src_size(s.size());
+
+    for (int track_num=0; track_num<p->tracks_size(); track_num++) {
+      for (int bar_start=0; bar_start<num_bars; bar_start+=chunk_bars) {
+        int bar_end = std::min(bar_start + chunk_bars, num_bars);
+        midi::Piece chunk;
+        midi::Track *t = chunk.add_tracks();
+        for (int bar_num=bar_start; bar_num<bar_end; bar_num++) {
+          midi::Bar *b = t->add_bars();
+          for (const auto event_index : p->tracks(track_num).bars(bar_num).events()) {
+            b->add_events( chunk.events_size() );
+            chunk.add_events()->CopyFrom( p->events(event_index) );
+          }
+        }
+        s = chunk.SerializeAsString();
+        write_compressed(s, &start, &end);
+        midi::Dataset::Chunk *c = item->add_chunks();
+        c->set_start(start);
+        c->set_end(end);
+        c->set_src_size(s.size());
+        c->set_track(track_num);
+        c->set_bar_start(bar_start);
+        c->set_bar_end(bar_end);
+      }
+    }
+  }
+
+  void load_chunked_segment(const midi::Dataset::Item &item, std::vector<int> tracks, std::vector<int> bars, midi::Piece *p) {
+    midi::Piece skeleton;
+    skeleton.ParseFromString(
+      read_compressed(item.start(), item.end(), item.src_size()));
+    if (tracks.size() == 0) {
+      tracks = arange(0,skeleton.tracks_size(),1);
+    }
+    if (bars.size() == 0) {
+      bars = arange(0,get_num_bars(&skeleton),1);
+    }
+    assemble_chunked_segment(item, skeleton, tracks, bars, p);
+  }
+
+  // mirrors prune_tracks_dev2, except the events are pulled from the
+  // chunks instead of a fully parsed piece
+  void assemble_chunked_segment(const midi::Dataset::Item &item, midi::Piece &skeleton, const std::vector<int> &tracks, const std::vector<int> &bars, midi::Piece *p) {
+    int num_bars = get_num_bars(&skeleton);
+    p->CopyFrom(skeleton);
+    p->clear_tracks();
+
+    std::map<std::tuple<int,int>,midi::Piece> chunks;
+    for (const auto track_num : tracks) {
+      if ((track_num < 0) || (track_num >= skeleton.tracks_size())) {
+        continue;
+      }
+      const midi::Track &track = skeleton.tracks(track_num);
+      midi::Track *t = p->add_tracks();
+      t->CopyFrom( track );
+      t->clear_bars();
+      for (const auto bar_num : bars) {
+        if ((bar_num < 0) || (bar_num >= num_bars)) {
+          continue;
+        }
+        int bar_start;
+        const midi::Piece &chunk = get_chunk(
+          item, num_bars, track_num, bar_num, chunks, &bar_start);
+        const midi::Bar &src = chunk.tracks(0).bars(bar_num - bar_start);
+        midi::Bar *b = t->add_bars();
+        b->CopyFrom( track.bars(bar_num) );
+        for (const auto event_index : src.events()) {
+          b->add_events( p->events_size() );
+          p->add_events()->CopyFrom( chunk.events(event_index) );
+        }
+      }
+    }
+  }
+
+  // chunks are decompressed at most once per call and cached in chunks.
+  // the chunk size is taken from the item, as it may have been written
+  // with a different chunk_bars.
+  const midi::Piece &get_chunk(const midi::Dataset::Item &item, int num_bars, int track_num, int bar_num, std::map<std::tuple<int,int>,midi::Piece> &chunks, int *bar_start) {
+    if (item.chunks_size() == 0) {
+      throw std::runtime_error("MISSING CHUNK");
+    }
+    int span = item.chunks(0).bar_end() - item.chunks(0).bar_start();
+    int chunks_per_track = (num_bars + span - 1) / span;
+    int index = track_num * chunks_per_track + bar_num / span;
+    if (index >= item.chunks_size()) {
+      throw std::runtime_error("MISSING CHUNK");
+    }
+    const midi::Dataset::Chunk &c = item.chunks(index);
+    if ((c.track() != track_num) || (bar_num < c.bar_start()) || (bar_num >= c.bar_end())) {
+      throw std::runtime_error("MISSING CHUNK");
+    }
+    *bar_start = c.bar_start();
+    std::tuple<int,int> key = std::make_tuple(track_num, c.bar_start());
+    auto it = chunks.find(key);
+    if (it == chunks.end()) {
+      it = chunks.insert(std::make_pair(key, midi::Piece())).first;
+      it->second.ParseFromString(
+        read_compressed(c.start(), c.end(), c.src_size()));
+    }
+    return it->second;
+  }
+
   std::string filepath;
   std::string header_filepath;
   std::fstream fs;
@@ -506,6 +722,7 @@ private:
   int min_tracks;
   int max_tracks;
   int max_seq_len;
+  int chunk_bars;
 
   std::mt19937 engine;
 
@@ -1,5 +1,10 @@
 #pragma once
 
+#include <map>
+#include <memory>
+#include <mutex>
+#include <typeindex>
+
 #include "representation.h"
 #include "util.h"
 
@@ -7,6 +12,7 @@
 #include "../enum/encoder_config.h"
 #include "../enum/train_config.h"
 #include "../midi_io.h"
+#include "../parallel.h"
 
 // START OF NAMESPACE
 namespace mmm {
@@ -49,6 +55,13 @@ std::vector<int> resolve_bar_infill_tokens(std::vector<int> &raw_tokens, REPRESE
   return tokens;
 }
 
+// ragged token buffer for a batch of pieces. the tokens of piece i are
+// tokens[offsets[i]:offsets[i+1]], so offsets has one more entry than
+// there are pieces.
+struct TokenBatch {
+  std::vector<int> tokens;
+  std::vector<int64_t> offsets;
+};
 
 class ENCODER {
 public:
@@ -61,6 +74,22 @@ public:
     throw std::runtime_error("ENCODER CLASS MUST DEFINE get_encoder_config()");
   }
 
+  // the representation is immutable, so it is built once per encoder class
+  // and shared by every instance (and thread). the per-call mutable state
+  // lives in config, which each instance owns.
+  REPRESENTATION *get_shared_encoder_rep() {
+    static std::mutex reps_mutex;
+    static std::map<std::type_index,std::unique_ptr<REPRESENTATION>> reps;
+    std::lock_guard<std::mutex> lock(reps_mutex);
+    std::unique_ptr<REPRESENTATION> &r = reps[std::type_index(typeid(*this))];
+    if (!r) {
+      r.reset( get_encoder_rep() );
+    }
+    return r.get();
+  }
+
+  virtual ~ENCODER() {}
+
   //virtual std::vector<int> encode(midi::Piece *p) {}
   //virtual std::tuple<std::vector<int>,std::vector<std::vector<double>>> encode_w_features(midi::Piece *p) {}
   //virtual std::vector<double> convert_feature(midi::ContinuousFeature f) {}
@@ -77,9 +106,19 @@ public:
     // default is to do nothing
   }
 
+  // encoders with a fixed feature set override these to use a
+  // specialized kernel (see STATIC_FEATURES in util.h)
+  virtual TokenSequence encode_kernel(midi::Piece *p) {
+    return to_performance_w_tracks_dev(p, rep, config);
+  }
+
+  virtual void decode_kernel(std::vector<int> &tokens, midi::Piece *p) {
+    decode_track_dev(tokens, p, rep, config);
+  }
+
   std::vector<int> encode(midi::Piece *p) {
     preprocess_piece(p);
-    TokenSequence ts = to_performance_w_tracks_dev(p, rep, config);
+    TokenSequence ts = encode_kernel(p);
     return ts.tokens;
   }
 
@@ -94,7 +133,7 @@ public:
   */
 
   std::vector<int> encode_wo_preprocess(midi::Piece *p) {
-    TokenSequence ts = to_performance_w_tracks_dev(p, rep, config);
+    TokenSequence ts = encode_kernel(p);
     return ts.tokens;
   }
 
@@ -105,7 +144,7 @@ public:
 
   std::tuple<std::vector<int>,matrix<double>> encode_w_embeds(midi::Piece *p) {
     preprocess_piece(p);
-    TokenSequence ts = to_performance_w_tracks_dev(p, rep, config);
+    TokenSequence ts = encode_kernel(p);
     matrix<double> embeds;
     for (auto f : ts.features) {
       embeds.push_back( convert_feature(f) );
@@ -117,7 +156,7 @@ public:
     if (config->do_multi_fill == true) {
       tokens = resolve_bar_infill_tokens(tokens, rep);
     }
-    return decode_track_dev(tokens, p, rep, config);
+    return decode_kernel(tokens, p);
   }
 
   std::string midi_to_json(std::string &filepath) {
@@ -202,6 +241,111 @@ public:
     }
   }
 
+  // batch versions of encode and decode. each piece is handled by a single
+  // worker and the encoder itself is only read, so one encoder can be shared
+  // by all the workers. num_threads <= 0 uses all available cores.
+  TokenBatch encode_batch(std::vector<midi::Piece> &pieces, int num_threads=0) {
+    std::vector<std::vector<int>> seqs(pieces.size());
+    parallel_for(pieces.size(), num_threads, [&](int i) {
+      seqs[i] = encode(&(pieces[i]));
+    });
+    return flatten_batch(seqs);
+  }
+
+  TokenBatch encode_batch_bytes(std::vector<std::string> &pieces, int num_threads=0) {
+    std::vector<std::vector<int>> seqs(pieces.size());
+    parallel_for(pieces.size(), num_threads, [&](int i) {
+      midi::Piece p;
+      if (!p.ParseFromString(pieces[i])) {
+        throw std::runtime_error("ERROR : FAILED TO PARSE PIECE IN BATCH");
+      }
+      seqs[i] = encode(&p);
+    });
+    return flatten_batch(seqs);
+  }
+
+  void decode_batch(const std::vector<int> &tokens, const std::vector<int64_t> &offsets, std::vector<midi::Piece> &output, int num_threads=0) {
+    validate_batch(tokens, offsets);
+    output.clear();
+    output.resize(offsets.size() - 1);
+    parallel_for(output.size(), num_threads, [&](int i) {
+      std::vector<int> seq(
+        tokens.begin() + offsets[i], tokens.begin() + offsets[i+1]);
+      decode(seq, &(output[i]));
+    });
+  }
+
+  std::vector<std::string> decode_batch_bytes(const std::vector<int> &tokens, const std::vector<int64_t> &offsets, int num_threads=0) {
+    validate_batch(tokens, offsets);
+    std::vector<std::string> output(offsets.size() - 1);
+    parallel_for(output.size(), num_threads, [&](int i) {
+      std::vector<int> seq(
+        tokens.begin() + offsets[i], tokens.begin() + offsets[i+1]);
+      midi::Piece p;
+      decode(seq, &p);
+      p.SerializeToString(&(output[i]));
+    });
+    return output;
+  }
+
+  static TokenBatch flatten_batch(std::vector<std::vector<int>> &seqs) {
+    TokenBatch batch;
+    batch.offsets.reserve(seqs.size() + 1);
+    batch.offsets.push_back(0);
+    for (const auto &seq : seqs) {
+      batch.offsets.push_back( batch.offsets.back() + seq.size() );
+    }
+    batch.tokens.reserve(batch.offsets.back());
+    for (const auto &seq : seqs) {
+      batch.tokens.insert(batch.tokens.end(), seq.begin(), seq.end());
+    }
+    return batch;
+  }
+
+  static void validate_batch(const std::vector<int> &tokens, const std::vector<int64_t> &offsets) {
+    if ((offsets.size() == 0) || (offsets[0] != 0)) {
+      throw std::runtime_error("ERROR : BATCH OFFSETS MUST START WITH 0");
+    }
+    for (int i=1; i<offsets.size(); i++) {
+      if ((offsets[i] < offsets[i-1]) || (offsets[i] > (int64_t)tokens.size())) {
+        throw std::runtime_error("ERROR : INVALID BATCH OFFSETS");
+      }
+    }
+  }
+
+  #ifdef PYBIND
+  // numpy versions of the batch functions. the pieces are serialized
+  // protobuf bytes and the token buffer is a pair of numpy arrays
+  // (tokens, offsets). the GIL is released while the workers run.
+  std::tuple<py::array_t<int>,py::array_t<int64_t>> encode_batch_py(std::vector<std::string> &pieces, int num_threads) {
+    TokenBatch batch;
+    {
+      py::gil_scoped_release release;
+      batch = encode_batch_bytes(pieces, num_threads);
+    }
+    py::array_t<int> tokens(batch.tokens.size());
+    py::array_t<int64_t> offsets(batch.offsets.size());
+    std::copy(batch.tokens.begin(), batch.tokens.end(), tokens.mutable_data());
+    std::copy(batch.offsets.begin(), batch.offsets.end(), offsets.mutable_data());
+    return std::make_tuple(tokens, offsets);
+  }
+
+  std::vector<py::bytes> decode_batch_py(py::array_t<int,py::array::c_style|py::array::forcecast> tokens, py::array_t<int64_t,py::array::c_style|py::array::forcecast> offsets, int num_threads) {
+    std::vector<int> t(tokens.data(), tokens.data() + tokens.size());
+    std::vector<int64_t> o(offsets.data(), offsets.data() + offsets.size());
+    std::vector<std::string> output;
+    {
+      py::gil_scoped_release release;
+      output = decode_batch_bytes(t, o, num_threads);
+    }
+    std::vector<py::bytes> result;
+    for (const auto &x : output) {
+      result.push_back( py::bytes(x) );
+    }
+    return result;
+  }
+  #endif
+
   void tokens_to_midi(std::vector<int> &tokens, std::string &filepath) {
     midi::Piece p;
     decode(tokens, &p);
@@ -16,10 +16,9 @@ class ElVelocityDurationPolyphonyEncoder : public ENCODER {
 public:
   ElVelocityDurationPolyphonyEncoder() {
     config = get_encoder_config();
-    rep = get_encoder_rep();
+    rep = get_shared_encoder_rep();
   }
   ~ElVelocityDurationPolyphonyEncoder() {
-    delete rep;
     delete config;
   }
 
@@ -70,6 +69,16 @@ public:
     return e;
   }
 
+  TokenSequence encode_kernel(midi::Piece *p) {
+    return encode_kernel_dispatch<DURATION_ABSOLUTE_FEATURES>(
+      p, rep, config);
+  }
+
+  void decode_kernel(std::vector<int> &tokens, midi::Piece *p) {
+    decode_kernel_dispatch<DURATION_ABSOLUTE_FEATURES>(
+      tokens, p, rep, config);
+  }
+
   void preprocess_piece(midi::Piece *p) {
     calculate_note_durations(p);
     update_av_polyphony_and_note_duration(p);
@@ -82,10 +91,9 @@ class ElVelocityDurationPolyphonyYellowEncoder : public ENCODER {
 public:
   ElVelocityDurationPolyphonyYellowEncoder() {
     config = get_encoder_config();
-    rep = get_encoder_rep();
+    rep = get_shared_encoder_rep();
   }
   ~ElVelocityDurationPolyphonyYellowEncoder() {
-    delete rep;
     delete config;
   }
 
@@ -136,6 +144,16 @@ public:
     return e;
   }
 
+  TokenSequence encode_kernel(midi::Piece *p) {
+    return encode_kernel_dispatch<DURATION_ABSOLUTE_FEATURES>(
+      p, rep, config);
+  }
+
+  void decode_kernel(std::vector<int> &tokens, midi::Piece *p) {
+    decode_kernel_dispatch<DURATION_ABSOLUTE_FEATURES>(
+      tokens, p, rep, config);
+  }
+
   void preprocess_piece(midi::Piece *p) {
     calculate_note_durations(p);
     update_av_polyphony_and_note_duration(p);
@@ -147,10 +165,9 @@ class ElVelocityDurationPolyphonyYellowFixedEncoder : public ENCODER {
 public:
   ElVelocityDurationPolyphonyYellowFixedEncoder() {
     config = get_encoder_config();
-    rep = get_encoder_rep();
+    rep = get_shared_encoder_rep();
   }
   ~ElVelocityDurationPolyphonyYellowFixedEncoder() {
-    delete rep;
     delete config;
   }
 
@@ -202,6 +219,16 @@ public:
     return e;
   }
 
+  TokenSequence encode_kernel(midi::Piece *p) {
+    return encode_kernel_dispatch<DURATION_ABSOLUTE_FEATURES>(
+      p, rep, config);
+  }
+
+  void decode_kernel(std::vector<int> &tokens, midi::Piece *p) {
+    decode_kernel_dispatch<DURATION_ABSOLUTE_FEATURES>(
+      tokens, p, rep, config);
+  }
+
   void preprocess_piece(midi::Piece *p) {
     calculate_note_durations(p);
     update_av_polyphony_and_note_duration(p);
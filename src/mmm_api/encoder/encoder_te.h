@@ -18,7 +18,15 @@ namespace mmm {
 class TeTrackDensityEncoder : public ENCODER {
 public:
   TeTrackDensityEncoder() {    
-    rep = new REPRESENTATION({
+    rep = get_shared_encoder_rep();
+    config = get_encoder_config();
+  }
+  ~TeTrackDensityEncoder() {
+    delete config;
+  }
+
+  REPRESENTATION *get_encoder_rep() {
+    REPRESENTATION *r = new REPRESENTATION({
       {PIECE_START, TOKEN_DOMAIN(2)}, // 1 is bar infill
       {BAR, TOKEN_DOMAIN(1)},
       {BAR_END, TOKEN_DOMAIN(1)},
@@ -40,11 +48,7 @@ public:
       {FILL_IN, TOKEN_DOMAIN(3)},
       {DENSITY_LEVEL, TOKEN_DOMAIN(10)}
       });
-    config = get_encoder_config();
-  }
-  ~TeTrackDensityEncoder() {
-    delete rep;
-    delete config;
+    return r;
   }
   EncoderConfig *get_encoder_config() {
     EncoderConfig *e = new EncoderConfig();
@@ -75,7 +79,15 @@ public:
 class TeEncoder : public ENCODER {
 public:
   TeEncoder() {    
-    rep = new REPRESENTATION({
+    rep = get_shared_encoder_rep();
+    config = get_encoder_config();
+  }
+  ~TeEncoder() {
+    delete config;
+  }
+
+  REPRESENTATION *get_encoder_rep() {
+    REPRESENTATION *r = new REPRESENTATION({
       {PIECE_START, TOKEN_DOMAIN(2)}, // 1 is bar infill
       {BAR, TOKEN_DOMAIN(1)},
       {BAR_END, TOKEN_DOMAIN(1)},
@@ -99,11 +111,7 @@ public:
       {FILL_IN_END, TOKEN_DOMAIN(1)},
       {VELOCITY_LEVEL, TOKEN_DOMAIN(DEFAULT_VELOCITY_MAP,INT_MAP_DOMAIN)}
       });
-    config = get_encoder_config();
-  }
-  ~TeEncoder() {
-    delete rep;
-    delete config;
+    return r;
   }
   EncoderConfig *get_encoder_config() {
     EncoderConfig *e = new EncoderConfig();
@@ -139,10 +147,9 @@ class TeEncoder : public ENCODER {
 public:
   TeEncoder() {
     config = get_encoder_config();
-    rep = get_encoder_rep();
+    rep = get_shared_encoder_rep();
   }
   ~TeEncoder() {
-    delete rep;
     delete config;
   }
 
@@ -210,10 +217,9 @@ class TeVelocityEncoder : public ENCODER {
 public:
   TeVelocityEncoder() {
     config = get_encoder_config();
-    rep = get_encoder_rep();
+    rep = get_shared_encoder_rep();
   }
   ~TeVelocityEncoder() {
-    delete rep;
     delete config;
   }
 
@@ -278,10 +284,9 @@ class TeVelocityDurationPolyphonyEncoder : public ENCODER {
 public:
   TeVelocityDurationPolyphonyEncoder() {
     config = get_encoder_config();
-    rep = get_encoder_rep();
+    rep = get_shared_encoder_rep();
   }
   ~TeVelocityDurationPolyphonyEncoder() {
-    delete rep;
     delete config;
   }
 
@@ -339,6 +344,16 @@ public:
     return e;
   }
 
+  TokenSequence encode_kernel(midi::Piece *p) {
+    return encode_kernel_dispatch<DURATION_ABSOLUTE_FEATURES>(
+      p, rep, config);
+  }
+
+  void decode_kernel(std::vector<int> &tokens, midi::Piece *p) {
+    decode_kernel_dispatch<DURATION_ABSOLUTE_FEATURES>(
+      tokens, p, rep, config);
+  }
+
   void preprocess_piece(midi::Piece *p) {
     calculate_note_durations(p);
     update_av_polyphony_and_note_duration(p);
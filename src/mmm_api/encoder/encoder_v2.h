@@ -19,7 +19,15 @@ const float FLOAT_MAX = std::numeric_limits<float>::max();
 class TrackDensityEncoder : public ENCODER {
 public:
   TrackDensityEncoder() {
-    rep = new REPRESENTATION({
+    rep = get_shared_encoder_rep();
+    config = get_encoder_config();
+  }
+  ~TrackDensityEncoder() {
+    delete config;
+  }
+
+  REPRESENTATION *get_encoder_rep() {
+    REPRESENTATION *r = new REPRESENTATION({
       {PIECE_START, TOKEN_DOMAIN(1)},
       {BAR, TOKEN_DOMAIN(1)},
       {BAR_END, TOKEN_DOMAIN(1)},
@@ -34,11 +42,7 @@ public:
       {TIME_DELTA, TOKEN_DOMAIN(48)},
       {DENSITY_LEVEL, TOKEN_DOMAIN(10)}
     });
-    config = get_encoder_config();
-  }
-  ~TrackDensityEncoder() {
-    delete rep;
-    delete config;
+    return r;
   }
   EncoderConfig *get_encoder_config() {
     EncoderConfig *e = new EncoderConfig();
@@ -64,7 +68,15 @@ public:
 class TrackDensityEncoderV2 : public ENCODER {
 public:
   TrackDensityEncoderV2() {    
-    rep = new REPRESENTATION({
+    rep = get_shared_encoder_rep();
+    config = get_encoder_config();
+  }
+  ~TrackDensityEncoderV2() {
+    delete config;
+  }
+
+  REPRESENTATION *get_encoder_rep() {
+    REPRESENTATION *r = new REPRESENTATION({
       {PIECE_START, TOKEN_DOMAIN(2)}, // 1 is bar infill
       {BAR, TOKEN_DOMAIN(1)},
       {BAR_END, TOKEN_DOMAIN(1)},
@@ -83,11 +95,7 @@ public:
       {FILL_IN_END, TOKEN_DOMAIN(1)},
       {DENSITY_LEVEL, TOKEN_DOMAIN(10)}
       });
-    config = get_encoder_config();
-  }
-  ~TrackDensityEncoderV2() {
-    delete rep;
-    delete config;
+    return r;
   }
   EncoderConfig *get_encoder_config() {
     EncoderConfig *e = new EncoderConfig();
@@ -118,7 +126,15 @@ public:
 class TrackBarFillDensityEncoder : public ENCODER {
 public:
   TrackBarFillDensityEncoder() {
-    rep = new REPRESENTATION({
+    rep = get_shared_encoder_rep();
+    config = get_encoder_config();
+  }
+  ~TrackBarFillDensityEncoder() {
+    delete config;
+  }
+
+  REPRESENTATION *get_encoder_rep() {
+    REPRESENTATION *r = new REPRESENTATION({
       {PIECE_START, TOKEN_DOMAIN(1)},
       {BAR, TOKEN_DOMAIN(1)},
       {BAR_END, TOKEN_DOMAIN(1)},
@@ -137,11 +153,7 @@ public:
       {FILL_IN_END, TOKEN_DOMAIN(1)},
       {DENSITY_LEVEL, TOKEN_DOMAIN(10)}
     });
-    config = get_encoder_config();
-  }
-  ~TrackBarFillDensityEncoder() {
-    delete rep;
-    delete config;
+    return r;
   }
   EncoderConfig *get_encoder_config() {
     EncoderConfig *e = new EncoderConfig();
@@ -164,7 +176,15 @@ public:
 class TrackInterleavedEncoder : public ENCODER {
 public:
   TrackInterleavedEncoder() {    
-    rep = new REPRESENTATION({
+    rep = get_shared_encoder_rep();
+    config = get_encoder_config();
+  }
+  ~TrackInterleavedEncoder() {
+    delete config;
+  }
+
+  REPRESENTATION *get_encoder_rep() {
+    REPRESENTATION *r = new REPRESENTATION({
       {PIECE_START, TOKEN_DOMAIN(1)},
       {BAR, TOKEN_DOMAIN(1)},
       {BAR_END, TOKEN_DOMAIN(1)},
@@ -173,11 +193,7 @@ public:
       {NOTE_ONSET, TOKEN_DOMAIN(128)},
       {TIME_DELTA, TOKEN_DOMAIN(48)},
       });
-    config = get_encoder_config();
-  }
-  ~TrackInterleavedEncoder() {
-    delete rep;
-    delete config;
+    return r;
   }
   EncoderConfig *get_encoder_config() {
     EncoderConfig *e = new EncoderConfig();
@@ -197,7 +213,15 @@ public:
 class TrackInterleavedWHeaderEncoder : public ENCODER {
 public:
   TrackInterleavedWHeaderEncoder() {    
-    rep = new REPRESENTATION({
+    rep = get_shared_encoder_rep();
+    config = get_encoder_config();
+  }
+  ~TrackInterleavedWHeaderEncoder() {
+    delete config;
+  }
+
+  REPRESENTATION *get_encoder_rep() {
+    REPRESENTATION *r = new REPRESENTATION({
       {PIECE_START, TOKEN_DOMAIN(1)},
       {BAR, TOKEN_DOMAIN(1)},
       {BAR_END, TOKEN_DOMAIN(1)},
@@ -207,11 +231,7 @@ public:
       {TIME_DELTA, TOKEN_DOMAIN(48)},
       {HEADER, TOKEN_DOMAIN(2)}
       });
-    config = get_encoder_config();
-  }
-  ~TrackInterleavedWHeaderEncoder() {
-    delete rep;
-    delete config;
+    return r;
   }
   EncoderConfig *get_encoder_config() {
     EncoderConfig *e = new EncoderConfig();
@@ -234,7 +254,15 @@ public:
 class TrackEncoder : public ENCODER {
 public:
   TrackEncoder() {    
-    rep = new REPRESENTATION({
+    rep = get_shared_encoder_rep();
+    config = get_encoder_config();
+  }
+  ~TrackEncoder() {
+    delete config;
+  }
+
+  REPRESENTATION *get_encoder_rep() {
+    REPRESENTATION *r = new REPRESENTATION({
       {PIECE_START, TOKEN_DOMAIN(1)},
       {BAR, TOKEN_DOMAIN(1)},
       {BAR_END, TOKEN_DOMAIN(1)},
@@ -248,11 +276,7 @@ public:
       {NOTE_ONSET, TOKEN_DOMAIN(128)},
       {TIME_DELTA, TOKEN_DOMAIN(48)},
       });
-    config = get_encoder_config();
-  }
-  ~TrackEncoder() {
-    delete rep;
-    delete config;
+    return r;
   }
   EncoderConfig *get_encoder_config() {
     EncoderConfig *e = new EncoderConfig();
@@ -274,7 +298,15 @@ public:
 class TrackNoInstEncoder : public ENCODER {
 public:
   TrackNoInstEncoder() {    
-    rep = new REPRESENTATION({
+    rep = get_shared_encoder_rep();
+    config = get_encoder_config();
+  }
+  ~TrackNoInstEncoder() {
+    delete config;
+  }
+
+  REPRESENTATION *get_encoder_rep() {
+    REPRESENTATION *r = new REPRESENTATION({
       {PIECE_START, TOKEN_DOMAIN(1)},
       {BAR, TOKEN_DOMAIN(1)},
       {BAR_END, TOKEN_DOMAIN(1)},
@@ -288,11 +320,7 @@ public:
       {NOTE_ONSET, TOKEN_DOMAIN(128)},
       {TIME_DELTA, TOKEN_DOMAIN(48)},
       });
-    config = get_encoder_config();
-  }
-  ~TrackNoInstEncoder() {
-    delete rep;
-    delete config;
+    return r;
   }
   EncoderConfig *get_encoder_config() {
     EncoderConfig *e = new EncoderConfig();
@@ -314,15 +342,19 @@ public:
 class TrackUnquantizedEncoder : public ENCODER {
 public:
   TrackUnquantizedEncoder() {    
-    rep = new REPRESENTATION({
-      {PIECE_START, TOKEN_DOMAIN(1)},
-    });
+    rep = get_shared_encoder_rep();
     config = get_encoder_config();
   }
   ~TrackUnquantizedEncoder() {
-    delete rep;
     delete config;
   }
+
+  REPRESENTATION *get_encoder_rep() {
+    REPRESENTATION *r = new REPRESENTATION({
+      {PIECE_START, TOKEN_DOMAIN(1)},
+    });
+    return r;
+  }
   EncoderConfig *get_encoder_config() {
     EncoderConfig *e = new EncoderConfig();
     e->resolution = 12;
@@ -345,7 +377,15 @@ public:
 class TrackSegmentEncoder : public ENCODER {
 public:
   TrackSegmentEncoder() {    
-    rep = new REPRESENTATION({
+    rep = get_shared_encoder_rep();
+    config = get_encoder_config();
+  }
+  ~TrackSegmentEncoder() {
+    delete config;
+  }
+
+  REPRESENTATION *get_encoder_rep() {
+    REPRESENTATION *r = new REPRESENTATION({
       {PIECE_START, TOKEN_DOMAIN(1)},
       {BAR, TOKEN_DOMAIN(1)},
       {BAR_END, TOKEN_DOMAIN(1)},
@@ -361,11 +401,7 @@ public:
       {SEGMENT, TOKEN_DOMAIN(1)},
       {SEGMENT_END, TOKEN_DOMAIN(1)},
       });
-    config = get_encoder_config();
-  }
-  ~TrackSegmentEncoder() {
-    delete rep;
-    delete config;
+    return r;
   }
   EncoderConfig *get_encoder_config() {
     EncoderConfig *e = new EncoderConfig();
@@ -392,7 +428,15 @@ public:
 class TrackNoteDurationEncoder : public ENCODER {
 public:
   TrackNoteDurationEncoder() {    
-    rep = new REPRESENTATION({
+    rep = get_shared_encoder_rep();
+    config = get_encoder_config();
+  }
+  ~TrackNoteDurationEncoder() {
+    delete config;
+  }
+
+  REPRESENTATION *get_encoder_rep() {
+    REPRESENTATION *r = new REPRESENTATION({
       {PIECE_START, TOKEN_DOMAIN(2)}, // 1 is bar infill
       {BAR, TOKEN_DOMAIN(1)},
       {BAR_END, TOKEN_DOMAIN(1)},
@@ -416,11 +460,7 @@ public:
       {TIME_SIGNATURE, TOKEN_DOMAIN(
         FOUR_FOUR_TIMESIG_MAP,TIMESIG_MAP_DOMAIN)}
       });
-    config = get_encoder_config();
-  }
-  ~TrackNoteDurationEncoder() {
-    delete rep;
-    delete config;
+    return r;
   }
   EncoderConfig *get_encoder_config() {
     EncoderConfig *e = new EncoderConfig();
@@ -449,7 +489,15 @@ public:
 class TrackNoteDurationContEncoder : public ENCODER {
 public:
   TrackNoteDurationContEncoder() {    
-    rep = new REPRESENTATION({
+    rep = get_shared_encoder_rep();
+    config = get_encoder_config();
+  }
+  ~TrackNoteDurationContEncoder() {
+    delete config;
+  }
+
+  REPRESENTATION *get_encoder_rep() {
+    REPRESENTATION *r = new REPRESENTATION({
       {PIECE_START, TOKEN_DOMAIN(2)}, // 1 is bar infill
       {BAR, TOKEN_DOMAIN(1)},
       {BAR_END, TOKEN_DOMAIN(1)},
@@ -469,11 +517,7 @@ public:
       {TIME_SIGNATURE, TOKEN_DOMAIN(
         BASIC_TIMESIG_MAP,TIMESIG_MAP_DOMAIN)}
       });
-    config = get_encoder_config();
-  }
-  ~TrackNoteDurationContEncoder() {
-    delete rep;
-    delete config;
+    return r;
   }
   EncoderConfig *get_encoder_config() {
     EncoderConfig *e = new EncoderConfig();
@@ -504,7 +548,15 @@ public:
 class TrackNoteDurationEmbedEncoder : public ENCODER {
 public:
   TrackNoteDurationEmbedEncoder() {    
-    rep = new REPRESENTATION({
+    rep = get_shared_encoder_rep();
+    config = get_encoder_config();
+  }
+  ~TrackNoteDurationEmbedEncoder() {
+    delete config;
+  }
+
+  REPRESENTATION *get_encoder_rep() {
+    REPRESENTATION *r = new REPRESENTATION({
       {PIECE_START, TOKEN_DOMAIN(2)}, // 1 is bar infill
       {BAR, TOKEN_DOMAIN(1)},
       {BAR_END, TOKEN_DOMAIN(1)},
@@ -524,11 +576,7 @@ public:
       {TIME_SIGNATURE, TOKEN_DOMAIN(
         BASIC_TIMESIG_MAP,TIMESIG_MAP_DOMAIN)}
       });
-    config = get_encoder_config();
-  }
-  ~TrackNoteDurationEmbedEncoder() {
-    delete rep;
-    delete config;
+    return r;
   }
   EncoderConfig *get_encoder_config() {
     EncoderConfig *e = new EncoderConfig();
@@ -563,7 +611,15 @@ public:
 class DensityGenreEncoder : public ENCODER {
 public:
   DensityGenreEncoder() {
-    rep = new REPRESENTATION({
+    rep = get_shared_encoder_rep();
+    config = get_encoder_config();
+  }
+  ~DensityGenreEncoder() {
+    delete config;
+  }
+
+  REPRESENTATION *get_encoder_rep() {
+    REPRESENTATION *r = new REPRESENTATION({
       {PIECE_START, TOKEN_DOMAIN(2)},
       {BAR, TOKEN_DOMAIN(1)},
       {BAR_END, TOKEN_DOMAIN(1)},
@@ -583,11 +639,7 @@ public:
       {DENSITY_LEVEL, TOKEN_DOMAIN(10)},
       {GENRE, TOKEN_DOMAIN(GENRE_MAP_DISCOGS,STRING_MAP_DOMAIN)}
     });
-    config = get_encoder_config();
-  }
-  ~DensityGenreEncoder() {
-    delete rep;
-    delete config;
+    return r;
   }
   EncoderConfig *get_encoder_config() {
     EncoderConfig *e = new EncoderConfig();
@@ -617,7 +669,15 @@ public:
 class DensityGenreTagtraumEncoder : public ENCODER {
 public:
   DensityGenreTagtraumEncoder() {
-    rep = new REPRESENTATION({
+    rep = get_shared_encoder_rep();
+    config = get_encoder_config();
+  }
+  ~DensityGenreTagtraumEncoder() {
+    delete config;
+  }
+
+  REPRESENTATION *get_encoder_rep() {
+    REPRESENTATION *r = new REPRESENTATION({
       {PIECE_START, TOKEN_DOMAIN(2)},
       {BAR, TOKEN_DOMAIN(1)},
       {BAR_END, TOKEN_DOMAIN(1)},
@@ -637,11 +697,7 @@ public:
       {DENSITY_LEVEL, TOKEN_DOMAIN(10)},
       {GENRE, TOKEN_DOMAIN(GENRE_MAP_TAGTRAUM,STRING_MAP_DOMAIN)}
     });
-    config = get_encoder_config();
-  }
-  ~DensityGenreTagtraumEncoder() {
-    delete rep;
-    delete config;
+    return r;
   }
   EncoderConfig *get_encoder_config() {
     EncoderConfig *e = new EncoderConfig();
@@ -671,7 +727,15 @@ public:
 class DensityGenreLastfmEncoder : public ENCODER {
 public:
   DensityGenreLastfmEncoder() {
-    rep = new REPRESENTATION({
+    rep = get_shared_encoder_rep();
+    config = get_encoder_config();
+  }
+  ~DensityGenreLastfmEncoder() {
+    delete config;
+  }
+
+  REPRESENTATION *get_encoder_rep() {
+    REPRESENTATION *r = new REPRESENTATION({
       {PIECE_START, TOKEN_DOMAIN(2)},
       {BAR, TOKEN_DOMAIN(1)},
       {BAR_END, TOKEN_DOMAIN(1)},
@@ -691,11 +755,7 @@ public:
       {DENSITY_LEVEL, TOKEN_DOMAIN(10)},
       {GENRE, TOKEN_DOMAIN(GENRE_MAP_LASTFM,STRING_MAP_DOMAIN)}
     });
-    config = get_encoder_config();
-  }
-  ~DensityGenreLastfmEncoder() {
-    delete rep;
-    delete config;
+    return r;
   }
   EncoderConfig *get_encoder_config() {
     EncoderConfig *e = new EncoderConfig();
@@ -731,10 +791,9 @@ class PolyphonyEncoder : public ENCODER {
 public:
   PolyphonyEncoder() {
     config = get_encoder_config();
-    rep = get_encoder_rep();
+    rep = get_shared_encoder_rep();
   }
   ~PolyphonyEncoder() {
-    delete rep;
     delete config;
   }
 
@@ -782,10 +841,9 @@ class PolyphonyDurationEncoder : public ENCODER {
 public:
   PolyphonyDurationEncoder() {
     config = get_encoder_config();
-    rep = get_encoder_rep();
+    rep = get_shared_encoder_rep();
   }
   ~PolyphonyDurationEncoder() {
-    delete rep;
     delete config;
   }
 
@@ -835,10 +893,9 @@ class DurationEncoder : public ENCODER {
 public:
   DurationEncoder() {
     config = get_encoder_config();
-    rep = get_encoder_rep();
+    rep = get_shared_encoder_rep();
   }
   ~DurationEncoder() {
-    delete rep;
     delete config;
   }
 
@@ -887,10 +944,9 @@ class NewDurationEncoder : public ENCODER {
 public:
   NewDurationEncoder() {
     config = get_encoder_config();
-    rep = get_encoder_rep();
+    rep = get_shared_encoder_rep();
   }
   ~NewDurationEncoder() {
-    delete rep;
     delete config;
   }
 
@@ -941,10 +997,9 @@ class NewVelocityEncoder : public ENCODER {
 public:
   NewVelocityEncoder() {
     config = get_encoder_config();
-    rep = get_encoder_rep();
+    rep = get_shared_encoder_rep();
   }
   ~NewVelocityEncoder() {
-    delete rep;
     delete config;
   }
 
@@ -994,10 +1049,9 @@ class AbsoluteEncoder : public ENCODER {
 public:
   AbsoluteEncoder() {
     config = get_encoder_config();
-    rep = get_encoder_rep();
+    rep = get_shared_encoder_rep();
   }
   ~AbsoluteEncoder() {
-    delete rep;
     delete config;
   }
 
@@ -1048,10 +1102,9 @@ class MultiLengthEncoder : public ENCODER {
 public:
   MultiLengthEncoder() {
     config = get_encoder_config();
-    rep = get_encoder_rep();
+    rep = get_shared_encoder_rep();
   }
   ~MultiLengthEncoder() {
-    delete rep;
     delete config;
   }
 
@@ -17,10 +17,9 @@ class EncoderVt : public ENCODER {
 public:
   EncoderVt() {
     config = get_encoder_config();
-    rep = get_encoder_rep();
+    rep = get_shared_encoder_rep();
   }
   ~EncoderVt() {
-    delete rep;
     delete config;
   }
 
@@ -136,9 +136,11 @@ class REPRESENTATION {
 public:
   REPRESENTATION(std::vector<std::pair<mmm::TOKEN_TYPE,TOKEN_DOMAIN>> spec) {
     vocab_size = 0;
+    token_type_offsets.resize(NONE + 1, 0);
     for (const auto token_domain : spec) {
       mmm::TOKEN_TYPE tt = std::get<0>(token_domain);
       TOKEN_DOMAIN domain = std::get<1>(token_domain);
+      token_type_offsets[tt] = vocab_size;
       int index = 0;
       for (const auto value : domain.map_items) {
         int token = vocab_size + std::get<1>(value);
@@ -156,6 +158,31 @@ public:
       domains.insert( std::make_pair(tt,domain.output_domain.size()) );
       token_domains.insert( std::make_pair(tt,domain) );
     }
+    // flat token --> (type, value) tables so the hot paths
+    // can avoid the map lookups
+    token_type_table.resize(vocab_size, NONE);
+    token_value_table.resize(vocab_size, 0);
+    token_input_type_table.resize(vocab_size, TI_INT);
+    for (const auto kv : backward) {
+      token_type_table[kv.first] = std::get<0>(kv.second);
+      token_input_type_table[kv.first] = backward_types[kv.first];
+      if (backward_types[kv.first] == TI_INT) {
+        token_value_table[kv.first] = std::get<int>(std::get<1>(kv.second));
+      }
+    }
+    // direct (type, int value) --> token tables for encode_int
+    int_encode_table.resize(NONE + 1);
+    for (const auto kv : forward) {
+      const TOKEN_VARIANT &v = std::get<1>(kv.first);
+      if (std::holds_alternative<int>(v) && (std::get<int>(v) >= 0)) {
+        std::vector<int> &table = int_encode_table[std::get<0>(kv.first)];
+        int value = std::get<int>(v);
+        if (value >= (int)table.size()) {
+          table.resize(value + 1, -1);
+        }
+        table[value] = kv.second;
+      }
+    }
   }
   int encode(mmm::TOKEN_TYPE tt, TOKEN_VARIANT value) {
     std::tuple<mmm::TOKEN_TYPE,TOKEN_VARIANT> key = std::make_tuple(tt,value);
@@ -174,6 +201,18 @@ public:
     }
     return it->second;
   }
+  // same as encode for integer values, without the map lookup
+  int encode_int(mmm::TOKEN_TYPE tt, int value) {
+    const std::vector<int> &table = int_encode_table[tt];
+    if ((value >= 0) && (value < (int)table.size()) && (table[value] >= 0)) {
+      return table[value];
+    }
+    return encode(tt, value);
+  }
+  // the position of a token within the domain of its type
+  int token_offset(mmm::TOKEN_TYPE tt, int token) {
+    return token - token_type_offsets[tt];
+  }
   int encode_partial(mmm::TOKEN_TYPE tt, TOKEN_VARIANT value) {
     auto it = token_domains.find(tt);
     if (it == token_domains.end()) {
@@ -195,24 +234,24 @@ public:
   }
   int decode(int token) {
     token_in_range(token);
-    if (backward_types[token] != TI_INT) {
+    if (token_input_type_table[token] != TI_INT) {
       throw std::runtime_error("TOKEN CAN NOT BE DECODED AS INT");
     }
-    return std::get<int>(std::get<1>(backward[token]));
+    return token_value_table[token];
   }
   std::string decode_string(int token) {
     token_in_range(token);
-    if (backward_types[token] != TI_STRING) {
+    if (token_input_type_table[token] != TI_STRING) {
       throw std::runtime_error("TOKEN CAN NOT BE DECODED AS STRING");
     }
-    return std::get<std::string>(std::get<1>(backward[token]));
+    return std::get<std::string>(std::get<1>(backward.at(token)));
   }
   std::tuple<int,int> decode_timesig(int token) {
     token_in_range(token);
-    if (backward_types[token] != TI_TIMESIG) {
+    if (token_input_type_table[token] != TI_TIMESIG) {
       throw std::runtime_error("TOKEN CAN NOT BE DECODED AS TIMESIG");
     }
-    return std::get<std::tuple<int,int>>(std::get<1>(backward[token]));
+    return std::get<std::tuple<int,int>>(std::get<1>(backward.at(token)));
   }
   int max_token() {
     return vocab_size;
@@ -256,8 +295,7 @@ public:
     return timesigs;
   }
   void check_token(int token) {
-    auto it = backward.find(token);
-    if (it == backward.end()) {
+    if ((token < 0) || (token >= vocab_size)) {
       std::ostringstream buffer;
       buffer << "ENCODER ERROR : TOKEN " << token << "IS NOT IN REPRESENTATION";
       throw std::runtime_error(buffer.str());
@@ -265,11 +303,11 @@ public:
   }
   bool is_token_type(int token, mmm::TOKEN_TYPE tt) {
     check_token(token);
-    return std::get<0>(backward[token]) == tt;
+    return token_type_table[token] == tt;
   }
   mmm::TOKEN_TYPE get_token_type(int token) {
     check_token(token);
-    return std::get<0>(backward[token]);
+    return token_type_table[token];
   }
   std::set<mmm::TOKEN_TYPE> get_mask_token_types(std::vector<int> &mask) {
     std::set<mmm::TOKEN_TYPE> tts;
@@ -374,8 +412,8 @@ public:
   }
 
   std::string pretty(int token) {
-    auto token_value = backward[token];
-    TOKEN_INPUT_TYPE ti = backward_types[token];
+    auto token_value = backward.at(token);
+    TOKEN_INPUT_TYPE ti = backward_types.at(token);
     return toString(std::get<0>(token_value)) + std::string(" = ") + token_variant_to_string(ti, std::get<1>(token_value));
   }
 
@@ -383,6 +421,11 @@ public:
   std::map<TOKEN_TUPLE,int> forward;
   std::map<int,TOKEN_TUPLE> backward;
   std::map<int,TOKEN_INPUT_TYPE> backward_types;
+  std::vector<mmm::TOKEN_TYPE> token_type_table;
+  std::vector<int> token_value_table;
+  std::vector<TOKEN_INPUT_TYPE> token_input_type_table;
+  std::vector<std::vector<int>> int_encode_table;
+  std::vector<int> token_type_offsets;
 
   std::map<mmm::TOKEN_TYPE,int> domains;
   std::map<mmm::TOKEN_TYPE,TOKEN_DOMAIN> token_domains;
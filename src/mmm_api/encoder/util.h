@@ -4,6 +4,7 @@
 
 #include <vector>
 #include <map>
+#include <functional>
 #include <tuple>
 #include <array>
 #include <utility>
@@ -26,7 +27,7 @@ public:
     tokens.push_back( token );
     features.push_back( empty );
   }
-  void push_back( int token, midi::ContinuousFeature feature) {
+  void push_back( int token, const midi::ContinuousFeature &feature) {
     tokens.push_back( token );
     features.push_back( feature );
   }
@@ -35,7 +36,7 @@ public:
       push_back(token);
     }
   }
-  void insert( std::vector<int> &tokens, midi::ContinuousFeature feature) {
+  void insert( std::vector<int> &tokens, const midi::ContinuousFeature &feature) {
     for (auto token : tokens) {
       push_back(token, feature);
     }
@@ -45,32 +46,71 @@ public:
   midi::ContinuousFeature empty;
 };
 
-std::vector<int> to_performance_duration(midi::Bar *bar, midi::Piece *p, REPRESENTATION *rep, int transpose, bool is_drum, EncoderConfig *ec) {
+// feature sets for the encoding and decoding kernels. RUNTIME_FEATURES
+// reads the flags from the EncoderConfig and works for every encoder.
+// STATIC_FEATURES fixes them at compile time so the checks fold away in
+// the inner loops, and is only used when the config matches.
+struct RUNTIME_FEATURES {
+  static bool matches(EncoderConfig *ec) { return true; }
+  static bool use_note_duration_encoding(EncoderConfig *ec) { return ec->use_note_duration_encoding; }
+  static bool use_absolute_time_encoding(EncoderConfig *ec) { return ec->use_absolute_time_encoding; }
+  static bool use_velocity_levels(EncoderConfig *ec) { return ec->use_velocity_levels; }
+  static bool use_drum_offsets(EncoderConfig *ec) { return ec->use_drum_offsets; }
+  static bool mark_time_sigs(EncoderConfig *ec) { return ec->mark_time_sigs; }
+  static bool interleaved(EncoderConfig *ec) { return ec->interleaved; }
+};
+
+template <bool DURATION, bool ABSOLUTE_TIME, bool VELOCITY_LEVELS, bool DRUM_OFFSETS, bool TIME_SIGS>
+struct STATIC_FEATURES {
+  static bool matches(EncoderConfig *ec) {
+    return (ec->use_note_duration_encoding == DURATION) && 
+      (ec->use_absolute_time_encoding == ABSOLUTE_TIME) && 
+      (ec->use_velocity_levels == VELOCITY_LEVELS) && 
+      (ec->use_drum_offsets == DRUM_OFFSETS) && 
+      (ec->mark_time_sigs == TIME_SIGS) && 
+      (!ec->interleaved);
+  }
+  static constexpr bool use_note_duration_encoding(EncoderConfig *ec) { return DURATION; }
+  static constexpr bool use_absolute_time_encoding(EncoderConfig *ec) { return ABSOLUTE_TIME; }
+  static constexpr bool use_velocity_levels(EncoderConfig *ec) { return VELOCITY_LEVELS; }
+  static constexpr bool use_drum_offsets(EncoderConfig *ec) { return DRUM_OFFSETS; }
+  static constexpr bool mark_time_sigs(EncoderConfig *ec) { return TIME_SIGS; }
+  static constexpr bool interleaved(EncoderConfig *ec) { return false; }
+};
+
+// used by the EL and TE velocity / duration / polyphony encoders
+using DURATION_ABSOLUTE_FEATURES = STATIC_FEATURES<true,true,true,false,true>;
+
+template <class F = RUNTIME_FEATURES>
+std::vector<int> to_performance_duration(const midi::Bar *bar, midi::Piece *p, REPRESENTATION *rep, int transpose, bool is_drum, EncoderConfig *ec) {
   std::vector<int> tokens;
+  tokens.reserve(2 * bar->events_size());
   int current_step = 0;
   int current_velocity = -1;
   int N_TIME_TOKENS = rep->get_domain_size(TIME_DELTA);
   int N_DURATION_TOKENS = rep->get_domain_size(NOTE_DURATION);
+  bool has_velocity_levels = rep->has_token_type(VELOCITY_LEVEL);
   bool added_instrument = false;
   for (const auto i : bar->events()) {
-    midi::Event event = p->events(i);
+    const midi::Event &event = p->events(i);
     if ((event.internal_duration() > 0) && (event.velocity() > 0)) {
       
       int qvel = event.velocity() > 0;
-      if (rep->has_token_type(VELOCITY_LEVEL)) {
-        qvel = rep->encode_partial(VELOCITY_LEVEL, event.velocity());
+      if (has_velocity_levels) {
+        qvel = rep->token_offset(VELOCITY_LEVEL, 
+          rep->encode_int(VELOCITY_LEVEL, event.velocity()));
       }
       if (event.time() > current_step) {
-        if (ec->use_absolute_time_encoding) {
-          tokens.push_back( rep->encode(TIME_ABSOLUTE, event.time()) );
+        if (F::use_absolute_time_encoding(ec)) {
+          tokens.push_back( rep->encode_int(TIME_ABSOLUTE, event.time()) );
         }
         else { 
           while (event.time() > current_step + N_TIME_TOKENS) {
-            tokens.push_back( rep->encode(TIME_DELTA, N_TIME_TOKENS-1) );
+            tokens.push_back( rep->encode_int(TIME_DELTA, N_TIME_TOKENS-1) );
             current_step += N_TIME_TOKENS;
           }
           if (event.time() > current_step) {
-            tokens.push_back( rep->encode(
+            tokens.push_back( rep->encode_int(
               TIME_DELTA, event.time()-current_step-1) );
           }
         }
@@ -83,19 +123,19 @@ std::vector<int> to_performance_duration(midi::Bar *bar, midi::Piece *p, REPRESE
         std::cout << "event.velocity() : " << event.velocity() << std::endl;
         throw std::runtime_error("Events are not sorted!");
       }
-      if (ec->use_velocity_levels) {
+      if (F::use_velocity_levels(ec)) {
         if ((qvel > 0) && (qvel != current_velocity)) {
-          tokens.push_back( rep->encode(VELOCITY_LEVEL, event.velocity()) );
+          tokens.push_back( rep->encode_int(VELOCITY_LEVEL, event.velocity()) );
           current_velocity = qvel;
         }
       }
       
       // instead of representing notes using onset-offset pairs
       // we have a note onset (with the pitch) and a note duration
-      tokens.push_back( rep->encode(NOTE_ONSET, event.pitch() + transpose) );
+      tokens.push_back( rep->encode_int(NOTE_ONSET, event.pitch() + transpose) );
       int duration = std::min(event.internal_duration(), N_DURATION_TOKENS);
-      if ((!is_drum) || (ec->use_drum_offsets)) {
-        tokens.push_back( rep->encode(NOTE_DURATION, duration - 1) );
+      if ((!is_drum) || (F::use_drum_offsets(ec))) {
+        tokens.push_back( rep->encode_int(NOTE_DURATION, duration - 1) );
       }
       
     }
@@ -104,31 +144,33 @@ std::vector<int> to_performance_duration(midi::Bar *bar, midi::Piece *p, REPRESE
 }
 
 
-std::vector<int> to_performance_dev(midi::Bar *bar, midi::Piece *p, REPRESENTATION *rep, int transpose, bool is_drum, EncoderConfig *ec) {
+template <class F = RUNTIME_FEATURES>
+std::vector<int> to_performance_dev(const midi::Bar *bar, midi::Piece *p, REPRESENTATION *rep, int transpose, bool is_drum, EncoderConfig *ec) {
 
-  if (ec->use_note_duration_encoding) {
-    return to_performance_duration(bar, p, rep, transpose, is_drum, ec);
+  if (F::use_note_duration_encoding(ec)) {
+    return to_performance_duration<F>(bar, p, rep, transpose, is_drum, ec);
   }
 
   std::vector<int> tokens;
+  tokens.reserve(2 * bar->events_size());
   int current_step = 0;
   int current_velocity = -1;
   int current_instrument = -1;
   int N_TIME_TOKENS = rep->get_domain_size(TIME_DELTA);
   bool added_instrument = false;
   for (const auto i : bar->events()) {
-    midi::Event event = p->events(i);
-    if ((!is_drum) || (event.velocity()>0) || (ec->use_drum_offsets)) {
+    const midi::Event &event = p->events(i);
+    if ((!is_drum) || (event.velocity()>0) || (F::use_drum_offsets(ec))) {
       //int qvel = velocity_maps[rep->velocity_map_name][event.velocity()];
       int qvel = event.velocity() > 0;
 
       if (event.time() > current_step) {
         while (event.time() > current_step + N_TIME_TOKENS) {
-          tokens.push_back( rep->encode(TIME_DELTA, N_TIME_TOKENS-1) );
+          tokens.push_back( rep->encode_int(TIME_DELTA, N_TIME_TOKENS-1) );
           current_step += N_TIME_TOKENS;
         }
         if (event.time() > current_step) {
-          tokens.push_back( rep->encode(
+          tokens.push_back( rep->encode_int(
             TIME_DELTA, event.time()-current_step-1) );
         }
         current_step = event.time();
@@ -141,25 +183,25 @@ std::vector<int> to_performance_dev(midi::Bar *bar, midi::Piece *p, REPRESENTATI
         throw std::runtime_error("Events are not sorted!");
       }
       // if the rep contains velocity levels
-      if (ec->use_velocity_levels) {
+      if (F::use_velocity_levels(ec)) {
         if ((qvel > 0) && (qvel != current_velocity)) {
-          tokens.push_back( rep->encode(VELOCITY_LEVEL, qvel) );
+          tokens.push_back( rep->encode_int(VELOCITY_LEVEL, qvel) );
           current_velocity = qvel;
         }
         qvel = std::min(1,qvel); // flatten down to binary for note
       }
       if (qvel==0) {
-        tokens.push_back( rep->encode(NOTE_OFFSET, event.pitch() + transpose) );
+        tokens.push_back( rep->encode_int(NOTE_OFFSET, event.pitch() + transpose) );
       }
       else {
-        tokens.push_back( rep->encode(NOTE_ONSET, event.pitch() + transpose) );
+        tokens.push_back( rep->encode_int(NOTE_ONSET, event.pitch() + transpose) );
       }
     }
   }
   return tokens;
 }
 
-midi::ContinuousFeature get_feature(midi::Bar &b) {
+midi::ContinuousFeature get_feature(const midi::Bar &b) {
   if (b.internal_feature_size() == 0) {
     midi::ContinuousFeature f;
     return f;
@@ -167,6 +209,7 @@ midi::ContinuousFeature get_feature(midi::Bar &b) {
   return b.internal_feature(0);
 }
 
+template <class F = RUNTIME_FEATURES>
 TokenSequence to_performance_w_tracks_dev(midi::Piece *p, REPRESENTATION *rep, EncoderConfig *e) {
 
   // make sure each bar has feature
@@ -213,7 +256,7 @@ TokenSequence to_performance_w_tracks_dev(midi::Piece *p, REPRESENTATION *rep, E
 
     for (int track_num=0; track_num<p->tracks_size(); track_num++) {
 
-      midi::Track track = p->tracks(track_num);
+      const midi::Track &track = p->tracks(track_num);
       midi::TrackFeatures *f = get_track_features(p, track_num);
 
       bool is_drum = is_drum_track( track.track_type() );
@@ -322,9 +365,9 @@ TokenSequence to_performance_w_tracks_dev(midi::Piece *p, REPRESENTATION *rep, E
           throw std::runtime_error("BAR NUMBER OUT OF RANGE!");
         }
 
-        midi::Bar bar = track.bars(bar_num);
+        const midi::Bar &bar = track.bars(bar_num);
         tokens.push_back( rep->encode(BAR, 0), get_feature(bar) );
-        if (e->mark_time_sigs) {
+        if (F::mark_time_sigs(e)) {
           //int ts = rep->encode_timesig(
           //  bar.ts_numerator(), bar.ts_denominator(),e->allow_beatlength_matches);
           int ts = rep->encode(TIME_SIGNATURE, std::make_tuple(bar.ts_numerator(), bar.ts_denominator()));
@@ -344,7 +387,7 @@ TokenSequence to_performance_w_tracks_dev(midi::Piece *p, REPRESENTATION *rep, E
           tokens.push_back( rep->encode(FILL_IN_PLACEHOLDER, 0), get_feature(bar));
         }
         else {
-          std::vector<int> bar_tokens = to_performance_dev(
+          std::vector<int> bar_tokens = to_performance_dev<F>(
             &bar, p, rep, cur_transpose, is_drum, e);
           tokens.insert( bar_tokens, get_feature(bar) );
         }
@@ -369,9 +412,9 @@ TokenSequence to_performance_w_tracks_dev(midi::Piece *p, REPRESENTATION *rep, E
       if (is_drum) {
         cur_transpose = 0;
       }
-      midi::Bar bar = p->tracks(fill_track).bars(fill_bar);
+      const midi::Bar &bar = p->tracks(fill_track).bars(fill_bar);
       tokens.push_back( rep->encode(FILL_IN_START, 0), get_feature(bar) );
-      std::vector<int> bar_tokens = to_performance_dev(
+      std::vector<int> bar_tokens = to_performance_dev<F>(
         &bar, p, rep, cur_transpose, is_drum, e);
       tokens.insert( bar_tokens, get_feature(bar) );
       tokens.push_back( rep->encode(FILL_IN_END, 0) ); // end fill-in
@@ -381,239 +424,450 @@ TokenSequence to_performance_w_tracks_dev(midi::Piece *p, REPRESENTATION *rep, E
   return tokens;
 }
 
-// fix the deconversion
-void decode_track_dev(std::vector<int> &tokens, midi::Piece *p, REPRESENTATION *rep, EncoderConfig *ec) {
-  p->set_tempo(ec->default_tempo);
-  p->set_resolution(ec->resolution);
-
-  std::map<int,int> inst_to_track;
-  midi::Event *e = NULL;
-  midi::Track *t = NULL;
-  midi::Bar *b = NULL;
-  int current_time, current_instrument, bar_start_time, current_track;
-  int beat_length = 0;
-  int track_count = 0;
-  int bar_count = 0;
-  int last_token = -1;
-  int current_velocity = 100;
-
-  std::set<int> offset_remain;
-
-  for (const auto token : tokens) {
-
-    //std::cout << "DECODING ... " << rep->pretty(token) << std::endl;
+// decodes tokens into a piece one at a time, so that a sequence which is
+// still growing is only decoded once. decode_track_dev runs the same
+// decoder over a complete sequence.
+//
+// with multi_fill, each fill-in at the end of a bar infilling sequence is
+// decoded in place of its FILL_IN_PLACEHOLDER, as resolve_bar_infill_tokens
+// does. the prompt tokens that follow a placeholder are held back until
+// its fill-in is complete.
+template <class F = RUNTIME_FEATURES>
+class IncrementalDecoder {
+public:
+  IncrementalDecoder(midi::Piece *piece, REPRESENTATION *r, EncoderConfig *c, bool mfill=false) {
+    p = piece;
+    rep = r;
+    ec = c;
+    multi_fill = mfill;
+    p->set_tempo(ec->default_tempo);
+    p->set_resolution(ec->resolution);
+
+    e = NULL;
+    t = NULL;
+    b = NULL;
+    current_time = 0;
+    current_instrument = 0;
+    beat_length = 0;
+    track_count = 0;
+    bar_count = 0;
+    last_token = -1;
+    current_velocity = 100;
+    pitch = 0;
+    bar_first_event = 0;
+    offset_remain.reserve(128);
+
+    types = rep->token_type_table.data();
+    values = rep->token_value_table.data();
+
+    num_tokens = 0;
+    fill_count = 0;
+    prompt_done = false;
+    in_fill = false;
+    fill_bar = false;
+  }
 
-    if (rep->is_token_type(token, SEGMENT)) {
-      track_count = 0; // reset track count
-      t = NULL;
-      b = NULL;
+  void push(int token) {
+    rep->check_token(token);
+    num_tokens++;
+    if (!multi_fill) {
+      decode_token(token);
+      return;
     }
-    if (rep->is_token_type(token, TRACK)) {
-      current_time = 0; // restart the time
-      current_instrument = 0; // reset instrument
-      offset_remain.clear();
-      if (track_count >= p->tracks_size()) {
-        t = p->add_tracks();
-      }
-      else {
-        t = p->mutable_tracks(track_count);
-      }
-      //t->set_is_drum( is_drum_track(rep->decode(token)) );
-      t->set_track_type( (midi::TRACK_TYPE)rep->decode(token) );
+    if (num_tokens == 1) {
+      return; // PIECE_START
     }
-    else if (rep->is_token_type(token, TRACK_END)) {
-      track_count++;
-      t = NULL;
+    if (types[token] == FILL_IN_START) {
+      // a fill-in without a placeholder is dropped
+      prompt_done = true;
+      in_fill = (fill_count < segments.size());
+      fill_bar = in_fill;
+      return;
     }
-    else if (rep->is_token_type(token, BAR)) {
-      // when we start new bar we need to decrement time of remaining offsets
-      for (const auto index : offset_remain) {
-        midi::Event *e = p->mutable_events(index);
-        e->set_time( e->time() - beat_length * p->resolution() );
+    if (!prompt_done) {
+      if (types[token] == FILL_IN_PLACEHOLDER) {
+        segments.push_back( std::vector<int>() );
       }
-      current_time = 0; // restart the time
-      beat_length = 4; // default value optionally overidden with TIME_SIGNATURE
-      if ((!ec->interleaved) && (t)) {
-        b = t->add_bars();
+      else if (segments.size()) {
+        segments.back().push_back( token );
+      }
+      else {
+        decode_token(token);
       }
-      bar_count++;
+      return;
     }
-    else if (rep->is_token_type(token, TIME_SIGNATURE)) {
-      std::tuple<int,int> ts = rep->decode_timesig(token);
-      beat_length = 4 * std::get<0>(ts) / std::get<1>(ts);
+    if (!in_fill) {
+      return; // tokens between the fill-ins are not part of the piece
     }
-    else if (rep->is_token_type(token, BAR_END)) {
-      if (b) {
-        b->set_internal_beat_length(beat_length);
+    if (types[token] == FILL_IN_END) {
+      in_fill = false;
+      for (const auto x : segments[fill_count]) {
+        decode_token(x);
       }
-      current_time = beat_length * p->resolution();
-      //b = NULL;
+      fill_count++;
+      return;
     }
-    else if (rep->is_token_type(token, TIME_DELTA)) {
-      current_time += (rep->decode(token) + 1);
-    }
-    else if (rep->is_token_type(token, TIME_ABSOLUTE)) {
-      current_time = rep->decode(token); // simply update instead of increment
+    decode_token(token);
+  }
+
+  void push(const std::vector<int> &tokens) {
+    for (const auto token : tokens) {
+      push(token);
     }
-    else if (rep->is_token_type(token, INSTRUMENT)) {
-        
-      // if we are in track interleaved mode
-      // we need to retrive track from instrument
-      if (ec->interleaved) {
-        current_instrument = rep->decode(token);
-        auto it = inst_to_track.find( current_instrument );
-        if (it != inst_to_track.end()) {
-          t = p->mutable_tracks(it->second);
+  }
+
+  void decode_token(int token) {
+
+    //std::cout << "DECODING ... " << rep->pretty(token) << std::endl;
+
+    switch (types[token]) {
+      case SEGMENT: {
+        track_count = 0; // reset track count
+        t = NULL;
+        b = NULL;
+        break;
+      }
+      case TRACK: {
+        current_time = 0; // restart the time
+        current_instrument = 0; // reset instrument
+        offset_remain.clear();
+        if (track_count >= p->tracks_size()) {
+          t = p->add_tracks();
         }
         else {
-          inst_to_track[current_instrument] = track_count;
-          t = p->add_tracks();
-          t->set_instrument( current_instrument % 128 );
-          if (current_instrument >= 128) {
-            //t->set_is_drum( true );
-            t->set_track_type( midi::TRACK_TYPE::STANDARD_DRUM_TRACK );
-          }
-          else {
-            //t->set_is_drum( false );
-            t->set_track_type( midi::TRACK_TYPE::STANDARD_TRACK );
-          }
-          track_count++;
+          t = p->mutable_tracks(track_count);
         }
-        // add bars and get current bar
-        int curr_bars = t->bars_size();
-        for (int n=curr_bars; n<bar_count; n++) {
+        t->set_track_type( (midi::TRACK_TYPE)values[token] );
+        break;
+      }
+      case TRACK_END: {
+        track_count++;
+        t = NULL;
+        break;
+      }
+      case BAR: {
+        bar_first_event = p->events_size();
+        // when we start new bar we need to decrement time of remaining offsets
+        for (const auto index : offset_remain) {
+          midi::Event *e = p->mutable_events(index);
+          e->set_time( e->time() - beat_length * p->resolution() );
+        }
+        current_time = 0; // restart the time
+        beat_length = 4; // default value optionally overidden with TIME_SIGNATURE
+        if ((!F::interleaved(ec)) && (t)) {
           b = t->add_bars();
-          b->set_internal_beat_length( 4 ); // set to default
         }
-        b = t->mutable_bars(bar_count-1); // make sure to get right bar
+        bar_count++;
+        break;
       }
-      else if (t) {
-        current_instrument = rep->decode(token);
-        t->set_instrument( current_instrument );
+      case TIME_SIGNATURE: {
+        std::tuple<int,int> ts = rep->decode_timesig(token);
+        beat_length = 4 * std::get<0>(ts) / std::get<1>(ts);
+        break;
       }
-    }
-    else if (rep->is_token_type(token, VELOCITY_LEVEL)) {
-      current_velocity = rep->decode(token);
-    }
-    else if (rep->is_token_type(token, NOTE_ONSET) || rep->is_token_type(token, NOTE_OFFSET)) {
-      if (b && t) {
-        
-        if (!ec->use_note_duration_encoding) {
-          int current_note_index = p->events_size();
-          e = p->add_events();
-          e->set_pitch( rep->decode(token) );
-          e->set_velocity( current_velocity );
-          if (rep->is_token_type(token, NOTE_OFFSET)) {
+      case BAR_END: {
+        if (b) {
+          b->set_internal_beat_length(beat_length);
+        }
+        current_time = beat_length * p->resolution();
+        break;
+      }
+      case TIME_DELTA: {
+        current_time += (values[token] + 1);
+        break;
+      }
+      case TIME_ABSOLUTE: {
+        current_time = values[token]; // simply update instead of increment
+        break;
+      }
+      case INSTRUMENT: {
+        // if we are in track interleaved mode
+        // we need to retrive track from instrument
+        if (F::interleaved(ec)) {
+          current_instrument = values[token];
+          auto it = inst_to_track.find( current_instrument );
+          if (it != inst_to_track.end()) {
+            t = p->mutable_tracks(it->second);
+          }
+          else {
+            inst_to_track[current_instrument] = track_count;
+            t = p->add_tracks();
+            t->set_instrument( current_instrument % 128 );
+            if (current_instrument >= 128) {
+              t->set_track_type( midi::TRACK_TYPE::STANDARD_DRUM_TRACK );
+            }
+            else {
+              t->set_track_type( midi::TRACK_TYPE::STANDARD_TRACK );
+            }
+            track_count++;
+          }
+          // add bars and get current bar
+          int curr_bars = t->bars_size();
+          for (int n=curr_bars; n<bar_count; n++) {
+            b = t->add_bars();
+            b->set_internal_beat_length( 4 ); // set to default
+          }
+          b = t->mutable_bars(bar_count-1); // make sure to get right bar
+        }
+        else if (t) {
+          current_instrument = values[token];
+          t->set_instrument( current_instrument );
+        }
+        break;
+      }
+      case VELOCITY_LEVEL: {
+        current_velocity = values[token];
+        break;
+      }
+      case NOTE_ONSET:
+      case NOTE_OFFSET: {
+        if (b && t) {
+          pitch = values[token];
+          if (!F::use_note_duration_encoding(ec)) {
+            b->add_events( p->events_size() );
+            e = p->add_events();
+            e->set_pitch( pitch );
+            e->set_velocity( current_velocity );
+            if (types[token] == NOTE_OFFSET) {
+              e->set_velocity( 0 );
+            }
+            e->set_time( current_time );
+            b->set_internal_has_notes( true );
+          }
+          else if ((!F::use_drum_offsets(ec)) && (is_drum_track(t->track_type()))) {
+            b->add_events( p->events_size() );
+            e = p->add_events();
+            e->set_pitch( pitch );
+            e->set_velocity( current_velocity );
+            e->set_time( current_time );
+
+            b->add_events( p->events_size() );
+            e = p->add_events();
+            e->set_pitch( pitch );
             e->set_velocity( 0 );
+            e->set_time( current_time + 1 );
+            b->set_internal_has_notes( true );
           }
-          e->set_time( current_time );
-          b->add_events( current_note_index );
-          b->set_internal_has_notes( true );
         }
-        else if ((ec->use_note_duration_encoding) && (!ec->use_drum_offsets) && (is_drum_track(t->track_type()))) {
-          
-          int current_note_index = p->events_size();
+        break;
+      }
+      case NOTE_DURATION: {
+        if (b && t && (last_token >= 0) && (types[last_token] == NOTE_ONSET)) {
+          pitch = values[last_token];
+
+          // add onset
+          b->add_events( p->events_size() );
           e = p->add_events();
-          e->set_pitch( rep->decode(token) );
+          e->set_pitch( pitch );
           e->set_velocity( current_velocity );
           e->set_time( current_time );
-          b->add_events( current_note_index );
-          b->set_internal_has_notes( true );
 
-          current_note_index = p->events_size();
+          // add offset
+          int current_note_index = p->events_size();
           e = p->add_events();
-          e->set_pitch( rep->decode(token) );
+          e->set_pitch( pitch );
           e->set_velocity( 0 );
-          e->set_time( current_time + 1 );
-          b->add_events( current_note_index );
-          b->set_internal_has_notes( true );
+          e->set_time( current_time + values[token] + 1 );
+
+          if (e->time() <= beat_length * p->resolution()) {
+            b->add_events( current_note_index );
+          }
+          else {
+            // we need to add this to a later bar
+            offset_remain.push_back( current_note_index );
+          }
 
+          b->set_internal_has_notes( true );
+        }
+        break;
+      }
+      case GENRE: {
+        midi::TrackFeatures *f;
+        if (!t->internal_features_size()) {
+          f = t->add_internal_features(); 
+        }
+        else {
+          f = t->mutable_internal_features(0);
         }
+        f->set_genre_str( rep->decode_string(token) );
+        break;
       }
+      default: break;
     }
-    else if (rep->is_token_type(token, NOTE_DURATION)) {
-      if (b && t && (last_token >= 0) && (rep->is_token_type(last_token, NOTE_ONSET))) {
 
-        // add onset
-        int current_note_index = p->events_size();
-        e = p->add_events();
-        e->set_pitch( rep->decode(last_token) );
-        e->set_velocity( current_velocity );
-        e->set_time( current_time );
-        b->add_events( current_note_index );
-
-        // add offset
-        current_note_index = p->events_size();
-        e = p->add_events();
-        e->set_pitch( rep->decode(last_token) );
-        e->set_velocity( 0 );
-        e->set_time( current_time + rep->decode(token) + 1 );
-
-        if (e->time() <= beat_length * p->resolution()) {
-          b->add_events( current_note_index );
+    // insert offsets from note_duration tokens when possible
+    if (offset_remain.size()) {
+      auto it = offset_remain.begin();
+      for (const auto index : offset_remain) {
+        if (p->events(index).time() <= current_time) {
+          b->add_events( index );
         }
         else {
-          // we need to add this to a later bar
-          offset_remain.insert( current_note_index );
+          *it++ = index;
         }
-
-        b->set_internal_has_notes( true );
       }
+      offset_remain.erase(it, offset_remain.end());
     }
-    else if (rep->is_token_type(token, GENRE)) {
-      midi::TrackFeatures *f;
-      if (!t->internal_features_size()) {
-        f = t->add_internal_features(); 
+
+    // the events of the bar are final once its BAR_END has been decoded
+    if ((types[token] == BAR_END) && (on_bar) && (t) && (b) && (!F::interleaved(ec))) {
+      if ((!multi_fill) || (fill_bar)) {
+        on_bar(track_count, t->bars_size() - 1);
       }
-      else {
-        f = t->mutable_internal_features(0);
+    }
+    if (types[token] == BAR_END) {
+      fill_bar = false;
+    }
+
+    last_token = token;
+  }
+
+  // finish the piece once all the tokens have been pushed
+  void finish() {
+    // prompt tokens after a placeholder whose fill-in never arrived
+    for (; fill_count<segments.size(); fill_count++) {
+      for (const auto x : segments[fill_count]) {
+        decode_token(x);
       }
-      f->set_genre_str( rep->decode_string(token) );
     }
 
-    // insert offsets from note_duration tokens when possible
-    std::vector<int> to_remove;
-    for (const auto index : offset_remain) {
-      if (p->events(index).time() <= current_time) {
-        b->add_events( index );
-        to_remove.push_back( index );
+    p->add_internal_valid_segments(0);
+    p->add_internal_valid_tracks((1<<p->tracks_size())-1);
+
+    // add extra bars if needed ...
+    if (F::interleaved(ec)) {
+      for (int track_num=0; track_num<p->tracks_size(); track_num++) {
+        t = p->mutable_tracks(track_num);
+        int curr_bars = t->bars_size();
+        for (int n=curr_bars; n<bar_count; n++) {
+          t->add_bars();
+        }
       }
     }
-    for (const auto index : to_remove) {
-      offset_remain.erase(index);
+
+    // for debug
+    /*
+    int track_num = 0;
+    for (const auto track : p->tracks()) {
+      int bar_num = 0;
+      for (const auto bar : track.bars()) {
+        std::cout << "TRACK " << track_num << " BAR " << bar_num << " " << bar.events_size() << std::endl;
+        bar_num++;
+      }
+      track_num++;
     }
+    */
 
-    last_token = token;
+    // update note density
+    update_note_density(p);
   }
-  p->add_internal_valid_segments(0);
-  p->add_internal_valid_tracks((1<<p->tracks_size())-1);
 
-  // add extra bars if needed ...
-  if (ec->interleaved) {
-    for (int track_num=0; track_num<p->tracks_size(); track_num++) {
-      t = p->mutable_tracks(track_num);
-      int curr_bars = t->bars_size();
-      for (int n=curr_bars; n<bar_count; n++) {
-        t->add_bars();
+  // copies the bar that has just been completed into out, as a piece with a
+  // single track and a single bar. only valid inside on_bar. the offsets of
+  // notes that ring past the end of the bar are kept with their onset.
+  void copy_bar(int track_num, int bar_num, midi::Piece *out) {
+    const midi::Track &track = p->tracks(track_num);
+    const midi::Bar &bar = track.bars(bar_num);
+    out->set_tempo( p->tempo() );
+    out->set_resolution( p->resolution() );
+    midi::Track *ot = out->add_tracks();
+    ot->set_track_type( track.track_type() );
+    ot->set_instrument( track.instrument() );
+    ot->mutable_internal_features()->CopyFrom( track.internal_features() );
+    midi::Bar *ob = ot->add_bars();
+    ob->CopyFrom( bar );
+    ob->clear_events();
+    for (const auto index : bar.events()) {
+      ob->add_events( out->events_size() );
+      out->add_events()->CopyFrom( p->events(index) );
+    }
+    for (const auto index : offset_remain) {
+      if (index >= bar_first_event) {
+        ob->add_events( out->events_size() );
+        out->add_events()->CopyFrom( p->events(index) );
       }
     }
   }
 
-  // for debug
-  /*
-  int track_num = 0;
-  for (const auto track : p->tracks()) {
-    int bar_num = 0;
-    for (const auto bar : track.bars()) {
-      std::cout << "TRACK " << track_num << " BAR " << bar_num << " " << bar.events_size() << std::endl;
-      bar_num++;
+  midi::Piece *p;
+  REPRESENTATION *rep;
+  EncoderConfig *ec;
+  bool multi_fill;
+
+  std::map<int,int> inst_to_track;
+  midi::Event *e;
+  midi::Track *t;
+  midi::Bar *b;
+  int current_time;
+  int current_instrument;
+  int beat_length;
+  int track_count;
+  int bar_count;
+  int last_token;
+  int current_velocity;
+  int pitch;
+  int bar_first_event;
+
+  // event indices are added in increasing order so the vector stays sorted
+  std::vector<int> offset_remain;
+
+  const mmm::TOKEN_TYPE *types;
+  const int *values;
+
+  int num_tokens; // number of tokens pushed so far
+  std::vector<std::vector<int>> segments; // prompt after each placeholder
+  int fill_count;
+  bool prompt_done;
+  bool in_fill;
+  bool fill_bar;
+
+  // called with the (track,bar) of each bar when its BAR_END is decoded.
+  // with multi_fill only the filled bars are reported.
+  std::function<void(int,int)> on_bar;
+};
+
+// fix the deconversion
+template <class F = RUNTIME_FEATURES>
+void decode_track_dev(std::vector<int> &tokens, midi::Piece *p, REPRESENTATION *rep, EncoderConfig *ec) {
+
+  // validate the tokens and reserve space for the events up front
+  int num_note_tokens = 0;
+  for (const auto token : tokens) {
+    rep->check_token(token);
+    switch (rep->token_type_table[token]) {
+      case NOTE_ONSET:
+      case NOTE_OFFSET:
+      case NOTE_DURATION: num_note_tokens++; break;
+      default: break;
     }
-    track_num++;
   }
-  */
-  
-  // update note density
-  update_note_density(p);
+  p->mutable_events()->Reserve(p->events_size() + 2 * num_note_tokens);
+
+  IncrementalDecoder<F> decoder(p, rep, ec);
+  for (const auto token : tokens) {
+    decoder.decode_token(token);
+  }
+  decoder.finish();
+}
+
+// use the kernels specialized for F when the config matches it, and the
+// runtime kernels otherwise
+template <class F>
+TokenSequence encode_kernel_dispatch(midi::Piece *p, REPRESENTATION *rep, EncoderConfig *ec) {
+  if (F::matches(ec)) {
+    return to_performance_w_tracks_dev<F>(p, rep, ec);
+  }
+  return to_performance_w_tracks_dev(p, rep, ec);
+}
+
+template <class F>
+void decode_kernel_dispatch(std::vector<int> &tokens, midi::Piece *p, REPRESENTATION *rep, EncoderConfig *ec) {
+  if (F::matches(ec)) {
+    decode_track_dev<F>(tokens, p, rep, ec);
+  }
+  else {
+    decode_track_dev(tokens, p, rep, ec);
+  }
 }
 
 std::vector<int> to_interleaved_performance_inner(std::vector<midi::Event> &events, REPRESENTATION *rep, EncoderConfig *ec) {
@@ -0,0 +1,17 @@
+#pragma once
+
+
+// START OF NAMESPACE
+namespace mmm {
+
+// how a call to sample_w_debug ended. when sampling stops early the piece
+// holds the bars of the generation steps that were completed.
+enum SAMPLE_STATUS {
+  SAMPLE_COMPLETE,
+  SAMPLE_MAX_STEPS, // at least one step hit SampleParam.max_steps
+  SAMPLE_CANCELLED,
+  SAMPLE_DEADLINE_EXCEEDED,
+};
+
+}
+// END OF NAMESPACE
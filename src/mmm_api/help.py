@@ -137,6 +137,8 @@ def build_py_encoder_class(name):
   .def("json_to_tokens", &{name}::json_to_tokens)
   .def("tokens_to_json", &{name}::tokens_to_json)
   .def("tokens_to_midi", &{name}::tokens_to_midi)
+  .def("encode_batch", &{name}::encode_batch_py)
+  .def("decode_batch", &{name}::decode_batch_py)
   .def_readwrite("config", &{name}::config)
   .def_readwrite("rep", &{name}::rep);\n\n"""
   cname = "".join([w.capitalize() for w in name.split("_")])
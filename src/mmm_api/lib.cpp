@@ -7,6 +7,7 @@ namespace py = pybind11;
 #include "dataset/jagged.h"
 #include "encoder/encoder_all.h"
 #include "enum/model_type.h"
+#include "enum/sample_status.h"
 #include "sampling/control.h"
 #include "sampling/util.h"
 #include "version.h"
@@ -44,6 +45,8 @@ std::string generate_py(std::string &status_str, std::string &piece_str, std::st
 namespace mmm {
 void generate_py() { }
 void sample_multi_step_py() { }
+void sample_multi_step_w_status_py() { }
+void set_inference_threads() { }
 }
 #endif
 
@@ -77,8 +80,10 @@ PYBIND11_MODULE(mmm_api,m) {
   m.def("gm_inst_to_string", &mmm::gm_inst_to_string);
 
   m.def("generate", &mmm::generate_py);
+  m.def("set_inference_threads", &mmm::set_inference_threads);
 
   m.def("sample_multi_step", &mmm::sample_multi_step_py);
+  m.def("sample_multi_step_w_status", &mmm::sample_multi_step_w_status_py);
   m.def("piece_to_status", &mmm::piece_to_status_py);
   m.def("default_sample_param", &mmm::default_sample_param_py);
   m.def("print_piece_summary", &mmm::print_piece_summary_py);
@@ -92,6 +97,13 @@ PYBIND11_MODULE(mmm_api,m) {
     .value("BAR_INFILL_MODEL", mmm::MODEL_TYPE::BAR_INFILL_MODEL)
     .export_values();
 
+  py::enum_<mmm::SAMPLE_STATUS>(m, "SAMPLE_STATUS", py::arithmetic())
+    .value("SAMPLE_COMPLETE", mmm::SAMPLE_STATUS::SAMPLE_COMPLETE)
+    .value("SAMPLE_MAX_STEPS", mmm::SAMPLE_STATUS::SAMPLE_MAX_STEPS)
+    .value("SAMPLE_CANCELLED", mmm::SAMPLE_STATUS::SAMPLE_CANCELLED)
+    .value("SAMPLE_DEADLINE_EXCEEDED", mmm::SAMPLE_STATUS::SAMPLE_DEADLINE_EXCEEDED)
+    .export_values();
+
   py::class_<mmm::Jagged>(m, "Jagged")
     .def(py::init<std::string &>())
     .def("set_seed", &mmm::Jagged::set_seed)
@@ -99,12 +111,14 @@ PYBIND11_MODULE(mmm_api,m) {
     .def("set_min_tracks", &mmm::Jagged::set_min_tracks)
     .def("set_max_tracks", &mmm::Jagged::set_max_tracks)
     .def("set_max_seq_len", &mmm::Jagged::set_max_seq_len)
+    .def("set_chunk_bars", &mmm::Jagged::set_chunk_bars)
     .def("enable_write", &mmm::Jagged::enable_write)
     .def("enable_read", &mmm::Jagged::enable_read)
     .def("append", &mmm::Jagged::append)
     .def("read", &mmm::Jagged::read)
     .def("read_bytes", &mmm::Jagged::read_bytes)
     .def("read_json", &mmm::Jagged::read_json)
+    .def("read_segment_bytes", &mmm::Jagged::read_segment_bytes)
     .def("read_batch", &mmm::Jagged::read_batch)
     .def("read_batch_v2", &mmm::Jagged::read_batch_v2)
     .def("read_batch_w_feature", &mmm::Jagged::read_batch_w_feature)
@@ -294,6 +308,8 @@ py::class_<mmm::TeTrackDensityEncoder>(m, "TeTrackDensityEncoder")
   .def("json_to_tokens", &mmm::TeTrackDensityEncoder::json_to_tokens)
   .def("tokens_to_json", &mmm::TeTrackDensityEncoder::tokens_to_json)
   .def("tokens_to_midi", &mmm::TeTrackDensityEncoder::tokens_to_midi)
+  .def("encode_batch", &mmm::TeTrackDensityEncoder::encode_batch_py)
+  .def("decode_batch", &mmm::TeTrackDensityEncoder::decode_batch_py)
   .def_readwrite("config", &mmm::TeTrackDensityEncoder::config)
   .def_readwrite("rep", &mmm::TeTrackDensityEncoder::rep);
 
@@ -309,6 +325,8 @@ py::class_<mmm::TrackDensityEncoderV2>(m, "TrackDensityEncoderV2")
   .def("json_to_tokens", &mmm::TrackDensityEncoderV2::json_to_tokens)
   .def("tokens_to_json", &mmm::TrackDensityEncoderV2::tokens_to_json)
   .def("tokens_to_midi", &mmm::TrackDensityEncoderV2::tokens_to_midi)
+  .def("encode_batch", &mmm::TrackDensityEncoderV2::encode_batch_py)
+  .def("decode_batch", &mmm::TrackDensityEncoderV2::decode_batch_py)
   .def_readwrite("config", &mmm::TrackDensityEncoderV2::config)
   .def_readwrite("rep", &mmm::TrackDensityEncoderV2::rep);
 
@@ -324,6 +342,8 @@ py::class_<mmm::TrackInterleavedEncoder>(m, "TrackInterleavedEncoder")
   .def("json_to_tokens", &mmm::TrackInterleavedEncoder::json_to_tokens)
   .def("tokens_to_json", &mmm::TrackInterleavedEncoder::tokens_to_json)
   .def("tokens_to_midi", &mmm::TrackInterleavedEncoder::tokens_to_midi)
+  .def("encode_batch", &mmm::TrackInterleavedEncoder::encode_batch_py)
+  .def("decode_batch", &mmm::TrackInterleavedEncoder::decode_batch_py)
   .def_readwrite("config", &mmm::TrackInterleavedEncoder::config)
   .def_readwrite("rep", &mmm::TrackInterleavedEncoder::rep);
 
@@ -339,6 +359,8 @@ py::class_<mmm::TrackInterleavedWHeaderEncoder>(m, "TrackInterleavedWHeaderEncod
   .def("json_to_tokens", &mmm::TrackInterleavedWHeaderEncoder::json_to_tokens)
   .def("tokens_to_json", &mmm::TrackInterleavedWHeaderEncoder::tokens_to_json)
   .def("tokens_to_midi", &mmm::TrackInterleavedWHeaderEncoder::tokens_to_midi)
+  .def("encode_batch", &mmm::TrackInterleavedWHeaderEncoder::encode_batch_py)
+  .def("decode_batch", &mmm::TrackInterleavedWHeaderEncoder::decode_batch_py)
   .def_readwrite("config", &mmm::TrackInterleavedWHeaderEncoder::config)
   .def_readwrite("rep", &mmm::TrackInterleavedWHeaderEncoder::rep);
 
@@ -354,6 +376,8 @@ py::class_<mmm::TrackEncoder>(m, "TrackEncoder")
   .def("json_to_tokens", &mmm::TrackEncoder::json_to_tokens)
   .def("tokens_to_json", &mmm::TrackEncoder::tokens_to_json)
   .def("tokens_to_midi", &mmm::TrackEncoder::tokens_to_midi)
+  .def("encode_batch", &mmm::TrackEncoder::encode_batch_py)
+  .def("decode_batch", &mmm::TrackEncoder::decode_batch_py)
   .def_readwrite("config", &mmm::TrackEncoder::config)
   .def_readwrite("rep", &mmm::TrackEncoder::rep);
 
@@ -369,6 +393,8 @@ py::class_<mmm::TrackNoInstEncoder>(m, "TrackNoInstEncoder")
   .def("json_to_tokens", &mmm::TrackNoInstEncoder::json_to_tokens)
   .def("tokens_to_json", &mmm::TrackNoInstEncoder::tokens_to_json)
   .def("tokens_to_midi", &mmm::TrackNoInstEncoder::tokens_to_midi)
+  .def("encode_batch", &mmm::TrackNoInstEncoder::encode_batch_py)
+  .def("decode_batch", &mmm::TrackNoInstEncoder::decode_batch_py)
   .def_readwrite("config", &mmm::TrackNoInstEncoder::config)
   .def_readwrite("rep", &mmm::TrackNoInstEncoder::rep);
 
@@ -384,6 +410,8 @@ py::class_<mmm::TrackUnquantizedEncoder>(m, "TrackUnquantizedEncoder")
   .def("json_to_tokens", &mmm::TrackUnquantizedEncoder::json_to_tokens)
   .def("tokens_to_json", &mmm::TrackUnquantizedEncoder::tokens_to_json)
   .def("tokens_to_midi", &mmm::TrackUnquantizedEncoder::tokens_to_midi)
+  .def("encode_batch", &mmm::TrackUnquantizedEncoder::encode_batch_py)
+  .def("decode_batch", &mmm::TrackUnquantizedEncoder::decode_batch_py)
   .def_readwrite("config", &mmm::TrackUnquantizedEncoder::config)
   .def_readwrite("rep", &mmm::TrackUnquantizedEncoder::rep);
 
@@ -399,6 +427,8 @@ py::class_<mmm::TrackDensityEncoder>(m, "TrackDensityEncoder")
   .def("json_to_tokens", &mmm::TrackDensityEncoder::json_to_tokens)
   .def("tokens_to_json", &mmm::TrackDensityEncoder::tokens_to_json)
   .def("tokens_to_midi", &mmm::TrackDensityEncoder::tokens_to_midi)
+  .def("encode_batch", &mmm::TrackDensityEncoder::encode_batch_py)
+  .def("decode_batch", &mmm::TrackDensityEncoder::decode_batch_py)
   .def_readwrite("config", &mmm::TrackDensityEncoder::config)
   .def_readwrite("rep", &mmm::TrackDensityEncoder::rep);
 
@@ -414,6 +444,8 @@ py::class_<mmm::TrackBarFillDensityEncoder>(m, "TrackBarFillDensityEncoder")
   .def("json_to_tokens", &mmm::TrackBarFillDensityEncoder::json_to_tokens)
   .def("tokens_to_json", &mmm::TrackBarFillDensityEncoder::tokens_to_json)
   .def("tokens_to_midi", &mmm::TrackBarFillDensityEncoder::tokens_to_midi)
+  .def("encode_batch", &mmm::TrackBarFillDensityEncoder::encode_batch_py)
+  .def("decode_batch", &mmm::TrackBarFillDensityEncoder::decode_batch_py)
   .def_readwrite("config", &mmm::TrackBarFillDensityEncoder::config)
   .def_readwrite("rep", &mmm::TrackBarFillDensityEncoder::rep);
 
@@ -429,6 +461,8 @@ py::class_<mmm::TrackNoteDurationEncoder>(m, "TrackNoteDurationEncoder")
   .def("json_to_tokens", &mmm::TrackNoteDurationEncoder::json_to_tokens)
   .def("tokens_to_json", &mmm::TrackNoteDurationEncoder::tokens_to_json)
   .def("tokens_to_midi", &mmm::TrackNoteDurationEncoder::tokens_to_midi)
+  .def("encode_batch", &mmm::TrackNoteDurationEncoder::encode_batch_py)
+  .def("decode_batch", &mmm::TrackNoteDurationEncoder::decode_batch_py)
   .def_readwrite("config", &mmm::TrackNoteDurationEncoder::config)
   .def_readwrite("rep", &mmm::TrackNoteDurationEncoder::rep);
 
@@ -444,6 +478,8 @@ py::class_<mmm::TrackNoteDurationContEncoder>(m, "TrackNoteDurationContEncoder")
   .def("json_to_tokens", &mmm::TrackNoteDurationContEncoder::json_to_tokens)
   .def("tokens_to_json", &mmm::TrackNoteDurationContEncoder::tokens_to_json)
   .def("tokens_to_midi", &mmm::TrackNoteDurationContEncoder::tokens_to_midi)
+  .def("encode_batch", &mmm::TrackNoteDurationContEncoder::encode_batch_py)
+  .def("decode_batch", &mmm::TrackNoteDurationContEncoder::decode_batch_py)
   .def_readwrite("config", &mmm::TrackNoteDurationContEncoder::config)
   .def_readwrite("rep", &mmm::TrackNoteDurationContEncoder::rep);
 
@@ -459,6 +495,8 @@ py::class_<mmm::TrackNoteDurationEmbedEncoder>(m, "TrackNoteDurationEmbedEncoder
   .def("json_to_tokens", &mmm::TrackNoteDurationEmbedEncoder::json_to_tokens)
   .def("tokens_to_json", &mmm::TrackNoteDurationEmbedEncoder::tokens_to_json)
   .def("tokens_to_midi", &mmm::TrackNoteDurationEmbedEncoder::tokens_to_midi)
+  .def("encode_batch", &mmm::TrackNoteDurationEmbedEncoder::encode_batch_py)
+  .def("decode_batch", &mmm::TrackNoteDurationEmbedEncoder::decode_batch_py)
   .def_readwrite("config", &mmm::TrackNoteDurationEmbedEncoder::config)
   .def_readwrite("rep", &mmm::TrackNoteDurationEmbedEncoder::rep);
 
@@ -474,6 +512,8 @@ py::class_<mmm::DensityGenreEncoder>(m, "DensityGenreEncoder")
   .def("json_to_tokens", &mmm::DensityGenreEncoder::json_to_tokens)
   .def("tokens_to_json", &mmm::DensityGenreEncoder::tokens_to_json)
   .def("tokens_to_midi", &mmm::DensityGenreEncoder::tokens_to_midi)
+  .def("encode_batch", &mmm::DensityGenreEncoder::encode_batch_py)
+  .def("decode_batch", &mmm::DensityGenreEncoder::decode_batch_py)
   .def_readwrite("config", &mmm::DensityGenreEncoder::config)
   .def_readwrite("rep", &mmm::DensityGenreEncoder::rep);
 
@@ -489,6 +529,8 @@ py::class_<mmm::DensityGenreTagtraumEncoder>(m, "DensityGenreTagtraumEncoder")
   .def("json_to_tokens", &mmm::DensityGenreTagtraumEncoder::json_to_tokens)
   .def("tokens_to_json", &mmm::DensityGenreTagtraumEncoder::tokens_to_json)
   .def("tokens_to_midi", &mmm::DensityGenreTagtraumEncoder::tokens_to_midi)
+  .def("encode_batch", &mmm::DensityGenreTagtraumEncoder::encode_batch_py)
+  .def("decode_batch", &mmm::DensityGenreTagtraumEncoder::decode_batch_py)
   .def_readwrite("config", &mmm::DensityGenreTagtraumEncoder::config)
   .def_readwrite("rep", &mmm::DensityGenreTagtraumEncoder::rep);
 
@@ -504,6 +546,8 @@ py::class_<mmm::DensityGenreLastfmEncoder>(m, "DensityGenreLastfmEncoder")
   .def("json_to_tokens", &mmm::DensityGenreLastfmEncoder::json_to_tokens)
   .def("tokens_to_json", &mmm::DensityGenreLastfmEncoder::tokens_to_json)
   .def("tokens_to_midi", &mmm::DensityGenreLastfmEncoder::tokens_to_midi)
+  .def("encode_batch", &mmm::DensityGenreLastfmEncoder::encode_batch_py)
+  .def("decode_batch", &mmm::DensityGenreLastfmEncoder::decode_batch_py)
   .def_readwrite("config", &mmm::DensityGenreLastfmEncoder::config)
   .def_readwrite("rep", &mmm::DensityGenreLastfmEncoder::rep);
 
@@ -519,6 +563,8 @@ py::class_<mmm::PolyphonyEncoder>(m, "PolyphonyEncoder")
   .def("json_to_tokens", &mmm::PolyphonyEncoder::json_to_tokens)
   .def("tokens_to_json", &mmm::PolyphonyEncoder::tokens_to_json)
   .def("tokens_to_midi", &mmm::PolyphonyEncoder::tokens_to_midi)
+  .def("encode_batch", &mmm::PolyphonyEncoder::encode_batch_py)
+  .def("decode_batch", &mmm::PolyphonyEncoder::decode_batch_py)
   .def_readwrite("config", &mmm::PolyphonyEncoder::config)
   .def_readwrite("rep", &mmm::PolyphonyEncoder::rep);
 
@@ -534,6 +580,8 @@ py::class_<mmm::PolyphonyDurationEncoder>(m, "PolyphonyDurationEncoder")
   .def("json_to_tokens", &mmm::PolyphonyDurationEncoder::json_to_tokens)
   .def("tokens_to_json", &mmm::PolyphonyDurationEncoder::tokens_to_json)
   .def("tokens_to_midi", &mmm::PolyphonyDurationEncoder::tokens_to_midi)
+  .def("encode_batch", &mmm::PolyphonyDurationEncoder::encode_batch_py)
+  .def("decode_batch", &mmm::PolyphonyDurationEncoder::decode_batch_py)
   .def_readwrite("config", &mmm::PolyphonyDurationEncoder::config)
   .def_readwrite("rep", &mmm::PolyphonyDurationEncoder::rep);
 
@@ -549,6 +597,8 @@ py::class_<mmm::DurationEncoder>(m, "DurationEncoder")
   .def("json_to_tokens", &mmm::DurationEncoder::json_to_tokens)
   .def("tokens_to_json", &mmm::DurationEncoder::tokens_to_json)
   .def("tokens_to_midi", &mmm::DurationEncoder::tokens_to_midi)
+  .def("encode_batch", &mmm::DurationEncoder::encode_batch_py)
+  .def("decode_batch", &mmm::DurationEncoder::decode_batch_py)
   .def_readwrite("config", &mmm::DurationEncoder::config)
   .def_readwrite("rep", &mmm::DurationEncoder::rep);
 
@@ -564,6 +614,8 @@ py::class_<mmm::NewDurationEncoder>(m, "NewDurationEncoder")
   .def("json_to_tokens", &mmm::NewDurationEncoder::json_to_tokens)
   .def("tokens_to_json", &mmm::NewDurationEncoder::tokens_to_json)
   .def("tokens_to_midi", &mmm::NewDurationEncoder::tokens_to_midi)
+  .def("encode_batch", &mmm::NewDurationEncoder::encode_batch_py)
+  .def("decode_batch", &mmm::NewDurationEncoder::decode_batch_py)
   .def_readwrite("config", &mmm::NewDurationEncoder::config)
   .def_readwrite("rep", &mmm::NewDurationEncoder::rep);
 
@@ -579,6 +631,8 @@ py::class_<mmm::TeEncoder>(m, "TeEncoder")
   .def("json_to_tokens", &mmm::TeEncoder::json_to_tokens)
   .def("tokens_to_json", &mmm::TeEncoder::tokens_to_json)
   .def("tokens_to_midi", &mmm::TeEncoder::tokens_to_midi)
+  .def("encode_batch", &mmm::TeEncoder::encode_batch_py)
+  .def("decode_batch", &mmm::TeEncoder::decode_batch_py)
   .def_readwrite("config", &mmm::TeEncoder::config)
   .def_readwrite("rep", &mmm::TeEncoder::rep);
 
@@ -594,6 +648,8 @@ py::class_<mmm::NewVelocityEncoder>(m, "NewVelocityEncoder")
   .def("json_to_tokens", &mmm::NewVelocityEncoder::json_to_tokens)
   .def("tokens_to_json", &mmm::NewVelocityEncoder::tokens_to_json)
   .def("tokens_to_midi", &mmm::NewVelocityEncoder::tokens_to_midi)
+  .def("encode_batch", &mmm::NewVelocityEncoder::encode_batch_py)
+  .def("decode_batch", &mmm::NewVelocityEncoder::decode_batch_py)
   .def_readwrite("config", &mmm::NewVelocityEncoder::config)
   .def_readwrite("rep", &mmm::NewVelocityEncoder::rep);
 
@@ -609,6 +665,8 @@ py::class_<mmm::AbsoluteEncoder>(m, "AbsoluteEncoder")
   .def("json_to_tokens", &mmm::AbsoluteEncoder::json_to_tokens)
   .def("tokens_to_json", &mmm::AbsoluteEncoder::tokens_to_json)
   .def("tokens_to_midi", &mmm::AbsoluteEncoder::tokens_to_midi)
+  .def("encode_batch", &mmm::AbsoluteEncoder::encode_batch_py)
+  .def("decode_batch", &mmm::AbsoluteEncoder::decode_batch_py)
   .def_readwrite("config", &mmm::AbsoluteEncoder::config)
   .def_readwrite("rep", &mmm::AbsoluteEncoder::rep);
 
@@ -624,6 +682,8 @@ py::class_<mmm::MultiLengthEncoder>(m, "MultiLengthEncoder")
   .def("json_to_tokens", &mmm::MultiLengthEncoder::json_to_tokens)
   .def("tokens_to_json", &mmm::MultiLengthEncoder::tokens_to_json)
   .def("tokens_to_midi", &mmm::MultiLengthEncoder::tokens_to_midi)
+  .def("encode_batch", &mmm::MultiLengthEncoder::encode_batch_py)
+  .def("decode_batch", &mmm::MultiLengthEncoder::decode_batch_py)
   .def_readwrite("config", &mmm::MultiLengthEncoder::config)
   .def_readwrite("rep", &mmm::MultiLengthEncoder::rep);
 
@@ -639,6 +699,8 @@ py::class_<mmm::TeVelocityDurationPolyphonyEncoder>(m, "TeVelocityDurationPolyph
   .def("json_to_tokens", &mmm::TeVelocityDurationPolyphonyEncoder::json_to_tokens)
   .def("tokens_to_json", &mmm::TeVelocityDurationPolyphonyEncoder::tokens_to_json)
   .def("tokens_to_midi", &mmm::TeVelocityDurationPolyphonyEncoder::tokens_to_midi)
+  .def("encode_batch", &mmm::TeVelocityDurationPolyphonyEncoder::encode_batch_py)
+  .def("decode_batch", &mmm::TeVelocityDurationPolyphonyEncoder::decode_batch_py)
   .def_readwrite("config", &mmm::TeVelocityDurationPolyphonyEncoder::config)
   .def_readwrite("rep", &mmm::TeVelocityDurationPolyphonyEncoder::rep);
 
@@ -654,6 +716,8 @@ py::class_<mmm::TeVelocityEncoder>(m, "TeVelocityEncoder")
   .def("json_to_tokens", &mmm::TeVelocityEncoder::json_to_tokens)
   .def("tokens_to_json", &mmm::TeVelocityEncoder::tokens_to_json)
   .def("tokens_to_midi", &mmm::TeVelocityEncoder::tokens_to_midi)
+  .def("encode_batch", &mmm::TeVelocityEncoder::encode_batch_py)
+  .def("decode_batch", &mmm::TeVelocityEncoder::decode_batch_py)
   .def_readwrite("config", &mmm::TeVelocityEncoder::config)
   .def_readwrite("rep", &mmm::TeVelocityEncoder::rep);
 
@@ -669,6 +733,8 @@ py::class_<mmm::ElVelocityDurationPolyphonyEncoder>(m, "ElVelocityDurationPolyph
   .def("json_to_tokens", &mmm::ElVelocityDurationPolyphonyEncoder::json_to_tokens)
   .def("tokens_to_json", &mmm::ElVelocityDurationPolyphonyEncoder::tokens_to_json)
   .def("tokens_to_midi", &mmm::ElVelocityDurationPolyphonyEncoder::tokens_to_midi)
+  .def("encode_batch", &mmm::ElVelocityDurationPolyphonyEncoder::encode_batch_py)
+  .def("decode_batch", &mmm::ElVelocityDurationPolyphonyEncoder::decode_batch_py)
   .def_readwrite("config", &mmm::ElVelocityDurationPolyphonyEncoder::config)
   .def_readwrite("rep", &mmm::ElVelocityDurationPolyphonyEncoder::rep);
 
@@ -684,6 +750,8 @@ py::class_<mmm::ElVelocityDurationPolyphonyYellowEncoder>(m, "ElVelocityDuration
   .def("json_to_tokens", &mmm::ElVelocityDurationPolyphonyYellowEncoder::json_to_tokens)
   .def("tokens_to_json", &mmm::ElVelocityDurationPolyphonyYellowEncoder::tokens_to_json)
   .def("tokens_to_midi", &mmm::ElVelocityDurationPolyphonyYellowEncoder::tokens_to_midi)
+  .def("encode_batch", &mmm::ElVelocityDurationPolyphonyYellowEncoder::encode_batch_py)
+  .def("decode_batch", &mmm::ElVelocityDurationPolyphonyYellowEncoder::decode_batch_py)
   .def_readwrite("config", &mmm::ElVelocityDurationPolyphonyYellowEncoder::config)
   .def_readwrite("rep", &mmm::ElVelocityDurationPolyphonyYellowEncoder::rep);
 
@@ -699,6 +767,8 @@ py::class_<mmm::ElVelocityDurationPolyphonyYellowFixedEncoder>(m, "ElVelocityDur
   .def("json_to_tokens", &mmm::ElVelocityDurationPolyphonyYellowFixedEncoder::json_to_tokens)
   .def("tokens_to_json", &mmm::ElVelocityDurationPolyphonyYellowFixedEncoder::tokens_to_json)
   .def("tokens_to_midi", &mmm::ElVelocityDurationPolyphonyYellowFixedEncoder::tokens_to_midi)
+  .def("encode_batch", &mmm::ElVelocityDurationPolyphonyYellowFixedEncoder::encode_batch_py)
+  .def("decode_batch", &mmm::ElVelocityDurationPolyphonyYellowFixedEncoder::decode_batch_py)
   .def_readwrite("config", &mmm::ElVelocityDurationPolyphonyYellowFixedEncoder::config)
   .def_readwrite("rep", &mmm::ElVelocityDurationPolyphonyYellowFixedEncoder::rep);
 
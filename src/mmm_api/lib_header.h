@@ -7,6 +7,7 @@ namespace py = pybind11;
 #include "dataset/jagged.h"
 #include "encoder/encoder_all.h"
 #include "enum/model_type.h"
+#include "enum/sample_status.h"
 #include "sampling/control.h"
 #include "sampling/util.h"
 #include "version.h"
@@ -44,6 +45,8 @@ std::string generate_py(std::string &status_str, std::string &piece_str, std::st
 namespace mmm {
 void generate_py() { }
 void sample_multi_step_py() { }
+void sample_multi_step_w_status_py() { }
+void set_inference_threads() { }
 }
 #endif
 
@@ -94,8 +97,10 @@ PYBIND11_MODULE(mmm_api,m) {
   m.def("gm_inst_to_string", &mmm::gm_inst_to_string);
 
   m.def("generate", &mmm::generate_py);
+  m.def("set_inference_threads", &mmm::set_inference_threads);
 
   m.def("sample_multi_step", &mmm::sample_multi_step_py);
+  m.def("sample_multi_step_w_status", &mmm::sample_multi_step_w_status_py);
   m.def("piece_to_status", &mmm::piece_to_status_py);
   m.def("default_sample_param", &mmm::default_sample_param_py);
   m.def("print_piece_summary", &mmm::print_piece_summary_py);
@@ -109,6 +114,13 @@ PYBIND11_MODULE(mmm_api,m) {
     .value("BAR_INFILL_MODEL", mmm::MODEL_TYPE::BAR_INFILL_MODEL)
     .export_values();
 
+  py::enum_<mmm::SAMPLE_STATUS>(m, "SAMPLE_STATUS", py::arithmetic())
+    .value("SAMPLE_COMPLETE", mmm::SAMPLE_STATUS::SAMPLE_COMPLETE)
+    .value("SAMPLE_MAX_STEPS", mmm::SAMPLE_STATUS::SAMPLE_MAX_STEPS)
+    .value("SAMPLE_CANCELLED", mmm::SAMPLE_STATUS::SAMPLE_CANCELLED)
+    .value("SAMPLE_DEADLINE_EXCEEDED", mmm::SAMPLE_STATUS::SAMPLE_DEADLINE_EXCEEDED)
+    .export_values();
+
   py::class_<mmm::Jagged>(m, "Jagged")
     .def(py::init<std::string &>())
     .def("set_seed", &mmm::Jagged::set_seed)
@@ -116,12 +128,14 @@ PYBIND11_MODULE(mmm_api,m) {
     .def("set_min_tracks", &mmm::Jagged::set_min_tracks)
     .def("set_max_tracks", &mmm::Jagged::set_max_tracks)
     .def("set_max_seq_len", &mmm::Jagged::set_max_seq_len)
+    .def("set_chunk_bars", &mmm::Jagged::set_chunk_bars)
     .def("enable_write", &mmm::Jagged::enable_write)
     .def("enable_read", &mmm::Jagged::enable_read)
     .def("append", &mmm::Jagged::append)
     .def("read", &mmm::Jagged::read)
     .def("read_bytes", &mmm::Jagged::read_bytes)
     .def("read_json", &mmm::Jagged::read_json)
+    .def("read_segment_bytes", &mmm::Jagged::read_segment_bytes)
     .def("read_batch", &mmm::Jagged::read_batch)
     .def("read_batch_v2", &mmm::Jagged::read_batch_v2)
     .def("read_batch_w_feature", &mmm::Jagged::read_batch_w_feature)
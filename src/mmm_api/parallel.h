@@ -0,0 +1,70 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// START OF NAMESPACE
+namespace mmm {
+
+// number of workers to use when the caller passes num_threads <= 0
+int default_num_threads() {
+  int n = (int)std::thread::hardware_concurrency();
+  return std::max(n, 1);
+}
+
+// run fn(i) for i in [0,n) on a pool of worker threads. work is handed out
+// one index at a time so that uneven items (long and short pieces) balance
+// across the workers. the first exception thrown by any worker is rethrown
+// on the calling thread once all workers have finished.
+void parallel_for(int n, int num_threads, const std::function<void(int)> &fn) {
+  if (num_threads <= 0) {
+    num_threads = default_num_threads();
+  }
+  num_threads = std::min(num_threads, n);
+  if (num_threads <= 1) {
+    for (int i=0; i<n; i++) {
+      fn(i);
+    }
+    return;
+  }
+
+  std::atomic<int> next(0);
+  std::exception_ptr error;
+  std::mutex error_mutex;
+
+  auto worker = [&]() {
+    int i;
+    while ((i = next++) < n) {
+      try {
+        fn(i);
+      }
+      catch (...) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error) {
+          error = std::current_exception();
+        }
+        next = n; // stop handing out work
+      }
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (int t=1; t<num_threads; t++) {
+    workers.push_back( std::thread(worker) );
+  }
+  worker(); // the calling thread is one of the workers
+  for (auto &w : workers) {
+    w.join();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+}
+// END OF NAMESPACE
@@ -402,6 +402,71 @@ void append_piece(midi::Piece *p, midi::Piece *q) {
 
 }
 
+// ========================================================================
+// EVENT COMPACTION
+
+// bars refer to events by their index in p->events. replacing the events
+// of a bar (i.e. piece_insert) leaves the old events behind, so over a
+// long multi-step generation most of the events can be orphaned. this
+// removes the events no bar refers to and remaps the bar event indices,
+// keeping the order of the remaining events. the piece is only compacted
+// when the fraction of orphaned events is above threshold. returns the
+// number of events removed.
+
+int compact_events(midi::Piece *p, double threshold=0, bool verbose=false) {
+	int num_events = p->events_size();
+	if (num_events == 0) {
+		return 0;
+	}
+
+	std::vector<int> remap(num_events, -1);
+	int num_used = 0;
+	for (const auto &track : p->tracks()) {
+		for (const auto &bar : track.bars()) {
+			for (const auto index : bar.events()) {
+				if ((index < 0) || (index >= num_events)) {
+					throw std::runtime_error("EVENT INDEX OUT OF RANGE. PIECE IS LIKELY MALFORMED");
+				}
+				if (remap[index] < 0) {
+					remap[index] = 0;
+					num_used++;
+				}
+			}
+		}
+	}
+	if ((double)(num_events - num_used) / num_events <= threshold) {
+		return 0;
+	}
+
+	// move the used events to the front in a single pass
+	auto events = p->mutable_events();
+	int count = 0;
+	for (int i=0; i<num_events; i++) {
+		if (remap[i] == 0) {
+			if (i != count) {
+				events->SwapElements(i, count);
+			}
+			remap[i] = count++;
+		}
+	}
+	events->DeleteSubrange(count, num_events - count);
+
+	for (int track_num=0; track_num<p->tracks_size(); track_num++) {
+		midi::Track *track = p->mutable_tracks(track_num);
+		for (int bar_num=0; bar_num<track->bars_size(); bar_num++) {
+			midi::Bar *bar = track->mutable_bars(bar_num);
+			for (int j=0; j<bar->events_size(); j++) {
+				bar->set_events(j, remap[bar->events(j)]);
+			}
+		}
+	}
+
+	if (verbose) {
+		std::cout << "COMPACTED EVENTS : " << num_events << " -> " << count << std::endl;
+	}
+	return num_events - count;
+}
+
 // ========================================================================
 // MAX POLYPHONY
 
@@ -826,22 +891,65 @@ void reorder_tracks(midi::Piece *x, std::vector<int> track_order) {
 	);
 }
 
+// count the references to each event from the bars in bars_to_keep (or
+// all bars when bars_to_keep is empty) of the given tracks
+std::vector<int> count_event_references(midi::Piece *x, std::vector<int> &tracks, std::vector<int> &bars_to_keep, std::set<int> *events_to_prune=NULL) {
+	std::vector<int> refs(x->events_size(), 0);
+	auto count_bar = [&](const midi::Bar &bar) {
+		for (const auto index : bar.events()) {
+			if ((index < 0) || (index >= x->events_size())) {
+				throw std::runtime_error("EVENT INDEX OUT OF RANGE. PIECE IS LIKELY MALFORMED");
+			}
+			if ((!events_to_prune) || (events_to_prune->find(index) == events_to_prune->end())) {
+				refs[index]++;
+			}
+		}
+	};
+	for (const auto track_num : tracks) {
+		const midi::Track &track = x->tracks(track_num);
+		if (bars_to_keep.size()) {
+			for (const auto bar_num : bars_to_keep) {
+				count_bar(track.bars(bar_num));
+			}
+		}
+		else {
+			for (const auto &bar : track.bars()) {
+				count_bar(bar);
+			}
+		}
+	}
+	return refs;
+}
+
+// append events[index] to x and return its new index. the event is moved
+// out on its last reference and copied otherwise.
+int transfer_event(midi::Piece *x, google::protobuf::RepeatedPtrField<midi::Event> &events, std::vector<int> &refs, int index) {
+	midi::Event *e = x->add_events();
+	if (--refs[index] == 0) {
+		e->Swap( events.Mutable(index) );
+	}
+	else {
+		e->CopyFrom( events.Get(index) );
+	}
+	return x->events_size() - 1;
+}
+
+// keep the tracks (in the given order) and bars listed. the kept tracks,
+// bars and events are moved out of the piece rather than copied, except
+// when a track or bar is listed more than once. when bars is empty every
+// bar and every event is kept.
 void prune_tracks_dev2(midi::Piece *x, std::vector<int> tracks, std::vector<int> bars) {
 
 	if (x->tracks_size() == 0) {
 		return;
 	}
 
-	midi::Piece tmp(*x);
-
 	int num_bars = get_num_bars(x);
 	bool remove_bars = bars.size() > 0;
-	x->clear_tracks();
-	x->clear_events();
 
 	std::vector<int> tracks_to_keep;
 	for (const auto track_num : tracks) {
-		if ((track_num >= 0) && (track_num < tmp.tracks_size())) {
+		if ((track_num >= 0) && (track_num < x->tracks_size())) {
 			tracks_to_keep.push_back(track_num);
 		}
 	}
@@ -853,26 +961,73 @@ void prune_tracks_dev2(midi::Piece *x, std::vector<int> tracks, std::vector<int>
 		}
 	}
 
+	std::vector<int> refs;
+	if (remove_bars) {
+		refs = count_event_references(x, tracks_to_keep, bars_to_keep);
+	}
+
+	// a track (or bar) is moved on its last use and copied before that
+	std::vector<int> track_uses(x->tracks_size(), 0);
+	for (const auto track_num : tracks_to_keep) {
+		track_uses[track_num]++;
+	}
+	std::vector<int> bar_uses(num_bars, 0);
+	for (const auto bar_num : bars_to_keep) {
+		bar_uses[bar_num]++;
+	}
+
+	// on the same arena as x so that the swaps only exchange pointers
+	google::protobuf::RepeatedPtrField<midi::Track> old_tracks(x->GetArena());
+	google::protobuf::RepeatedPtrField<midi::Event> old_events(x->GetArena());
+	old_tracks.Swap( x->mutable_tracks() );
+	old_events.Swap( x->mutable_events() );
+
 	for (const auto track_num : tracks_to_keep) {
-		const midi::Track track = tmp.tracks(track_num);
 		midi::Track *t = x->add_tracks();
-		t->CopyFrom( track );
-		if (remove_bars) {
-			t->clear_bars();
-			for (const auto bar_num : bars_to_keep) {
-				const midi::Bar bar = track.bars(bar_num);
-				midi::Bar *b  = t->add_bars();
-				b->CopyFrom( bar );
-				b->clear_events();
-				for (const auto event_index : bar.events()) {
-					b->add_events( x->events_size() );
-					midi::Event *e = x->add_events();
-					e->CopyFrom( tmp.events(event_index) );
-				}
+		bool last_track_use = (--track_uses[track_num] == 0);
+		if (!remove_bars) {
+			if (last_track_use) {
+				t->Swap( old_tracks.Mutable(track_num) );
+			}
+			else {
+				t->CopyFrom( old_tracks.Get(track_num) );
+			}
+			continue;
+		}
+
+		// move everything but the bars
+		midi::Track *src = old_tracks.Mutable(track_num);
+		google::protobuf::RepeatedPtrField<midi::Bar> src_bars(x->GetArena());
+		src_bars.Swap( src->mutable_bars() );
+		if (last_track_use) {
+			t->Swap( src );
+		}
+		else {
+			t->CopyFrom( *src );
+			src->mutable_bars()->Swap( &src_bars );
+		}
+		
+		std::vector<int> uses(bar_uses);
+		for (const auto bar_num : bars_to_keep) {
+			midi::Bar *b = t->add_bars();
+			midi::Bar *src_bar = last_track_use ? 
+				src_bars.Mutable(bar_num) : src->mutable_bars(bar_num);
+			if ((last_track_use) && (--uses[bar_num] == 0)) {
+				b->Swap( src_bar );
+			}
+			else {
+				b->CopyFrom( *src_bar );
+			}
+			for (int j=0; j<b->events_size(); j++) {
+				b->set_events(j, transfer_event(x, old_events, refs, b->events(j)));
 			}
 		}
 	}
 
+	if (!remove_bars) {
+		x->mutable_events()->Swap( &old_events );
+	}
+
 	//if (x->events_size() == 0) {
 	//  throw std::runtime_error("NO EVENTS COPIED");
 	//}
@@ -908,28 +1063,28 @@ void shuffle_tracks_dev(midi::Piece *x, std::mt19937 *engine) {
 }
 
 void prune_events(midi::Piece *x, std::set<int> &events_to_prune) {
-	midi::Piece tmp(*x);
-	x->clear_events();
-
-	int track_num = 0;
-	for (const auto track : tmp.tracks()) {
-		int bar_num = 0;
-		for (const auto bar : track.bars()) {
-			// clear this bars events in tmp and repopulate
-			midi::Bar *b = x->mutable_tracks(track_num)->mutable_bars(bar_num);
-			b->clear_events();
-
-			for (const auto index : bar.events()) {
+	std::vector<int> tracks = arange(0,x->tracks_size(),1);
+	std::vector<int> all_bars;
+	std::vector<int> refs = count_event_references(
+		x, tracks, all_bars, &events_to_prune);
+
+	google::protobuf::RepeatedPtrField<midi::Event> old_events(x->GetArena());
+	old_events.Swap( x->mutable_events() );
+
+	// rewrite the event indices of each bar in place
+	for (int track_num=0; track_num<x->tracks_size(); track_num++) {
+		midi::Track *track = x->mutable_tracks(track_num);
+		for (int bar_num=0; bar_num<track->bars_size(); bar_num++) {
+			midi::Bar *b = track->mutable_bars(bar_num);
+			int count = 0;
+			for (int j=0; j<b->events_size(); j++) {
+				int index = b->events(j);
 				if (events_to_prune.find(index) == events_to_prune.end()) {
-					// add this event
-					b->add_events( x->events_size() );
-					midi::Event *e = x->add_events();
-					e->CopyFrom( tmp.events(index) );
+					b->set_events(count++, transfer_event(x, old_events, refs, index));
 				}
 			}
-			bar_num++;
+			b->mutable_events()->Truncate(count);
 		}
-		track_num++;
 	}
 
 }
@@ -974,8 +1129,13 @@ void prune_notes_wo_offset(midi::Piece *x, bool ignore_drums) {
 // 1. we select an index of a random segment
 
 
-void update_valid_segments(midi::Piece *x, int seglen, int min_tracks, bool opz) {
-	update_has_notes(x);
+// keep_has_notes uses the stored internal_has_notes instead of recomputing
+// it. skeletons from the chunked Jagged layout have no events, so this is
+// the only way to find their valid segments.
+void update_valid_segments(midi::Piece *x, int seglen, int min_tracks, bool opz, bool keep_has_notes=false) {
+	if (!keep_has_notes) {
+		update_has_notes(x);
+	}
 	x->clear_internal_valid_segments();
 	x->clear_internal_valid_tracks();
 
@@ -1049,8 +1209,8 @@ void update_valid_segments(midi::Piece *x, int seglen, int min_tracks, bool opz)
 	}
 }
 
-void select_random_segment_indices(midi::Piece *x, int num_bars, int min_tracks, int max_tracks, bool opz, std::mt19937 *engine, std::vector<int> &valid_tracks, int *start) {
-	update_valid_segments(x, num_bars, min_tracks, opz);
+void select_random_segment_indices(midi::Piece *x, int num_bars, int min_tracks, int max_tracks, bool opz, std::mt19937 *engine, std::vector<int> &valid_tracks, int *start, bool keep_has_notes=false) {
+	update_valid_segments(x, num_bars, min_tracks, opz, keep_has_notes);
 	
 	if (x->internal_valid_segments_size() == 0) {
 		throw std::runtime_error("NO VALID SEGMENTS");
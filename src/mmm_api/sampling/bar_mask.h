@@ -0,0 +1,136 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// START OF NAMESPACE
+namespace mmm {
+
+inline int popcount64(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_popcountll(x);
+#else
+  int count = 0;
+  while (x) {
+    x &= x - 1;
+    count++;
+  }
+  return count;
+#endif
+}
+
+// the bits of word w that fall in the bar range [start,end)
+inline uint64_t bar_range_word(int start, int end, int w) {
+  int lo = std::max(start - w*64, 0);
+  int hi = std::min(end - w*64, 64);
+  if (lo >= hi) {
+    return 0;
+  }
+  uint64_t upper = (hi == 64) ? ~(uint64_t)0 : (((uint64_t)1 << hi) - 1);
+  return upper & ~(((uint64_t)1 << lo) - 1);
+}
+
+// a track x bar boolean matrix with the bars of each track packed into
+// 64-bit words, so that the step planner can combine whole rows at once
+// instead of visiting each bar.
+class BarMask {
+public:
+  BarMask () {
+    num_tracks = 0;
+    num_bars = 0;
+    num_words = 0;
+  }
+
+  BarMask (int nt, int nb) {
+    num_tracks = nt;
+    num_bars = nb;
+    num_words = (nb + 63) / 64;
+    bits.resize(nt * num_words, 0);
+  }
+
+  BarMask (const std::vector<std::vector<bool>> &x) : BarMask(
+    (int)x.size(), x.size() ? (int)x[0].size() : 0) {
+    for (int i=0; i<num_tracks; i++) {
+      for (int j=0; j<num_bars; j++) {
+        if (x[i][j]) {
+          set(i,j);
+        }
+      }
+    }
+  }
+
+  bool get(int track, int bar) const {
+    return (bits[track*num_words + bar/64] >> (bar%64)) & 1;
+  }
+
+  void set(int track, int bar) {
+    bits[track*num_words + bar/64] |= (uint64_t)1 << (bar%64);
+  }
+
+  uint64_t *row(int track) {
+    return bits.data() + track*num_words;
+  }
+
+  const uint64_t *row(int track) const {
+    return bits.data() + track*num_words;
+  }
+
+  bool any_in_row(int track) const {
+    const uint64_t *r = row(track);
+    for (int w=0; w<num_words; w++) {
+      if (r[w]) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool any() const {
+    for (const auto word : bits) {
+      if (word) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool all() const {
+    for (int i=0; i<num_tracks; i++) {
+      const uint64_t *r = row(i);
+      for (int w=0; w<num_words; w++) {
+        if (r[w] != bar_range_word(0, num_bars, w)) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  int count() const {
+    int total = 0;
+    for (const auto word : bits) {
+      total += popcount64(word);
+    }
+    return total;
+  }
+
+  std::vector<std::vector<bool>> to_matrix() const {
+    std::vector<std::vector<bool>> x(
+      num_tracks, std::vector<bool>(num_bars,false));
+    for (int i=0; i<num_tracks; i++) {
+      for (int j=0; j<num_bars; j++) {
+        x[i][j] = get(i,j);
+      }
+    }
+    return x;
+  }
+
+  int num_tracks;
+  int num_bars;
+  int num_words;
+  std::vector<uint64_t> bits;
+};
+
+}
+// END OF NAMESPACE
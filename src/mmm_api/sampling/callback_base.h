@@ -1,5 +1,10 @@
 #pragma once
 
+#include <map>
+#include <memory>
+#include <tuple>
+#include <vector>
+
 #include "../encoder/encoder_base.h"
 
 namespace mmm {
@@ -7,20 +12,52 @@ namespace mmm {
   // this can bs used as a base class for callbacks
   class CallbackManager {
   public:
-    CallbackManager () { 
+    CallbackManager () {
       progress_count = 0;
       generated_bar_count = 0;
+      stream_bars = false;
     }
-    ~CallbackManager () { }
+    virtual ~CallbackManager () { }
     void set_generated_bar_count(int x) {
       generated_bar_count = x;
     }
+
+    // maps the (track,bar) of the current generation step to the piece that
+    // is being sampled. bars that are not in the mapping are not streamed.
+    void set_stream_mapping(const std::map<std::tuple<int,int>,std::tuple<int,int>> &mapping) {
+      stream_mapping = mapping;
+    }
+
+    // maps the tracks of the piece that is being sampled back to the order
+    // of the tracks passed in by the caller
+    void set_stream_track_order(const std::vector<int> &order) {
+      stream_track_order = order;
+    }
+
+    // reports a bar of the current generation step that has just been
+    // decoded, at its position in the piece that is being sampled
+    void stream_bar(int track_num, int bar_num, const midi::Piece &bar) {
+      std::tuple<int,int> pos = std::make_tuple(track_num, bar_num);
+      if (stream_mapping.size()) {
+        auto it = stream_mapping.find(pos);
+        if (it == stream_mapping.end()) {
+          return;
+        }
+        pos = it->second;
+      }
+      track_num = std::get<0>(pos);
+      if (track_num < stream_track_order.size()) {
+        track_num = stream_track_order[track_num];
+      }
+      on_bar(track_num, std::get<1>(pos), bar);
+    }
+
     void update(std::unique_ptr<ENCODER> *encoder, int token) {
 
       if (generated_bar_count == 0) {
         throw std::runtime_error("GENERATED BAR COUNT WAS NEVER SPECIFIED");
       }
-      
+
       if ((!encoder) || (!encoder->get())) {
         throw std::runtime_error("CALLBACK MANAGER RECIEVED NULL ENCODER");
       }
@@ -34,8 +71,16 @@ namespace mmm {
     }
     virtual void on_bar_end (float) = 0;
 
+    // called with each bar as soon as it has been generated when
+    // stream_bars is true. bar holds a single track with a single bar and
+    // its events.
+    virtual void on_bar (int track_num, int bar_num, const midi::Piece &bar) { }
+
     int generated_bar_count;
     int progress_count;
+    bool stream_bars;
+    std::map<std::tuple<int,int>,std::tuple<int,int>> stream_mapping;
+    std::vector<int> stream_track_order;
   };
 
-}
\ No newline at end of file
+}
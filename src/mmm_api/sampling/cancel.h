@@ -0,0 +1,76 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+
+#include "../enum/sample_status.h"
+#include "../protobuf/midi.pb.h"
+
+// START OF NAMESPACE
+namespace mmm {
+
+// lets another thread abort a generation in flight. cancel() can be called
+// from any thread; the sampler notices it before its next forward pass.
+class CancellationToken {
+public:
+  CancellationToken () {
+    cancelled = false;
+  }
+  void cancel() {
+    cancelled = true;
+  }
+  void reset() {
+    cancelled = false;
+  }
+  bool is_cancelled() const {
+    return cancelled;
+  }
+
+  std::atomic<bool> cancelled;
+};
+
+// the reasons a single call to sample_w_debug may stop early. the
+// deadline is fixed when the object is created, from SampleParam.timeout_ms.
+// the first reason found is kept in status.
+class StopCondition {
+public:
+  StopCondition(midi::SampleParam *param, CancellationToken *cancel_token=NULL) {
+    token = cancel_token;
+    use_deadline = param->timeout_ms() > 0;
+    deadline = std::chrono::steady_clock::now() +
+      std::chrono::milliseconds(param->timeout_ms());
+    status = SAMPLE_COMPLETE;
+  }
+
+  // returns true once sampling should stop
+  bool check() {
+    if (!stopped()) {
+      if ((token) && (token->is_cancelled())) {
+        status = SAMPLE_CANCELLED;
+      }
+      else if ((use_deadline) && (std::chrono::steady_clock::now() >= deadline)) {
+        status = SAMPLE_DEADLINE_EXCEEDED;
+      }
+    }
+    return stopped();
+  }
+
+  bool stopped() const {
+    return (status == SAMPLE_CANCELLED) || (status == SAMPLE_DEADLINE_EXCEEDED);
+  }
+
+  // a step that hits max_steps is dropped, but the remaining steps still run
+  void hit_max_steps() {
+    if (status == SAMPLE_COMPLETE) {
+      status = SAMPLE_MAX_STEPS;
+    }
+  }
+
+  CancellationToken *token;
+  bool use_deadline;
+  std::chrono::steady_clock::time_point deadline;
+  SAMPLE_STATUS status;
+};
+
+}
+// END OF NAMESPACE
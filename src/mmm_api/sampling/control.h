@@ -7,9 +7,15 @@
 
 #pragma once
 
+#include <bitset>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <random>
 #include <tuple>
 #include <set>
+#include <typeindex>
 #include <vector>
 
 #include "../encoder/representation.h"
@@ -17,6 +23,7 @@
 #include "../enum/token_types.h"
 #include "../enum/encoder_types.h"
 #include "callback_base.h"
+#include "metrics.h"
 
 namespace mmm {
 
@@ -37,6 +44,11 @@ public:
   std::vector<std::vector<int>> orders;
   std::vector<MODEL_TYPE> modes;
   std::vector<std::vector<bool>> is_autoregressive;
+  std::vector<int> num_forward_passes; // per generate call
+  std::vector<int> num_forced_tokens; // tokens appended without sampling
+  std::vector<int> num_draft_proposed; // speculative decoding only
+  std::vector<int> num_draft_accepted;
+  midi::SampleMetrics metrics; // when SampleParam.collect_metrics is set
 };
 
 using TOKEN_EDGE = std::pair<mmm::TOKEN_TYPE,mmm::TOKEN_TYPE>;
@@ -198,7 +210,10 @@ class REP_GRAPH {
 public:
   REP_GRAPH(ENCODER *e, MODEL_TYPE mt) {
     enc = e;
+    rep = e->rep;
     initialize(mt);
+    compile();
+    enc = NULL; // the graph outlives the encoder when it is shared
   }
   //REP_GRAPH(ENCODER_TYPE et, MODEL_TYPE mt) {
   //  enc = getEncoder(et);
@@ -320,17 +335,28 @@ public:
       add_path(path);
     }
   }
-  void check_edge(mmm::TOKEN_TYPE u, mmm::TOKEN_TYPE v) {
-    auto uit = nodes.find(u);
-    if (uit == nodes.end()) {
-      throw std::runtime_error("INVALID NODE");
+  // the graph is compiled into an adjacency bitmatrix over token types
+  // and one vocab mask per node (the tokens which may follow a token of
+  // that type), so that masking never has to walk the graph
+  void compile() {
+    has_node.reset();
+    edge_matrix.assign(NONE+1, std::bitset<NONE+1>());
+    node_masks.assign(NONE+1, std::vector<int>());
+    for (const auto &kv : nodes) {
+      std::vector<int> mask(rep->max_token(), 0);
+      for (const auto e : kv.second.edges) {
+        edge_matrix[kv.first].set(e);
+        rep->set_mask(e, {-1}, mask, 1);
+      }
+      has_node.set(kv.first);
+      node_masks[kv.first] = mask;
     }
-    auto vit = nodes.find(v);
-    if (uit == nodes.end()) {
+  }
+  void check_edge(mmm::TOKEN_TYPE u, mmm::TOKEN_TYPE v) {
+    if ((!has_node.test(u)) || (!has_node.test(v))) {
       throw std::runtime_error("INVALID NODE");
     }
-    auto eit = nodes.find(u)->second.edges.find(v);
-    if (eit == nodes.find(u)->second.edges.end()) {
+    if (!edge_matrix[u].test(v)) {
       std::ostringstream buffer;
       buffer << "INVALID EDGE " << toString(u) << "-->" << toString(v);
       throw std::runtime_error(buffer.str());
@@ -350,40 +376,87 @@ public:
   void validate_sequence(std::vector<int> &tokens) {
     for (int i=0; i<(int)tokens.size()-1; i++) {
       check_edge(
-        enc->rep->get_token_type(tokens[i]),
-        enc->rep->get_token_type(tokens[i+1]));
+        rep->get_token_type(tokens[i]),
+        rep->get_token_type(tokens[i+1]));
     }
   }
   void set_mask(int last_token, std::vector<int> &mask) {
-    mmm::TOKEN_TYPE tt = enc->rep->get_token_type(last_token);
-    auto it = nodes.find(tt);
-    if (it == nodes.end()) {
+    mmm::TOKEN_TYPE tt = rep->get_token_type(last_token);
+    if (!has_node.test(tt)) {
       std::ostringstream buffer;
       buffer << "ERROR : INVALID NODE IN REP GRAPH (" << toString(tt) << ")";
       throw std::runtime_error(buffer.str());
     }
-    for (const auto e : it->second.edges) {
-
-      enc->rep->set_mask(e, {-1}, mask, 1);
+    const std::vector<int> &node_mask = node_masks[tt];
+    int n = std::min(mask.size(), node_mask.size());
+    for (int i=0; i<n; i++) {
+      mask[i] |= node_mask[i];
     }
   }
   std::vector<int> get_mask(int last_token) {
-    std::vector<int> mask(enc->rep->max_token(), 0);
+    std::vector<int> mask(rep->max_token(), 0);
     set_mask(last_token, mask);
     return mask;
   }
   std::set<mmm::TOKEN_TYPE> all_token_types;
-  ENCODER *enc;
+  ENCODER *enc; // only valid while the graph is being built
   //std::unique_ptr<ENCODER> enc;
   REPRESENTATION *rep;
   std::map<mmm::TOKEN_TYPE,REP_NODE> nodes;
-};
 
+  std::bitset<NONE+1> has_node;
+  std::vector<std::bitset<NONE+1>> edge_matrix;
+  std::vector<std::vector<int>> node_masks;
+};
 
+// the graph only depends on the encoder class and the model type, so it
+// is compiled once and shared (read-only) by every SAMPLE_CONTROL
+REP_GRAPH *get_shared_rep_graph(ENCODER *enc, MODEL_TYPE mt) {
+  static std::mutex graphs_mutex;
+  static std::map<std::tuple<std::type_index,MODEL_TYPE>,std::unique_ptr<REP_GRAPH>> graphs;
+  std::lock_guard<std::mutex> lock(graphs_mutex);
+  std::unique_ptr<REP_GRAPH> &g = graphs[std::make_tuple(std::type_index(typeid(*enc)), mt)];
+  if (!g) {
+    g.reset( new REP_GRAPH(enc, mt) );
+  }
+  return g.get();
+}
 
 
+// (time, pitch) pairs ordered by when the note expires, so that only
+// the expired notes are visited after each token
+typedef std::priority_queue<std::pair<int,int>,
+  std::vector<std::pair<int,int>>,
+  std::greater<std::pair<int,int>>> NOTE_EXPIRY_QUEUE;
 
+// the part of the SAMPLE_CONTROL state that depends on the position in
+// the token sequence. it is recorded at each FILL_IN_PLACEHOLDER
+class CONTROL_STATE {
+public:
+  NOTE_EXPIRY_QUEUE note_expiry;
+  std::bitset<128> onsets;
+  std::bitset<128> touched; // pitches changed since the previous placeholder
+  midi::TRACK_TYPE current_track_type;
+  int barlength;
+  int timestep;
+  int absolute_timestep;
+  int bar_start_timestep;
+  int bar_count;
+  int track_count;
+};
 
+// everything needed to rewind a SAMPLE_CONTROL to an earlier point in the
+// token sequence (i.e. when speculative tokens are rejected)
+class CONTROL_CHECKPOINT {
+public:
+  CONTROL_STATE state;
+  int last_token;
+  int infill_bar_count;
+  int token_position;
+  bool finished;
+  int history_size;
+  int num_placeholder_states;
+};
 
 class SAMPLE_CONTROL {
 public:
@@ -396,21 +469,13 @@ public:
 
     // initialize() will set enc
     rep = enc->rep;
-    rg = new REP_GRAPH(enc.get(), model_type);
-
-    if (!rg) {
-      std::runtime_error("REG GRAPH CONSTRUCTOR FAILED");
-    }
+    rg = get_shared_rep_graph(enc.get(), model_type);
 
     parse_status(status);
     initialize_members();
 
   }
 
-  ~SAMPLE_CONTROL() {
-    delete rg;
-  }
-
   void initialize_members() {
     barlength = 4 * enc->config->resolution;
     timestep = 0;
@@ -420,6 +485,10 @@ public:
     infill_bar_count = 0;
     finished = false;
     token_position = 0;
+    decoded.Clear();
+    decoder.reset( new IncrementalDecoder<>(
+      &decoded, rep, enc->config, enc->config->do_multi_fill) );
+    decoding_paused = false;
   }
 
   void set_bar_infill_prompt(std::vector<std::tuple<int,int>> &bars, midi::Piece *p, midi::Status *status, midi::SampleParam *param) {
@@ -795,8 +864,9 @@ public:
         bar_count = 0;
         absolute_timestep = 0;
         bar_start_timestep = 0;
-        onsets.clear();
-        note_expiry.clear();
+        onsets.reset();
+        touched.set();
+        note_expiry = NOTE_EXPIRY_QUEUE();
         current_track_type = static_cast<midi::TRACK_TYPE>(rep->decode(token));
         break;
       }
@@ -816,23 +886,41 @@ public:
         bar_start_timestep += barlength;
         break;
       }
+      case FILL_IN_PLACEHOLDER: {
+        // remember the state at each placeholder in the prompt
+        // so that we can jump back to it when the bar is filled
+        placeholder_states.push_back( get_state() );
+        placeholder_states.back().touched = touched;
+        touched.reset();
+        break;
+      }
       case FILL_IN_START: {
-        // clear onsets and read in the token sequence
-        // we backfill events in between FILL_IN_PLACEHOLDERs
-        // so that we don't skip context
-        int fillp_token = enc->rep->encode(FILL_IN_PLACEHOLDER,0);
-        auto it = history.begin();
-        auto prev = it;
-        for (int i=0; i<=infill_bar_count; i++) {
-          prev = it;
-          it = find(next(it), history.end(), fillp_token);
+        // restore the state recorded at the placeholder for this bar
+        // instead of replaying the prompt up to that point
+        if (infill_bar_count >= placeholder_states.size()) {
+          throw std::runtime_error("FATAL ERROR : NO FILL_IN_PLACEHOLDER FOR FILL_IN_START");
         }
-        for (auto i=next(prev); i!=it; i++) {
-          if (verbose) {
-            std::cout << "BACKFILLING :: " << enc->rep->pretty(*i) << std::endl;
+        CONTROL_STATE state = placeholder_states[infill_bar_count];
+        if ((infill_bar_count > 0) && (state.track_count == placeholder_states[infill_bar_count-1].track_count)) {
+          // notes from the previously filled bar on this track may
+          // still be sounding. they are kept unless the prompt between
+          // the two placeholders touched the same pitch.
+          std::bitset<128> carried = onsets;
+          while (!note_expiry.empty()) {
+            if (note_expiry.top().first > state.absolute_timestep) {
+              state.note_expiry.push( note_expiry.top() );
+            }
+            else {
+              carried.reset( note_expiry.top().second );
+            }
+            note_expiry.pop();
           }
-          update(*i);
+          state.onsets = (state.onsets & state.touched) | (carried & ~state.touched);
         }
+        if (verbose) {
+          std::cout << "RESTORING STATE FOR FILL_IN " << infill_bar_count << std::endl;
+        }
+        set_state(state);
         break;
       }
       case FILL_IN_END: {
@@ -859,7 +947,8 @@ public:
       }
       case NOTE_ONSET: {
         int pitch = rep->decode(token);
-        onsets.insert( pitch );
+        onsets.set( pitch );
+        touched.set( pitch );
 
         if ((is_drum_track(current_track_type)) && (!enc->config->use_drum_offsets)) {
           // artificially add the note duration of 1
@@ -871,13 +960,14 @@ public:
       }
       case NOTE_OFFSET: {
         int pitch = rep->decode(token);
-        onsets.erase( pitch );
+        onsets.reset( pitch );
+        touched.set( pitch );
         break;
       }
       case NOTE_DURATION: {
         int dur = rep->decode(token) + 1;
         int pitch = rep->decode(last_token);
-        note_expiry[dur + absolute_timestep].push_back(pitch);
+        note_expiry.push( std::make_pair(dur + absolute_timestep, pitch) );
         break;
       }
       default:
@@ -886,29 +976,75 @@ public:
     }
 
     // remove notes that have "expired"
-    std::vector<int> to_remove;
-    for (const auto kv : note_expiry) {
-      if (kv.first <= absolute_timestep) {
-        for (const auto pitch : kv.second) {
-          onsets.erase( pitch );
-        }
-        to_remove.push_back( kv.first );
-      }
-    }
-    // remove these lists from note expiry
-    for (const auto t : to_remove) {
-      note_expiry.erase( t ); 
+    while ((!note_expiry.empty()) && (note_expiry.top().first <= absolute_timestep)) {
+      onsets.reset( note_expiry.top().second );
+      touched.set( note_expiry.top().second );
+      note_expiry.pop();
     }
 
     last_token = token;
 
     if (verbose) {
-      std::cout << "ONSETS : " << onsets.size() << std::endl;
+      std::cout << "ONSETS : " << onsets.count() << std::endl;
     }
     
 
   }
 
+  CONTROL_STATE get_state() {
+    CONTROL_STATE state;
+    state.note_expiry = note_expiry;
+    state.onsets = onsets;
+    state.current_track_type = current_track_type;
+    state.barlength = barlength;
+    state.timestep = timestep;
+    state.absolute_timestep = absolute_timestep;
+    state.bar_start_timestep = bar_start_timestep;
+    state.bar_count = bar_count;
+    state.track_count = track_count;
+    return state;
+  }
+
+  CONTROL_CHECKPOINT save() {
+    CONTROL_CHECKPOINT c;
+    c.state = get_state();
+    c.state.touched = touched;
+    c.last_token = last_token;
+    c.infill_bar_count = infill_bar_count;
+    c.token_position = token_position;
+    c.finished = finished;
+    c.history_size = history.size();
+    c.num_placeholder_states = placeholder_states.size();
+    // the tokens seen until restore() may be rolled back, so they are only
+    // decoded once they are seen again after restore()
+    decoding_paused = true;
+    return c;
+  }
+
+  void restore(const CONTROL_CHECKPOINT &c) {
+    set_state(c.state);
+    touched = c.state.touched;
+    last_token = c.last_token;
+    infill_bar_count = c.infill_bar_count;
+    token_position = c.token_position;
+    finished = c.finished;
+    history.resize(c.history_size);
+    placeholder_states.resize(c.num_placeholder_states);
+    decoding_paused = false;
+  }
+
+  void set_state(const CONTROL_STATE &state) {
+    note_expiry = state.note_expiry;
+    onsets = state.onsets;
+    current_track_type = state.current_track_type;
+    barlength = state.barlength;
+    timestep = state.timestep;
+    absolute_timestep = state.absolute_timestep;
+    bar_start_timestep = state.bar_start_timestep;
+    bar_count = state.bar_count;
+    track_count = state.track_count;
+  }
+
   void set_mask(int last_token, std::vector<int> &mask) {
 
     // basic constraints of the representation
@@ -935,15 +1071,19 @@ public:
     }
     
     // can't have onset for note that is already sounding
-    for (const auto pitch : onsets) {
-      mask[rep->encode(NOTE_ONSET,pitch)] = 0;
+    if (onsets.any()) {
+      for (int pitch=0; pitch<128; pitch++) {
+        if (onsets.test(pitch)) {
+          mask[rep->encode_int(NOTE_ONSET,pitch)] = 0;
+        }
+      }
     }
     
     // can't have offset for note that is not sounding
     if (rep->has_token_type(NOTE_OFFSET)) {
       for (int pitch=0; pitch<128; pitch++) {
-        if (onsets.find(pitch) == onsets.end()) {
-          mask[rep->encode(NOTE_OFFSET,pitch)] = 0;
+        if (!onsets.test(pitch)) {
+          mask[rep->encode_int(NOTE_OFFSET,pitch)] = 0;
         }
       }
     }
@@ -977,7 +1117,7 @@ public:
     }
 
     // can't have more than n simultaneous notes
-    if (onsets.size() >= hard_limit) {
+    if (onsets.count() >= hard_limit) {
       if (verbose) {
         std::cout << "HIT HARD LIMIT >>>>>>>>>>>>>>>>>>>> " << std::endl;
       }
@@ -1058,17 +1198,50 @@ public:
     return mask;
   }
 
-  std::vector<int> get_mask(std::vector<int> &tokens) {
-    std::vector<int> mask(enc->rep->max_token(), 0);
+  // true once the last TRACK_END (track model) or FILL_IN_END (bar
+  // infill) has been produced. nothing after that point is used.
+  bool is_complete() {
+    if (model_type == TRACK_MODEL) {
+      return track_count >= num_tracks;
+    }
+    return infill_bar_count >= num_infill_bars;
+  }
+
+  // update the state with the tokens that have not been seen yet. marks
+  // the sequence as finished as soon as it is complete, without waiting
+  // for the next mask.
+  bool advance(std::vector<int> &tokens) {
     for (int t=token_position; t<tokens.size(); t++) {
       if (verbose) {
         std::cout << "UPDATING [" << token_position << "] :: " << enc->rep->pretty(tokens[t]) << std::endl;
       }
       update( tokens[t] );
+      if (!decoding_paused) {
+        decoder->push( tokens[t] );
+      }
       history.push_back( tokens[t] );
       token_position++;
     }
+    if (is_complete()) {
+      finished = true;
+    }
+    return finished;
+  }
+
+  // the piece decoded from tokens. the tokens are decoded as the state is
+  // updated, so only the tokens that have not been seen yet are decoded
+  // here. the decoder is finished, so no more tokens can be added.
+  void get_piece(std::vector<int> &tokens, midi::Piece *piece) {
+    MetricsTimer timer("decode");
+    advance(tokens);
+    decoder->finish();
+    piece->Swap(&decoded);
+  }
 
+  std::vector<int> get_mask(std::vector<int> &tokens) {
+    MetricsTimer timer("get_mask");
+    std::vector<int> mask(enc->rep->max_token(), 0);
+    advance(tokens);
     set_mask(tokens.back(), mask);
     return mask;
   }
@@ -1097,9 +1270,9 @@ public:
     rg->validate_sequence(tokens);
   }
 
-  // map from pitch to when it expires
-  std::map<int,std::vector<int>> note_expiry; // time -> list of pitches
-  std::set<int> onsets;
+  NOTE_EXPIRY_QUEUE note_expiry;
+  std::bitset<128> onsets; // pitches that are currently sounding
+  std::bitset<128> touched;
   int last_token;
   midi::TRACK_TYPE current_track_type;
 
@@ -1128,17 +1301,24 @@ public:
   bool finished;
   MODEL_TYPE model_type;
   std::vector<int> history;
+  std::vector<CONTROL_STATE> placeholder_states;
 
   bool verbose;
   int polyphony_hard_limit;
   std::vector<int> polyphony_hard_limits;
   std::vector<float> track_temperatures;
   std::vector<std::pair<int,int>> selected_bars;
+  std::mt19937 engine; // draws tokens, see sample_candidates
 
   //ENCODER *enc;
   std::unique_ptr<ENCODER> enc;
   REPRESENTATION *rep;
-  REP_GRAPH *rg;
+  REP_GRAPH *rg; // shared, see get_shared_rep_graph
+
+  // the sequence is decoded as it is sampled, see get_piece
+  midi::Piece decoded;
+  std::unique_ptr<IncrementalDecoder<>> decoder;
+  bool decoding_paused;
 
 };
 
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../protobuf/midi.pb.h"
+
+// START OF NAMESPACE
+namespace mmm {
+
+// spans after this many are only added to the timings, which keeps the
+// trace of a long generation bounded
+static const int MAX_TRACE_EVENTS = 100000;
+
+std::atomic<bool> &global_metrics_flag() {
+  static std::atomic<bool> enabled(false);
+  return enabled;
+}
+
+// turns on metrics for every call, as if SampleParam.collect_metrics was set
+void set_metrics_enabled(bool enabled) {
+  global_metrics_flag() = enabled;
+}
+
+bool metrics_enabled(midi::SampleParam *param) {
+  return global_metrics_flag() || ((param) && (param->collect_metrics()));
+}
+
+// collects the spans timed on one thread during a single call
+class MetricsRecorder {
+public:
+  using clock = std::chrono::steady_clock;
+
+  MetricsRecorder() {
+    start = clock::now();
+  }
+
+  void add(const char *name, clock::time_point begin, clock::time_point end) {
+    double ms = std::chrono::duration<double,std::milli>(end - begin).count();
+    TIMING &t = timings[name];
+    t.count++;
+    t.total_ms += ms;
+    t.max_ms = std::max(t.max_ms, ms);
+    if (events.size() < MAX_TRACE_EVENTS) {
+      events.push_back( {name,
+        std::chrono::duration_cast<std::chrono::microseconds>(
+          begin - start).count(),
+        std::chrono::duration_cast<std::chrono::microseconds>(
+          end - begin).count()} );
+    }
+  }
+
+  void to_protobuf(midi::SampleMetrics *metrics) const {
+    metrics->Clear();
+    for (const auto &kv : timings) {
+      midi::SampleTiming *t = metrics->add_timings();
+      t->set_name( kv.first );
+      t->set_count( kv.second.count );
+      t->set_total_ms( kv.second.total_ms );
+      t->set_max_ms( kv.second.max_ms );
+    }
+    for (const auto &event : events) {
+      midi::SampleTraceEvent *e = metrics->add_events();
+      e->set_name( event.name );
+      e->set_start_us( event.start_us );
+      e->set_duration_us( event.duration_us );
+    }
+    metrics->set_total_ms( std::chrono::duration<double,std::milli>(
+      clock::now() - start).count() );
+  }
+
+  struct TIMING {
+    int64_t count = 0;
+    double total_ms = 0;
+    double max_ms = 0;
+  };
+  struct EVENT {
+    const char *name;
+    int64_t start_us;
+    int64_t duration_us;
+  };
+
+  clock::time_point start;
+  std::map<std::string,TIMING> timings;
+  std::vector<EVENT> events;
+};
+
+// the recorder of the call running on this thread, if any
+MetricsRecorder *&current_metrics() {
+  static thread_local MetricsRecorder *recorder = NULL;
+  return recorder;
+}
+
+// makes a recorder current for the calling thread for the lifetime of the
+// object. with a NULL recorder nothing is recorded.
+class MetricsScope {
+public:
+  MetricsScope(MetricsRecorder *recorder) {
+    prev = current_metrics();
+    current_metrics() = recorder;
+  }
+  ~MetricsScope() {
+    current_metrics() = prev;
+  }
+
+  MetricsRecorder *prev;
+};
+
+// times its own lifetime as a span called name. name must outlive the
+// recorder, so it should be a string literal. when no recorder is current
+// the clock is not read.
+class MetricsTimer {
+public:
+  MetricsTimer(const char *n) {
+    name = n;
+    recorder = current_metrics();
+    if (recorder) {
+      begin = MetricsRecorder::clock::now();
+    }
+  }
+  ~MetricsTimer() {
+    stop();
+  }
+
+  // ends the span before the end of the enclosing scope
+  void stop() {
+    if (recorder) {
+      recorder->add(name, begin, MetricsRecorder::clock::now());
+      recorder = NULL;
+    }
+  }
+
+  const char *name;
+  MetricsRecorder *recorder;
+  MetricsRecorder::clock::time_point begin;
+};
+
+// the spans of a call in the Chrome trace event format, which can be opened
+// in chrome://tracing or https://ui.perfetto.dev
+std::string metrics_to_chrome_trace(const midi::SampleMetrics &metrics) {
+  std::ostringstream ss;
+  ss << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  for (int i=0; i<metrics.events_size(); i++) {
+    const midi::SampleTraceEvent &e = metrics.events(i);
+    if (i > 0) {
+      ss << ",";
+    }
+    ss << "{\"name\":\"" << e.name() << "\",\"ph\":\"X\",\"pid\":0,\"tid\":0";
+    ss << ",\"ts\":" << e.start_us() << ",\"dur\":" << e.duration_us() << "}";
+  }
+  ss << "]}";
+  return ss.str();
+}
+
+void write_chrome_trace(const midi::SampleMetrics &metrics, const std::string &path) {
+  std::ofstream out(path);
+  if (!out.is_open()) {
+    throw std::runtime_error("COULD NOT OPEN " + path);
+  }
+  out << metrics_to_chrome_trace(metrics);
+}
+
+}
+// END OF NAMESPACE
@@ -4,10 +4,16 @@
 #include <algorithm>
 
 #include "sample_internal.h"
+#include "threads.h"
+#include "bar_mask.h"
 #include "../protobuf/util.h"
 
 namespace mmm {
 
+// the piece is compacted between steps once more than this fraction of its
+// events are no longer used by any bar
+const double EVENT_COMPACTION_THRESHOLD = 0.5;
+
 template <typename T>
 void show_vector(const std::vector<T> &x, bool show_shape=true) {
   if (show_shape) {
@@ -120,12 +126,11 @@ void status_rehighlight(midi::Status *status, std::set<std::tuple<int,int>> &bar
   }
 }
 
-midi::Status status_subset(midi::Status *status, int start_bar, int end_bar, std::vector<int> &track_indices) {
-  midi::Status subset;
+void status_subset(midi::Status *status, int start_bar, int end_bar, std::vector<int> &track_indices, midi::Status *subset) {
   int track_count = 0;
   for (const auto track_index : track_indices) {
-    const midi::StatusTrack track = status->tracks(track_index);
-    midi::StatusTrack *t = subset.add_tracks();
+    const midi::StatusTrack &track = status->tracks(track_index);
+    midi::StatusTrack *t = subset->add_tracks();
     t->CopyFrom(track);
     t->set_track_id(track_count);
     t->clear_selected_bars();
@@ -138,6 +143,11 @@ midi::Status status_subset(midi::Status *status, int start_bar, int end_bar, std
     }
     track_count++;
   }
+}
+
+midi::Status status_subset(midi::Status *status, int start_bar, int end_bar, std::vector<int> &track_indices) {
+  midi::Status subset;
+  status_subset(status, start_bar, end_bar, track_indices, &subset);
   return subset;
 }
 
@@ -151,19 +161,18 @@ void update_status_instruments(midi::Piece *piece, midi::Status *status) {
   }
 }
 
-midi::Piece piece_subset(midi::Piece *piece, int start_bar, int end_bar, std::vector<int> &track_indices) {
+void piece_subset(midi::Piece *piece, int start_bar, int end_bar, std::vector<int> &track_indices, midi::Piece *subset) {
   // grab a subset of a piece
-  // NOTE : we do this the lazy way leaving extra events in the events field
-  midi::Piece subset;
-  subset.set_resolution( piece->resolution() );
-  subset.set_tempo( piece->tempo() );
+  // only the events of the selected bars are copied into the subset
+  subset->set_resolution( piece->resolution() );
+  subset->set_tempo( piece->tempo() );
   int track_count = 0;
   for (const auto track_index : track_indices) {
     if (track_index >= piece->tracks_size()) {
       throw std::runtime_error("TRYING TO ACCESS TRACK OUT OF RANGE. PIECE IS LIKELY MALFORMED");
     }
-    const midi::Track track = piece->tracks(track_index);
-    midi::Track *t = subset.add_tracks();
+    const midi::Track &track = piece->tracks(track_index);
+    midi::Track *t = subset->add_tracks();
     t->CopyFrom(track);
     t->clear_bars();
     for (int i=start_bar; i<end_bar; i++) {
@@ -172,13 +181,18 @@ midi::Piece piece_subset(midi::Piece *piece, int start_bar, int end_bar, std::ve
       b->clear_events();
 
       for (const auto event : track.bars(i).events()) {
-        b->add_events( subset.events_size() );
-        midi::Event *e = subset.add_events();
+        b->add_events( subset->events_size() );
+        midi::Event *e = subset->add_events();
         e->CopyFrom( piece->events(event) );
       }
     }
     track_count++;
   }
+}
+
+midi::Piece piece_subset(midi::Piece *piece, int start_bar, int end_bar, std::vector<int> &track_indices) {
+  midi::Piece subset;
+  piece_subset(piece, start_bar, end_bar, track_indices, &subset);
   return subset;
 }
 
@@ -319,226 +333,155 @@ void piece_insert_old(midi::Piece *piece, midi::Piece *x, int start, std::vector
 
 class STEP {
 public:
-  STEP (int sstart, int eend, std::vector<std::vector<bool>> &sstep, std::vector<std::vector<bool>> &ccontext) {
+  STEP (int sstart, int eend, const BarMask &sstep, const BarMask &ccontext) {
     start = sstart;
     end = eend;
     step = sstep;
     context = ccontext;
   }
 
-  STEP (const STEP &old) {
-    start = old.start;
-    end = old.end;
-    step = old.step;
-    context = old.context;
-  }
-
   STEP () {
     start = 0;
     end = 0;
   }
 
   int generated_bar_count() const {
-    int count = 0;
-    for (const auto x : step) {
-      for (const auto xx : x) {
-        count += (int)xx;
-      }
-    }
-    return count;
+    return step.count();
   }
 
   int start;
   int end;
-  std::vector<std::vector<bool>> step;
-  std::vector<std::vector<bool>> context;
+  BarMask step;
+  BarMask context;
 };
 
-void find_steps_inner(std::vector<STEP> &steps, std::vector<std::vector<bool>> &selection_matrix, std::vector<bool> &resample_mask, std::vector<bool> &ignore_mask, bool autoregressive, std::vector<std::vector<bool>> &generated, midi::SampleParam *param) {
+void find_steps_inner(std::vector<STEP> &steps, const BarMask &selection_matrix, std::vector<bool> &resample_mask, std::vector<bool> &ignore_mask, bool autoregressive, BarMask &generated, midi::SampleParam *param) {
 
   int tracks_per_step = param->tracks_per_step();
   int bars_per_step = param->bars_per_step();
   int model_dim = param->model_dim();
   int current_num_steps = steps.size();
 
-  std::vector<std::vector<bool>> sel(selection_matrix);
+  BarMask sel(selection_matrix);
 
-  int nt = sel.size();
-  int nb = sel[0].size();
+  int nt = sel.num_tracks;
+  int nb = sel.num_bars;
   
   // if autoregressive only consider resample_mask
-  for (int i=0; i<sel.size(); i++) {
-    for (int j=0; j<sel[i].size(); j++) {
-      if (autoregressive) {
-        sel[i][j] = sel[i][j] & resample_mask[i];
-      }
-      else {
-        sel[i][j] = sel[i][j] & ~resample_mask[i];
-      }
+  std::vector<bool> track_selected(nt, false);
+  for (int i=0; i<nt; i++) {
+    if (resample_mask[i] != autoregressive) {
+      std::fill(sel.row(i), sel.row(i) + sel.num_words, 0);
     }
+    track_selected[i] = sel.any_in_row(i);
   }
 
   if (param->verbose()) {
     std::cout << "AUTOREGRESSIVE = " << autoregressive << std::endl;
     std::cout << "SELECTION MATRIX : " << std::endl;
-    show_matrix(sel);
+    show_matrix(sel.to_matrix());
     std::cout << "GLOBAL SELECTION MATRIX : " << std::endl;
-    show_matrix(selection_matrix);
+    show_matrix(selection_matrix.to_matrix());
   }
 
-  // generated should be a zeros matrix
-  std::vector<std::vector<bool>> covered(sel.size(), std::vector<bool>(sel[0].size(),false));
+  BarMask covered(nt, nb);
 
   // the min tracks per step is 1
   // the max tracks per step is the number of tracks in the piece
-  tracks_per_step = std::max(std::min(tracks_per_step, (int)sel.size()), 1);
+  tracks_per_step = std::max(std::min(tracks_per_step, nt), 1);
 
   // the min bars per step is 1
   // the max bars per step is the model dim
   bars_per_step = std::max(std::min(bars_per_step, model_dim), 1);
 
-  std::vector<int> tracks_to_consider = arange(0, (int)sel.size(), 1);
-
   int num_context = (model_dim - bars_per_step) / 2;
-  if (autoregressive) {
-    int num_context = (model_dim - bars_per_step);
-  }
-
-  std::vector<std::tuple<int,int>> ijs;
-  for (int i=0; i<sel.size(); i=i+tracks_per_step) {
-    for (int j=0; j<sel[i].size(); j=j+bars_per_step) {
-      ijs.push_back( std::make_tuple(i,j) );
-    }
-  }
-
-  // we should do these things afterwards
-  /*
-  if ((param->shuffle()) && (!autoregressive)) {
-    std::random_device rd;
-    std::mt19937 g(rd());
-    std::shuffle(ijs.begin(), ijs.end(), g);
-  }
-  if ((param->percentage() < 100) && (!autoregressive)) {
-    int new_size = ijs.size() * ((float)param->percentage() / 100.);
-    ijs.resize(std::max(new_size,1));
-  }
-  */
 
-  //for (int i=0; i<sel.size(); i=i+tracks_per_step) {
-  //  for (int j=0; j<sel[i].size(); j=j+bars_per_step) {
-  
-  for (const auto ij : ijs) {
-
-    int i = std::get<0>(ij);
-    int j = std::get<1>(ij);
-
-    int kii, kjj; // iterators for the kernel
+  for (int i=0; i<nt; i=i+tracks_per_step) {
+    for (int j=0; j<nb; j=j+bars_per_step) {
 
-    int num_tracks = std::min(tracks_per_step,(int)sel.size()-i);
-    std::vector<std::vector<bool>> kernel(num_tracks,std::vector<bool>(model_dim,false));
+      int num_tracks = std::min(tracks_per_step, nt-i);
 
-    int t = 0;
-    if (autoregressive) {
-      // for the first step we have no generated material to 
-      // condition on so we use entire model window
-      // after the first step (j>0) we only generate bars_per_step bars
-      int right_offset = std::max((j + model_dim) - nb,0);
-      t = std::min(j, nb - model_dim);
+      // the kernel covers the bars [kernel_start,kernel_end) of the
+      // num_tracks tracks starting at track i. the model sees the window
+      // [t,t+model_dim)
+      int t = 0;
+      int kernel_start = 0;
+      int kernel_end = 0;
+      if (autoregressive) {
+        // for the first step we have no generated material to 
+        // condition on so we use entire model window
+        // after the first step (j>0) we only generate bars_per_step bars
+        int right_offset = std::max((j + model_dim) - nb,0);
+        t = std::min(j, nb - model_dim);
+        kernel_start = t + (j>0)*(num_context+right_offset);
+        kernel_end = t + model_dim;
+      }
+      else {
+        // we want to have the generated bars at the center
+        // this is not possible at beginning and end so we adjust
+        // for those cases
+        t = std::min(std::max(j - num_context,0), nb - model_dim);
+        kernel_start = j;
+        kernel_end = std::min(j + bars_per_step, t + model_dim);
+      }
+      int window_start = t / 64;
+      int window_end = (t + model_dim + 63) / 64;
 
-      for (int k=(j>0)*(num_context+right_offset); k<model_dim; k++) {
-        for (int n=0; n<num_tracks; n++) {
-          kernel[n][k] = true;
-        }
-      } 
-    }
-    else {
-      // we want to have the generated bars at the center
-      // this is not possible at beginning and end so we adjust
-      // for those cases
-      t = std::min(std::max(j - num_context,0), nb - model_dim);
-      
-      for (int k=j-t; k<j-t+bars_per_step; k++) {
-        for (int n=0; n<num_tracks; n++) {
-          kernel[n][k] = true;
-        }
+      if (param->verbose()) {
+        std::cout << "CHECKING STEP : " << i << " " << j << std::endl;
+        std::cout << "T = " << t << std::endl;
+        std::cout << "NUM TRACKS = " << num_tracks << std::endl;
       }
-    }
 
-    
-    if (param->verbose()) {
-      std::cout << "CHECKING STEP : " << i << " " << j << std::endl;
-      std::cout << "T = " << t << std::endl;
-      std::cout << "NUM TRACKS = " << num_tracks << std::endl;
-    }
-    
-    
-    // check
-    //assert not np.any(covered[i:i+num_tracks,t:t+model_dim] & kernel)
-
-    std::vector<std::vector<bool>> step(nt,std::vector<bool>(nb,false));
-    std::vector<std::vector<bool>> context(nt,std::vector<bool>(nb,false));
-
-    kii = 0;
-    for (int k=i; k<i+num_tracks; k++) {
-      kjj = 0;
-      for (int n=t; n<t+model_dim; n++) {
-        step[k][n] = sel[k][n] * kernel[kii][kjj];
-        if (autoregressive) {
-          // if autoregressive don't generate what
-          // we already have generated ...
-          step[k][n] = step[k][n] & (!generated[k][n]);
+      BarMask step(nt, nb);
+      BarMask context(nt, nb);
+
+      for (int k=i; k<i+num_tracks; k++) {
+        for (int w=window_start; w<window_end; w++) {
+          uint64_t kernel = bar_range_word(kernel_start, kernel_end, w);
+          step.row(k)[w] = sel.row(k)[w] & kernel;
+          if (autoregressive) {
+            // if autoregressive don't generate what
+            // we already have generated ...
+            step.row(k)[w] &= ~generated.row(k)[w];
+          }
         }
-        kjj++;
       }
-      kii++;
-    }
-
-    if (param->verbose()) {
-      show_matrix(step);
-      show_matrix(generated);
-    }
 
-    // set context
-    for (int k=0; k<nt; k++) {
-      for (int n=t; n<t+model_dim; n++) {
-        context[k][n] = ~ignore_mask[k] & ~step[k][n];
+      if (param->verbose()) {
+        show_matrix(step.to_matrix());
+        show_matrix(generated.to_matrix());
       }
-    }
 
-    // refine context so that we don't look into future
-    // on tracks we are auto-regressively sampling
-    if (autoregressive) {
+      // set context. every bar of the window is context, apart from the
+      // tracks we are auto-regressively sampling, where we don't look into
+      // the future and only use what has been generated so far
       for (int k=0; k<nt; k++) {
-        if (any(sel[k])) {
-          for (int n=t; n<t+model_dim; n++) {
-            context[k][n] = generated[k][n];
-          }
+        bool causal = autoregressive && track_selected[k];
+        for (int w=window_start; w<window_end; w++) {
+          uint64_t window = bar_range_word(t, t + model_dim, w);
+          context.row(k)[w] = causal ? (generated.row(k)[w] & window) : window;
         }
       }
-    }
 
-    if (any(step)) {
-      steps.push_back(STEP(t, t+model_dim, step, context));
-    }
+      if (step.any()) {
+        steps.push_back(STEP(t, t+model_dim, step, context));
+      }
 
-    kii = 0;
-    for (int k=i; k<i+num_tracks; k++) {
-      kjj = 0;
-      for (int n=t; n<t+model_dim; n++) {
-        generated[k][n] = std::max(generated[k][n], step[k][n]);
-        covered[k][n] = std::max(covered[k][n], kernel[kii][kjj]);
-        kjj++;
+      for (int k=i; k<i+num_tracks; k++) {
+        for (int w=window_start; w<window_end; w++) {
+          generated.row(k)[w] |= step.row(k)[w];
+          covered.row(k)[w] |= bar_range_word(kernel_start, kernel_end, w);
+        }
       }
-      kii++;
     }
-
   }
 
   if (param->verbose()) {
     std::cout << "COVERED MATRIX : " << std::endl;
-    show_matrix(covered);
+    show_matrix(covered.to_matrix());
   }
-  if (!all(covered)) {
+  if (!covered.all()) {
     throw std::runtime_error("PIECE IS ONLY PARTIALLY COVERED");
   }
 
@@ -556,25 +499,27 @@ void find_steps_inner(std::vector<STEP> &steps, std::vector<std::vector<bool>> &
 }
 
 std::vector<STEP> find_steps(std::vector<std::vector<bool>> &sel, std::vector<bool> &resample_mask, std::vector<bool> &ignore_mask, midi::SampleParam *param) {
+  MetricsTimer timer("find_steps");
 
   std::vector<STEP> steps;
-  std::vector<std::vector<bool>> generated(sel.size(), std::vector<bool>(sel[0].size(),false));
+  BarMask selection(sel);
+  BarMask generated(selection.num_tracks, selection.num_bars);
 
   find_steps_inner(
-    steps, sel, resample_mask, ignore_mask, true, generated, param);
+    steps, selection, resample_mask, ignore_mask, true, generated, param);
   find_steps_inner(
-    steps, sel, resample_mask, ignore_mask, false, generated, param);
+    steps, selection, resample_mask, ignore_mask, false, generated, param);
 
   return steps;
 }
 
-midi::Piece generate_callback_inner(midi::Piece *piece, midi::Status *status, midi::SampleParam *param, Debugger *debug, ModelMeta *model, CallbackManager *callbacks) {
+std::vector<midi::Piece> generate_callback_inner(midi::Piece *piece, midi::Status *status, midi::SampleParam *param, Debugger *debug, ModelMeta *model, CallbackManager *callbacks, ModelMeta *draft=NULL, StopCondition *stop=NULL) {
 
-  return generate(status, piece, param, debug, model, callbacks)[0];
+  return generate(status, piece, param, debug, model, callbacks, draft, stop);
 
 }
 
-void sample_step(midi::Piece *piece, midi::Status *status, midi::SampleParam *param, Debugger *debug, ModelMeta *model, const STEP *s, CallbackManager *callbacks) {
+void sample_step(midi::Piece *piece, midi::Status *status, midi::SampleParam *param, Debugger *debug, ModelMeta *model, const STEP *s, CallbackManager *callbacks, ModelMeta *draft=NULL, StopCondition *stop=NULL) {
 
   /*
   if (param->verbose()) {
@@ -588,15 +533,15 @@ void sample_step(midi::Piece *piece, midi::Status *status, midi::SampleParam *pa
   std::set<std::tuple<int,int>> bars_to_generate;
   std::vector<std::tuple<int,int,int,int>> bar_mapping;
   int track_count = 0;
-  int num_tracks = s->step.size();
+  int num_tracks = s->step.num_tracks;
   for (int i=0; i<num_tracks; i++) {
     bool track_used = false;
     for (int j=s->start; j<s->end; j++) {
-      if (s->step[i][j]) {
+      if (s->step.get(i,j)) {
         bars_to_generate.insert( std::make_tuple(track_count,j-s->start) );
         bar_mapping.push_back( std::make_tuple(track_count,j-s->start,i,j) );
       }
-      if (s->step[i][j] || s->context[i][j]) {
+      if (s->step.get(i,j) || s->context.get(i,j)) {
         track_set.insert( i );
         track_used = true;
       }
@@ -608,39 +553,66 @@ void sample_step(midi::Piece *piece, midi::Status *status, midi::SampleParam *pa
   std::vector<int> tracks(track_set.begin(), track_set.end());
   //std::vector<int> gen_tracks(gen_track_set.begin(), gen_track_set.end());
 
-  midi::Status step_status = status_subset(status, s->start, s->end, tracks);
-  if (bars_to_generate.size()) {
-    status_rehighlight(&step_status, bars_to_generate);
+  // the messages of this step are allocated on an arena, which is freed in
+  // one go when the step ends
+  google::protobuf::Arena arena;
+  midi::Status *step_status =
+    google::protobuf::Arena::CreateMessage<midi::Status>(&arena);
+  midi::Piece *step_piece =
+    google::protobuf::Arena::CreateMessage<midi::Piece>(&arena);
+  {
+    MetricsTimer timer("piece_subset");
+    status_subset(status, s->start, s->end, tracks, step_status);
+    if (bars_to_generate.size()) {
+      status_rehighlight(step_status, bars_to_generate);
+    }
+    // ISSUE : likely fails when piece -> status track mapping is not identity
+    piece_subset(piece, s->start, s->end, tracks, step_piece);
   }
-  // ISSUE : likely fails when piece -> status track mapping is not identity
-  midi::Piece step_piece = piece_subset(piece, s->start, s->end, tracks);
 
   if (param->verbose()) {
     std::cout << "GENERATION STEP INPUTS ::" << std::endl;
     show_vector(tracks);
-    print_piece_summary(&step_piece);
-    print_protobuf(&step_piece);
-    print_status(&step_status);
+    print_piece_summary(step_piece);
+    print_protobuf(step_piece);
+    print_status(step_status);
   }
 
   //print_piece_summary(&step_piece); 
 
-  midi::Piece gen_piece = generate_callback_inner(
-    &step_piece, &step_status, param, debug, model, callbacks);
+  // streamed bars are reported at their position in the piece
+  if (callbacks) {
+    std::map<std::tuple<int,int>,std::tuple<int,int>> stream_mapping;
+    for (const auto &m : bar_mapping) {
+      stream_mapping[std::make_tuple(std::get<0>(m),std::get<1>(m))] =
+        std::make_tuple(std::get<2>(m),std::get<3>(m));
+    }
+    callbacks->set_stream_mapping(stream_mapping);
+  }
+
+  std::vector<midi::Piece> output = generate_callback_inner(
+    step_piece, step_status, param, debug, model, callbacks, draft, stop);
 
   // update debug.order here
   if (debug) {
     std::vector<bool> is_autoreg;
     for (int i=0; i<debug->orders.back().size(); i++) {
       is_autoreg.push_back( 
-        step_status.tracks(debug->orders.back()[i]).autoregressive() );
+        step_status->tracks(debug->orders.back()[i]).autoregressive() );
       debug->orders.back()[i] = tracks[debug->orders.back()[i]];
     }
     debug->is_autoregressive.push_back( is_autoreg );
   }
+
+  // the step hit max_steps or was stopped, so there is nothing to insert
+  if (output.size() == 0) {
+    return;
+  }
+  midi::Piece &gen_piece = output[0];
   
   // NOTE : this inserts tracks that are just conditioned on as well
   //piece_insert_old(piece, &gen_piece, s->start, tracks);
+  MetricsTimer timer("piece_insert");
   piece_insert(piece, &gen_piece, bar_mapping, param->verbose());
   
   //update_status_instruments(piece, status);
@@ -656,21 +628,30 @@ void sample_step(midi::Piece *piece, midi::Status *status, midi::SampleParam *pa
 
 }
 
-void sample_w_debug(midi::Piece *piece, midi::Status *raw_status, midi::SampleParam *param, Debugger *debug, CallbackManager *callbacks=NULL) {
+SAMPLE_STATUS sample_w_debug_inner(midi::Piece *piece, midi::Status *raw_status, midi::SampleParam *param, Debugger *debug, CallbackManager *callbacks, CancellationToken *cancel_token) {
   if ((!piece) || (!raw_status) || (!param)) {
     throw std::invalid_argument("Piece, Status or SampleParam is malformed");
   }
 
+  // the deadline includes loading the model
+  StopCondition stop(param, cancel_token);
+
+  // thread settings hold for the rest of this call
+  ThreadScope thread_scope(param);
+
   // don't modify status in place
   midi::Status status_ob(*raw_status);
   midi::Status *status = &status_ob;
 
-  // try to load model
-  ModelMeta model;
+  // try to load model. loaded models are shared by every call, so they
+  // are used through a pointer and never modified
+  MetricsTimer load_timer("model_load");
+  ModelMeta random_model;
+  ModelMeta *model = &random_model;
   if (!param->internal_random_sample_mode()) {
-    load_model(param->ckpt(), &model);
-    if (model.meta.model_dim() != -1) {
-      param->set_model_dim(model.meta.model_dim());
+    model = get_shared_model(param->ckpt(), param->use_quantized_model());
+    if (model->meta.model_dim() != -1) {
+      param->set_model_dim(model->meta.model_dim());
     }
   }
   else {
@@ -678,14 +659,28 @@ void sample_w_debug(midi::Piece *piece, midi::Status *raw_status, midi::SamplePa
       throw std::invalid_argument
       ("MUST SET MODEL DIM MANUALLY IF USING RANDOM SAMPLE MODE");
     }
-    model.meta.set_encoder(param->ckpt());
-    model.meta.set_model_dim(param->model_dim());
+    random_model.meta.set_encoder(param->ckpt());
+    random_model.meta.set_model_dim(param->model_dim());
+  }
+
+  // try to load the draft model used for speculative sampling
+  ModelMeta *draft = NULL;
+  bool use_draft = (param->draft_ckpt().size() > 0) &&
+    (!param->internal_random_sample_mode());
+  if (use_draft) {
+    draft = get_shared_model(
+      param->draft_ckpt(), param->use_quantized_model());
+    if (draft->meta.encoder() != model->meta.encoder()) {
+      throw std::invalid_argument(
+        "DRAFT MODEL MUST USE THE SAME ENCODER AS THE MODEL");
+    }
   }
+  load_timer.stop();
 
   // we run into problems if nb < model_dim
 
   std::unique_ptr<ENCODER> enc = getEncoder(
-    getEncoderType(model.meta.encoder()));
+    getEncoderType(model->meta.encoder()));
   if (!enc.get()) {
     throw std::invalid_argument("INVALID ENCODER");
   }
@@ -718,7 +713,7 @@ void sample_w_debug(midi::Piece *piece, midi::Status *raw_status, midi::SamplePa
 
   std::vector<std::vector<bool>> selection_mask = status_to_selection_mask(status);
   if (!any(selection_mask)) {
-    return; // nothing to do
+    return SAMPLE_COMPLETE; // nothing to do
   }
 
   std::vector<bool> resample_mask = status_to_resample_mask(status);
@@ -735,23 +730,23 @@ void sample_w_debug(midi::Piece *piece, midi::Status *raw_status, midi::SamplePa
     std::cout << "IGNORE MASK ..." << std::endl;
     show_vector(ignore_mask);
     int step_num = 0;
-    for (const auto step : steps) {
+    for (const auto &step : steps) {
       std::cout << "=========================" << std::endl;
       std::cout << "STEP " << step_num << "/" << steps.size() << std::endl; 
-      show_matrix(step.step);
-      show_matrix(step.context);
+      show_matrix(step.step.to_matrix());
+      show_matrix(step.context.to_matrix());
       step_num++;
     }
   }
 
   if (steps.size() == 0) {
     // nothing to be done
-    return;
+    return SAMPLE_COMPLETE;
   }
 
   // find the total number of bars to be generated
   int bar_count = 0;
-  for (const auto step : steps) {
+  for (const auto &step : steps) {
     bar_count += step.generated_bar_count();
   }
   if (callbacks) {
@@ -773,16 +768,58 @@ void sample_w_debug(midi::Piece *piece, midi::Status *raw_status, midi::SamplePa
     [&order](size_t i, size_t j) {return order[i] < order[j];});
   
   reorder_tracks(piece, order);
+  if (callbacks) {
+    callbacks->set_stream_track_order(reverse_order);
+  }
 
-  for (const auto step : steps) {
-    sample_step(piece, status, param, debug, &model, &step, callbacks);
+  for (const auto &step : steps) {
+    if (stop.check()) {
+      break;
+    }
+    sample_step(piece, status, param, debug, model, &step, callbacks,
+      draft, &stop);
+    // each step orphans the events of the bars it replaced
+    compact_events(piece, EVENT_COMPACTION_THRESHOLD, param->verbose());
   }
+  compact_events(piece, 0, param->verbose());
 
   reorder_tracks(piece, reverse_order);
+
+  if ((param->verbose()) && (stop.stopped())) {
+    std::cout << "SAMPLING STOPPED EARLY" << std::endl;
+  }
+  return stop.status;
+}
+
+// generation stops early when cancel_token is cancelled or when
+// SampleParam.timeout_ms has passed. the status tells which happened.
+// when metrics are enabled the timing breakdown of the call is written to
+// metrics and debug->metrics.
+SAMPLE_STATUS sample_w_debug(midi::Piece *piece, midi::Status *raw_status, midi::SampleParam *param, Debugger *debug, CallbackManager *callbacks=NULL, CancellationToken *cancel_token=NULL, midi::SampleMetrics *metrics=NULL) {
+  if (!metrics_enabled(param)) {
+    return sample_w_debug_inner(
+      piece, raw_status, param, debug, callbacks, cancel_token);
+  }
+  MetricsRecorder recorder;
+  SAMPLE_STATUS status;
+  {
+    MetricsScope scope(&recorder);
+    MetricsTimer timer("sample");
+    status = sample_w_debug_inner(
+      piece, raw_status, param, debug, callbacks, cancel_token);
+  }
+  if (metrics) {
+    recorder.to_protobuf(metrics);
+  }
+  if (debug) {
+    recorder.to_protobuf(&debug->metrics);
+  }
+  return status;
 }
 
-void sample(midi::Piece *piece, midi::Status *status, midi::SampleParam *param, CallbackManager *callbacks=NULL) {
-  sample_w_debug(piece, status, param, NULL, callbacks);
+SAMPLE_STATUS sample(midi::Piece *piece, midi::Status *status, midi::SampleParam *param, CallbackManager *callbacks=NULL, CancellationToken *cancel_token=NULL, midi::SampleMetrics *metrics=NULL) {
+  return sample_w_debug(
+    piece, status, param, NULL, callbacks, cancel_token, metrics);
 }
 
 std::string sample_multi_step_py(std::string &piece_json, std::string &status_json, std::string &param_json) {
@@ -798,4 +835,24 @@ std::string sample_multi_step_py(std::string &piece_json, std::string &status_js
   return output;
 }
 
+// like sample_multi_step_py, but also returns how sampling ended, so that a
+// piece cut short by timeout_ms or max_steps can be told apart from a
+// complete one, and the timing breakdown as json (empty unless
+// collect_metrics is set)
+std::tuple<std::string,SAMPLE_STATUS,std::string> sample_multi_step_w_status_py(std::string &piece_json, std::string &status_json, std::string &param_json) {
+  midi::Piece p;
+  midi::Status s;
+  midi::SampleParam h;
+  google::protobuf::util::JsonStringToMessage(piece_json.c_str(), &p);
+  google::protobuf::util::JsonStringToMessage(status_json.c_str(), &s);
+  google::protobuf::util::JsonStringToMessage(param_json.c_str(), &h);
+  midi::SampleMetrics metrics;
+  SAMPLE_STATUS result = sample(&p, &s, &h, NULL, NULL, &metrics);
+  std::string output;
+  google::protobuf::util::MessageToJsonString(p, &output);
+  std::string metrics_output;
+  google::protobuf::util::MessageToJsonString(metrics, &metrics_output);
+  return std::make_tuple(output, result, metrics_output);
+}
+
 }
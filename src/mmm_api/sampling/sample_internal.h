@@ -4,15 +4,23 @@
 #include <torch/nn/functional/activation.h>
 //#include <torch/nn/modules/functional.h>
 
+#include <fstream>
 #include <iostream>
 #include <string>
 #include <vector>
+#include <algorithm>
 #include <array>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
 #include <set>
+#include <tuple>
 
 #include "../encoder/encoder_all.h"
 #include "../enum/model_type.h"
 #include "control.h"
+#include "cancel.h"
 
 namespace mmm {
 
@@ -27,7 +35,28 @@ static const int NUM_LAYERS = 6;
 // additional constraints
 // 1. can't start a note that is already sounding ()
 
-void load_model(const std::string &ckpt_path, ModelMeta *m) {
+// the int8 variant of a checkpoint. this is quantized_ckpt from its metadata
+// (relative to the checkpoint) if set, otherwise the _int8.pt sibling
+// written by scripts/quantize_model.py if it exists, otherwise empty.
+std::string quantized_ckpt_path(const std::string &ckpt_path, midi::ModelMetadata *meta) {
+  std::string path = meta->quantized_ckpt();
+  if (path.size()) {
+    size_t pos = ckpt_path.find_last_of("/\\");
+    if ((path[0] != '/') && (pos != std::string::npos)) {
+      path = ckpt_path.substr(0, pos + 1) + path;
+    }
+    return path;
+  }
+  size_t ext = ckpt_path.rfind(".pt");
+  if ((ext == std::string::npos) || (ext + 3 != ckpt_path.size())) {
+    return "";
+  }
+  path = ckpt_path.substr(0, ext) + "_int8.pt";
+  std::ifstream f(path);
+  return f.good() ? path : "";
+}
+
+void load_model(const std::string &ckpt_path, ModelMeta *m, bool quantized=false) {
   try {
     std::unordered_map<std::string, std::string> loaded_extra_files;
     loaded_extra_files["metadata.json"] = "";
@@ -42,9 +71,166 @@ void load_model(const std::string &ckpt_path, ModelMeta *m) {
     std::cout << e.what() << std::endl;
     throw std::runtime_error("ERROR LOADING MODEL.");
   }
+
+  // swap in the int8 variant if there is one
+  std::string path;
+  if ((quantized) && (!m->meta.quantized())) {
+    path = quantized_ckpt_path(ckpt_path, &m->meta);
+  }
+  if (path.size()) {
+    load_model(path, m);
+    if (!m->meta.quantized()) {
+      throw std::runtime_error("ERROR LOADING MODEL : QUANTIZED MODEL IS NOT MARKED AS QUANTIZED.");
+    }
+  }
+}
+
+// loaded models are shared between calls, so each checkpoint is only read
+// from disk (and its quantized variant resolved) once. modules can run
+// forward from several threads at once.
+ModelMeta *get_shared_model(const std::string &ckpt_path, bool quantized=false) {
+  static std::mutex m;
+  static std::map<std::tuple<std::string,bool>,std::unique_ptr<ModelMeta>> models;
+  std::lock_guard<std::mutex> lock(m);
+  auto key = std::make_tuple(ckpt_path, quantized);
+  auto it = models.find(key);
+  if (it == models.end()) {
+    auto mm = std::make_unique<ModelMeta>();
+    load_model(ckpt_path, mm.get(), quantized);
+    it = models.insert(std::make_pair(key, std::move(mm))).first;
+  }
+  return it->second.get();
+}
+
+// the probabilities of the tokens allowed by the mask after temperature,
+// top-k and top-p, as (token, probability) pairs. only the legal tokens are
+// gathered, so the softmax and the partial sort run over the handful of
+// candidates left by the controller rather than the whole vocabulary.
+std::vector<std::pair<int,float>> candidate_probs(const float *logits, const std::vector<int> &mask, float temperature, int top_k, float top_p) {
+  std::vector<std::pair<int,float>> cand;
+  for (int j=0; j<mask.size(); j++) {
+    if (mask[j]) {
+      cand.push_back( std::make_pair(j, logits[j] / temperature) );
+    }
+  }
+  if (cand.size() == 0) {
+    return cand;
+  }
+
+  auto by_logit = [](const std::pair<int,float> &a, const std::pair<int,float> &b) {
+    return a.second > b.second;
+  };
+  bool use_top_p = (top_p > 0) && (top_p < 1);
+  int k = cand.size();
+  if ((top_k > 0) && (top_k < k)) {
+    k = top_k;
+  }
+  if (use_top_p) {
+    std::partial_sort(cand.begin(), cand.begin() + k, cand.end(), by_logit);
+  }
+  else if (k < cand.size()) {
+    std::nth_element(cand.begin(), cand.begin() + k - 1, cand.end(), by_logit);
+  }
+  cand.resize(k);
+
+  float max_logit = std::max_element(cand.begin(), cand.end(),
+    [](const std::pair<int,float> &a, const std::pair<int,float> &b) {
+      return a.second < b.second; })->second;
+  float total = 0;
+  for (auto &c : cand) {
+    c.second = std::exp(c.second - max_logit);
+    total += c.second;
+  }
+
+  // keep the most probable tokens until their mass reaches top_p
+  int n = k;
+  if (use_top_p) {
+    float mass = 0;
+    for (n=0; n<k; n++) {
+      mass += cand[n].second / total;
+      if (mass >= top_p) {
+        n++;
+        break;
+      }
+    }
+    n = std::min(n, k);
+    cand.resize(n);
+    total = 0;
+    for (const auto &c : cand) {
+      total += c.second;
+    }
+  }
+  for (auto &c : cand) {
+    c.second /= total;
+  }
+  return cand;
+}
+
+int sample_candidates(const std::vector<std::pair<int,float>> &cand, std::mt19937 *engine) {
+  std::uniform_real_distribution<float> dist(0, 1);
+  float r = dist(*engine);
+  float mass = 0;
+  for (const auto &c : cand) {
+    mass += c.second;
+    if (r < mass) {
+      return c.first;
+    }
+  }
+  return cand.back().first;
 }
 
-void sample_inner(std::vector<std::unique_ptr<SAMPLE_CONTROL>> &scon, std::vector<std::vector<int>> &seqs, torch::jit::Module *model, std::vector<torch::jit::IValue> &inputs, midi::SampleParam *param, CallbackManager *callbacks) {
+// when the mask leaves exactly one legal token (i.e. BAR after BAR_END,
+// a forced TRACK_END, a fixed time signature or the NOTE_DURATION of a
+// drum hit) there is nothing to sample, so the token is appended directly.
+// runs of these tokens are appended until some sequence has a real choice
+// to make. every sequence gets the same number of tokens so that the batch
+// stays aligned with the model state. returns the length of the run and
+// adds the appended tokens to runs.
+int append_forced_tokens(std::vector<std::unique_ptr<SAMPLE_CONTROL>> &scon, std::vector<std::vector<int>> &seqs, std::vector<std::vector<int>> &runs, CallbackManager *callbacks) {
+  int run_length = 0;
+  while (true) {
+    std::vector<int> forced(seqs.size(), -1);
+    bool active = false;
+    for (int i=0; i<seqs.size(); i++) {
+      if (scon[i]->finished) {
+        continue;
+      }
+      std::vector<int> mask = scon[i]->get_mask( seqs[i] );
+      if (scon[i]->finished) {
+        continue;
+      }
+      if (std::count(mask.begin(), mask.end(), 1) != 1) {
+        return run_length;
+      }
+      forced[i] = std::find(mask.begin(), mask.end(), 1) - mask.begin();
+      active = true;
+    }
+    if (!active) {
+      return run_length;
+    }
+    for (int i=0; i<seqs.size(); i++) {
+      if (forced[i] >= 0) {
+        seqs[i].push_back( forced[i] );
+        runs[i].push_back( forced[i] );
+        if (callbacks) {
+          callbacks->update(&scon[i]->enc, forced[i]);
+        }
+      }
+    }
+    run_length++;
+  }
+}
+
+// the position tensor passed along with a static state, for a forward pass
+// of num_tokens tokens starting at position
+torch::Tensor state_position(int64_t position, int64_t num_tokens, midi::ModelMetadata *meta) {
+  if (position + num_tokens > meta->max_length()) {
+    throw std::runtime_error("ERROR : SEQUENCE IS LONGER THAN THE STATIC STATE.");
+  }
+  return torch::tensor(position, torch::TensorOptions().dtype(torch::kInt64));
+}
+
+int sample_inner(std::vector<std::unique_ptr<SAMPLE_CONTROL>> &scon, std::vector<std::vector<int>> &seqs, torch::jit::Module *model, std::vector<torch::jit::IValue> &inputs, midi::SampleParam *param, CallbackManager *callbacks, midi::ModelMetadata *meta=NULL) {
   
   if ((!model) && (!param->internal_random_sample_mode())) {
     throw std::runtime_error("ERROR : MODEL IS INVALID.");
@@ -58,43 +244,88 @@ void sample_inner(std::vector<std::unique_ptr<SAMPLE_CONTROL>> &scon, std::vecto
     logits = torch::ones({param->batch_size(),vocab_size},opts);
   }
   else {
+    // the first pass runs the whole prompt, later ones only the new tokens
+    bool prefill = inputs[0].toTensor().size(1) == seqs[0].size();
+    MetricsTimer timer(prefill ? "forward_prefill" : "forward_token");
     auto outputs = model->forward(inputs).toTuple();
     logits = outputs->elements()[0].toTensor().index(
       {torch::indexing::Slice(),-1,torch::indexing::Slice()});
     past_key_values = outputs->elements()[1];
   }
 
-  // set masks
+  float temperature = param->temperature();
+  if (param->use_per_track_temperature()) {
+    temperature = scon[0]->get_temperature();
+  }
+
+  // sample from the tokens allowed by the masks
+  logits = logits.to(torch::kFloat32).contiguous();
+  std::vector<int> next_tokens(seqs.size(), 0);
   for (int i=0; i<seqs.size(); i++) {
     std::vector<int> mask = scon[i]->get_mask( seqs[i] );
     if (param->verbose()) {
       scon[i]->rep->show_mask_token_types(mask);
     }
-    if ((!scon[i]->finished) && (!param->internal_disable_masking())) {
-      for (int j=0; j<mask.size(); j++) {
-        if (mask[j] == 0) {
-          // set this to a very small possibility
-          logits[i][j] = -1 * std::numeric_limits<float>::max();
-        }
+    if (scon[i]->finished) {
+      continue;
+    }
+    if (param->internal_disable_masking()) {
+      std::fill(mask.begin(), mask.end(), 1);
+    }
+    MetricsTimer timer("sample_token");
+    next_tokens[i] = sample_candidates(candidate_probs(
+      logits[i].data_ptr<float>(), mask, temperature, param->top_k(),
+      param->top_p()), &scon[i]->engine);
+  }
+
+  // add next token to the sequences
+  std::vector<std::vector<int>> runs(seqs.size());
+  for (int i=0; i<seqs.size(); i++) {
+    int next_token = next_tokens[i];
+    runs[i].push_back( next_token );
+    if (!scon[i]->finished) {
+      seqs[i].push_back( next_token );
+      if (callbacks) {
+        callbacks->update(&scon[i]->enc, next_token);
       }
+      scon[i]->advance( seqs[i] );
     }
   }
 
-  //for (int i=0; i<logits.sizes()[1]; i++) {
-  //  std::cout << "logits[" << i << "] = " << logits[0][i].item<float_t>() << /std::endl;
-  //}
+  // append any tokens that follow without a choice
+  int run_length = 0;
+  if (!param->internal_disable_masking()) {
+    run_length = append_forced_tokens(scon, seqs, runs, callbacks);
+  }
 
-  // sample from probs
-  float temperature = param->temperature();
-  if (param->use_per_track_temperature()) {
-    temperature = scon[0]->get_temperature();
+  // once every sequence is complete there is no next forward pass
+  bool complete = true;
+  for (int i=0; i<seqs.size(); i++) {
+    complete &= scon[i]->finished;
   }
-  auto probs = (logits / temperature).softmax(1);
-  auto next_tokens = probs.multinomial(1);
 
-  if (!param->internal_random_sample_mode()) {
+  if ((!param->internal_random_sample_mode()) && (!complete)) {
+    // the sampled token and the forced tokens go through the model in
+    // a single forward pass. sequences that stopped early are padded
+    // with their last token, which is never used.
+    auto opts = torch::TensorOptions().dtype(torch::kInt64);
+    torch::Tensor x = torch::zeros({(int)seqs.size(), run_length + 1}, opts);
+    for (int i=0; i<seqs.size(); i++) {
+      for (int j=0; j<=run_length; j++) {
+        x[i][j] = runs[i][std::min(j, (int)runs[i].size()-1)];
+      }
+    }
+
+    // a static state is written in place, so the model only needs to know
+    // where the tokens from this forward pass start
+    bool static_state = (meta) && (meta->static_state());
+    int64_t position = 0;
+    if (static_state) {
+      position = inputs.back().toTensor().item<int64_t>() +
+        inputs[0].toTensor().size(1);
+    }
     inputs.clear();
-    inputs.push_back( next_tokens );
+    inputs.push_back( x );
 
     /*
     ENCODER *encoder = scon[0]->enc;
@@ -115,19 +346,12 @@ void sample_inner(std::vector<std::unique_ptr<SAMPLE_CONTROL>> &scon, std::vecto
     */
 
     inputs.push_back( past_key_values );
-  }
-  
-
-  // add next token to the sequences
-  for (int i=0; i<seqs.size(); i++) {
-    if (!scon[i]->finished) {
-      int next_token = next_tokens[i][0].item<int64_t>();
-      seqs[i].push_back( next_token );
-      if (callbacks) {
-        callbacks->update(&scon[i]->enc, next_token);
-      }
+    if (static_state) {
+      inputs.push_back( state_position(position, run_length + 1, meta) );
     }
   }
+
+  return run_length;
 }
 
 void make_state_legacy(std::vector<torch::jit::IValue> *state, int batch_size, midi::ModelMetadata *meta) {
@@ -146,7 +370,232 @@ void make_state(std::vector<torch::jit::IValue> *state, int batch_size, midi::Mo
   }
 }
 
-std::vector<midi::Piece> generate(midi::Status *status, midi::Piece *piece, midi::SampleParam *param, Debugger *debug, ModelMeta *mm, CallbackManager *callbacks) {
+// the cache is allocated once at full length and the model writes each
+// step into it in place, so it never has to be copied as it grows.
+void make_state_static(std::vector<torch::jit::IValue> *state, int batch_size, midi::ModelMetadata *meta) {
+  if (meta->max_length() <= 0) {
+    throw std::runtime_error("ERROR : STATIC STATE REQUIRES max_length IN MODEL METADATA.");
+  }
+  for (int i=0; i<meta->num_layers(); i++) {
+    std::vector<torch::jit::IValue> tuple;
+    for (int j=0; j<2; j++) {
+      tuple.push_back( torch::zeros({batch_size, meta->num_heads(), meta->max_length(), meta->num_hidden()}) );
+    }
+    state->push_back( torch::ivalue::Tuple::create(tuple) );
+  }
+}
+
+void make_model_state(std::vector<torch::jit::IValue> *state, int batch_size, midi::ModelMetadata *meta) {
+  if (meta->static_state()) {
+    make_state_static(state, batch_size, meta);
+  }
+  else if (meta->new_state()) {
+    make_state(state, batch_size, meta);
+  }
+  else {
+    make_state_legacy(state, batch_size, meta);
+  }
+}
+
+// keep the first length positions of a model state. new style states hold
+// (k,v) tuples of (B,H,T,D) tensors, legacy states hold (2,B,H,T,D) tensors.
+torch::jit::IValue truncate_state(const torch::jit::IValue &state, int length, bool new_state) {
+  std::vector<torch::jit::IValue> layers;
+  for (const auto &layer : state.toTuple()->elements()) {
+    if (new_state) {
+      std::vector<torch::jit::IValue> kv;
+      for (const auto &t : layer.toTuple()->elements()) {
+        kv.push_back( t.toTensor().narrow(2, 0, length) );
+      }
+      layers.push_back( torch::ivalue::Tuple::create(kv) );
+    }
+    else {
+      layers.push_back( layer.toTensor().narrow(3, 0, length) );
+    }
+  }
+  return torch::ivalue::Tuple::create(layers);
+}
+
+// a model with its own state for a single sequence. consumed is the number
+// of tokens of the sequence that are already in the state, so forward only
+// runs the tokens that are new since the last call.
+class ModelRunner {
+public:
+  ModelRunner(ModelMeta *m) {
+    mm = m;
+    consumed = 0;
+    std::vector<torch::jit::IValue> s;
+    make_model_state(&s, 1, &mm->meta);
+    state = torch::ivalue::Tuple::create(s);
+  }
+
+  // returns the logits (n,V) for the last n = tokens.size() - consumed
+  // positions of the sequence
+  torch::Tensor forward(std::vector<int> &tokens) {
+    int n = tokens.size() - consumed;
+    auto opts = torch::TensorOptions().dtype(torch::kInt64);
+    torch::Tensor x = torch::zeros({1, n}, opts);
+    for (int i=0; i<n; i++) {
+      x[0][i] = tokens[consumed + i];
+    }
+    std::vector<torch::jit::IValue> inputs = {x, state};
+    if (mm->meta.static_state()) {
+      inputs.push_back( state_position(consumed, n, &mm->meta) );
+    }
+    MetricsTimer timer(consumed ? "forward_token" : "forward_prefill");
+    auto outputs = mm->model.forward(inputs).toTuple();
+    state = outputs->elements()[1];
+    consumed = tokens.size();
+    return outputs->elements()[0].toTensor()[0];
+  }
+
+  // drop everything after the first length tokens from the state. a static
+  // state is simply overwritten from the new position on.
+  void truncate(int length) {
+    if (length < consumed) {
+      if (!mm->meta.static_state()) {
+        state = truncate_state(state, length, mm->meta.new_state());
+      }
+      consumed = length;
+    }
+  }
+
+  ModelMeta *mm;
+  torch::jit::IValue state;
+  int consumed;
+};
+
+// the dense distribution that sample_inner draws from
+torch::Tensor masked_probs(torch::Tensor logits, std::vector<int> mask, float temperature, midi::SampleParam *param) {
+  MetricsTimer timer("sample_token");
+  if (param->internal_disable_masking()) {
+    std::fill(mask.begin(), mask.end(), 1);
+  }
+  logits = logits.to(torch::kFloat32).contiguous();
+  torch::Tensor probs = torch::zeros_like(logits);
+  auto p = probs.accessor<float,1>();
+  for (const auto &c : candidate_probs(logits.data_ptr<float>(), mask,
+    temperature, param->top_k(), param->top_p())) {
+    p[c.first] = c.second;
+  }
+  return probs;
+}
+
+// draws from a dense distribution, which does not need to be normalized,
+// using the engine of the controller like sample_candidates
+int sample_dense(torch::Tensor probs, std::mt19937 *engine) {
+  probs = probs.to(torch::kFloat32).contiguous();
+  auto p = probs.accessor<float,1>();
+  float total = 0;
+  for (int i=0; i<p.size(0); i++) {
+    total += p[i];
+  }
+  std::uniform_real_distribution<float> dist(0, total);
+  float r = dist(*engine);
+  float mass = 0;
+  int last = 0;
+  for (int i=0; i<p.size(0); i++) {
+    if (p[i] > 0) {
+      mass += p[i];
+      last = i;
+      if (r < mass) {
+        return i;
+      }
+    }
+  }
+  return last;
+}
+
+float sample_temperature(SAMPLE_CONTROL *sc, midi::SampleParam *param) {
+  if (param->use_per_track_temperature()) {
+    return sc->get_temperature();
+  }
+  return param->temperature();
+}
+
+// one step of speculative decoding. the draft model proposes up to
+// draft_tokens tokens, which the target model scores in a single forward
+// pass. proposal x is accepted with probability min(1, p(x)/q(x)) and the
+// first rejected proposal is resampled from max(p-q,0), so the tokens
+// follow the target distribution exactly. the controller is rolled back to
+// the last accepted token using its checkpoint. returns the number of
+// proposed tokens and adds the number of accepted ones to num_accepted.
+int sample_speculative(SAMPLE_CONTROL *sc, std::vector<int> &seq, ModelRunner &target, ModelRunner &drafter, midi::SampleParam *param, CallbackManager *callbacks, int *num_accepted) {
+
+  int start = seq.size();
+  CONTROL_CHECKPOINT checkpoint = sc->save();
+
+  // draft proposals
+  std::vector<std::vector<int>> masks;
+  std::vector<float> temperatures;
+  std::vector<torch::Tensor> q;
+  for (int j=0; j<param->draft_tokens(); j++) {
+    std::vector<int> mask = sc->get_mask(seq);
+    if (sc->finished) {
+      break;
+    }
+    float temperature = sample_temperature(sc, param);
+    torch::Tensor logits = drafter.forward(seq)[-1];
+    torch::Tensor probs = masked_probs(logits, mask, temperature, param);
+    seq.push_back( sample_dense(probs, &sc->engine) );
+    masks.push_back( mask );
+    temperatures.push_back( temperature );
+    q.push_back( probs );
+  }
+  int num_proposed = masks.size();
+
+  // score the pending tokens and all proposals at once
+  torch::Tensor logits = target.forward(seq);
+  int offset = logits.size(0) - 1 - num_proposed;
+
+  int accepted = 0;
+  int next_token = -1;
+  for (; accepted<num_proposed; accepted++) {
+    torch::Tensor p = masked_probs(logits[offset + accepted],
+      masks[accepted], temperatures[accepted], param);
+    int x = seq[start + accepted];
+    float ratio = p[x].item<float>() / q[accepted][x].item<float>();
+    std::uniform_real_distribution<float> dist(0, 1);
+    if (dist(sc->engine) >= ratio) {
+      torch::Tensor residual = (p - q[accepted]).clamp_min(0);
+      if (residual.sum().item<float>() <= 0) {
+        residual = p;
+      }
+      next_token = sample_dense(residual, &sc->engine);
+      break;
+    }
+  }
+
+  // roll back to the last accepted token
+  seq.resize(start + accepted);
+  sc->restore(checkpoint);
+  std::vector<int> mask = sc->get_mask(seq);
+
+  // every proposal was accepted, so the target gets one more token for free
+  if ((accepted == num_proposed) && (!sc->finished)) {
+    torch::Tensor p = masked_probs(logits[offset + num_proposed],
+      mask, sample_temperature(sc, param), param);
+    next_token = sample_dense(p, &sc->engine);
+  }
+  if (next_token >= 0) {
+    seq.push_back( next_token );
+    sc->get_mask(seq);
+  }
+
+  if (callbacks) {
+    for (int t=start; t<seq.size(); t++) {
+      callbacks->update(&sc->enc, seq[t]);
+    }
+  }
+
+  target.truncate(start + accepted);
+  drafter.truncate(start + accepted);
+
+  *num_accepted += accepted;
+  return num_proposed;
+}
+
+std::vector<midi::Piece> generate(midi::Status *status, midi::Piece *piece, midi::SampleParam *param, Debugger *debug, ModelMeta *mm, CallbackManager *callbacks, ModelMeta *draft=NULL, StopCondition *stop=NULL) {
 
   float temp = param->temperature();
   int batch_size = param->batch_size();
@@ -165,13 +614,37 @@ std::vector<midi::Piece> generate(midi::Status *status, midi::Piece *piece, midi
   //sc.internal_skip_preprocess = param->internal_skip_preprocess(); // WATCH OUT
   //prepare_generate(status, piece, &sc, ckpt_map);
 
+  MetricsTimer timer("generate");
+
   std::vector<std::unique_ptr<SAMPLE_CONTROL>> scon;
   for (int i=0; i<param->batch_size(); i++) {
+    MetricsTimer encode_timer("prompt_encode");
     scon.push_back( std::move(
       std::make_unique<SAMPLE_CONTROL>(piece,status,param,&mm->meta)) );
+    // seed from torch so that torch::manual_seed fixes the samples
+    scon.back()->engine.seed(
+      torch::randint(std::numeric_limits<int>::max(), {1}).item<int64_t>() );
   }
 
   std::vector<int> prompt = scon[0]->prompt;
+
+  // bars of the first sequence are streamed as soon as they are decoded.
+  // the bars of the prompt are not streamed.
+  if ((callbacks) && (callbacks->stream_bars)) {
+    IncrementalDecoder<> *decoder = scon[0]->decoder.get();
+    std::vector<int> track_order = scon[0]->inverse_order;
+    int prompt_size = prompt.size();
+    decoder->on_bar = [=](int track_num, int bar_num) {
+      if (decoder->num_tokens > prompt_size) {
+        midi::Piece bar;
+        decoder->copy_bar(track_num, bar_num, &bar);
+        if (track_num < track_order.size()) {
+          track_num = track_order[track_num];
+        }
+        callbacks->stream_bar(track_num, bar_num, bar);
+      }
+    };
+  }
   
   //torch::jit::Module m;
   //midi::ModelMetadata meta;
@@ -193,72 +666,125 @@ std::vector<midi::Piece> generate(midi::Status *status, midi::Piece *piece, midi
   
 
 
-  std::vector<torch::jit::IValue> inputs;
+  std::vector<std::vector<int>> seqs;
+  int num_steps = 0;
+  int num_forced_tokens = 0;
+  int num_draft_proposed = 0;
+  int num_draft_accepted = 0;
 
-  // we don't need inputs if we are randomly sampling?
+  if ((draft) && (param->draft_tokens() > 0) && (!param->internal_random_sample_mode())) {
 
-  if (!param->internal_random_sample_mode()) {
+    if (batch_size != 1) {
+      throw std::invalid_argument("ERROR : DRAFT MODEL SAMPLING REQUIRES batch_size = 1.");
+    }
+    if (scon[0]->enc->config->embed_dim) {
+      throw std::invalid_argument("ERROR : DRAFT MODEL SAMPLING DOES NOT SUPPORT EMBEDDINGS.");
+    }
 
-    // create the inputs by tileing prompt
-    auto opts = torch::TensorOptions().dtype(torch::kInt64);
-    torch::Tensor x = torch::zeros({batch_size, (int)prompt.size()}, opts);
-    for (int k=0; k<batch_size; k++) {
-      for (int i=0; i<prompt.size(); i++) {
-        x[k][i] = prompt[i];
+    seqs.push_back( prompt );
+    ModelRunner target(mm);
+    ModelRunner drafter(draft);
+    while (!scon[0]->finished) {
+      num_draft_proposed += sample_speculative(scon[0].get(), seqs[0], target,
+        drafter, param, callbacks, &num_draft_accepted);
+      num_steps++;
+
+      // quit if we go for too long
+      if ((param->max_steps() > 0) && (num_steps >= param->max_steps())) {
+        terminated = true;
+        if (stop) {
+          stop->hit_max_steps();
+        }
+        break;
+      }
+
+      // quit if the request was cancelled or ran out of time
+      if ((stop) && (stop->check())) {
+        terminated = true;
+        break;
       }
     }
-    inputs.push_back( x );
 
-    if (scon[0]->enc->config->embed_dim) {
+    if (param->verbose()) {
+      std::cout << "DRAFT TOKENS ACCEPTED : " << num_draft_accepted << " / ";
+      std::cout << num_draft_proposed << std::endl;
+    }
+  }
+  else {
 
-      int embed_dim = scon[0]->enc->config->embed_dim;
-      opts = torch::TensorOptions().dtype(torch::kFloat32);
-      torch::Tensor c = torch::zeros({batch_size,(int)prompt.size(),embed_dim},opts);
+    std::vector<torch::jit::IValue> inputs;
+
+    // we don't need inputs if we are randomly sampling?
+
+    if (!param->internal_random_sample_mode()) {
+
+      // create the inputs by tileing prompt
+      auto opts = torch::TensorOptions().dtype(torch::kInt64);
+      torch::Tensor x = torch::zeros({batch_size, (int)prompt.size()}, opts);
       for (int k=0; k<batch_size; k++) {
         for (int i=0; i<prompt.size(); i++) {
-          for (int j=0; j<embed_dim; j++) {
-            c[k][i][j] = scon[0]->embeds[i][j];
-          }
+          x[k][i] = prompt[i];
         }
       }
-      inputs.push_back( c );
-
+      inputs.push_back( x );
+
+      if (scon[0]->enc->config->embed_dim) {
+
+        int embed_dim = scon[0]->enc->config->embed_dim;
+        opts = torch::TensorOptions().dtype(torch::kFloat32);
+        torch::Tensor c = torch::zeros({batch_size,(int)prompt.size(),embed_dim},opts);
+        for (int k=0; k<batch_size; k++) {
+          for (int i=0; i<prompt.size(); i++) {
+            for (int j=0; j<embed_dim; j++) {
+              c[k][i][j] = scon[0]->embeds[i][j];
+            }
+          }
+        }
+        inputs.push_back( c );
 
-      // create empty state v2
-      std::vector<torch::jit::IValue> state;
-      make_state(&state, param->batch_size(), &mm->meta);
-      inputs.push_back( torch::ivalue::Tuple::create(state) );
 
-    }
-    else {
-      // create empty state
-      // TODO :: infer the rest of the state dimensions from the model
-      std::vector<torch::jit::IValue> state;
-      if ((param) && (mm->meta.new_state())) {
+        // create empty state v2
+        std::vector<torch::jit::IValue> state;
         make_state(&state, param->batch_size(), &mm->meta);
+        inputs.push_back( torch::ivalue::Tuple::create(state) );
+
       }
       else {
-        make_state_legacy(&state, param->batch_size(), &mm->meta);
+        // create empty state
+        // TODO :: infer the rest of the state dimensions from the model
+        std::vector<torch::jit::IValue> state;
+        make_model_state(&state, param->batch_size(), &mm->meta);
+        inputs.push_back( torch::ivalue::Tuple::create(state) );
+        if (mm->meta.static_state()) {
+          inputs.push_back( state_position(0, prompt.size(), &mm->meta) );
+        }
       }
-      inputs.push_back( torch::ivalue::Tuple::create(state) );
     }
-  }
 
-  // create empty sequnces
-  std::vector<std::vector<int>> seqs;
-  for (int k=0; k<batch_size; k++) {
-    seqs.push_back( prompt );
-  }
+    // create empty sequnces
+    for (int k=0; k<batch_size; k++) {
+      seqs.push_back( prompt );
+    }
 
-  int num_steps = 0;
-  while (!scon[0]->finished) {
-    sample_inner(scon, seqs, &mm->model, inputs, param, callbacks);
-    num_steps++;
+    while (!scon[0]->finished) {
+      num_forced_tokens += sample_inner(
+        scon, seqs, &mm->model, inputs, param, callbacks, &mm->meta);
+      num_steps++;
     
-    // quit if we go for too long
-    if ((param->max_steps() > 0) && (num_steps >= param->max_steps())) {
-      terminated = true;
-      break;
+      // quit if we go for too long
+      if ((param->max_steps() > 0) && (num_steps >= param->max_steps())) {
+        terminated = true;
+        if (stop) {
+          stop->hit_max_steps();
+        }
+        break;
+      }
+
+      // quit if the request was cancelled or ran out of time
+      if ((stop) && (stop->check())) {
+        terminated = true;
+        break;
+      }
     }
   }
 
@@ -267,12 +793,20 @@ std::vector<midi::Piece> generate(midi::Status *status, midi::Piece *piece, midi
     debug->tokens.push_back(seqs[0]);
     debug->orders.push_back(scon[0]->inverse_order);
     debug->modes.push_back(scon[0]->model_type);
+    debug->num_forward_passes.push_back(num_steps);
+    debug->num_forced_tokens.push_back(num_forced_tokens);
+    debug->num_draft_proposed.push_back(num_draft_proposed);
+    debug->num_draft_accepted.push_back(num_draft_accepted);
   }
 
-  // convert back to piece
-  std::vector<midi::Piece> output(batch_size);
+  // the pieces have been decoded along with the sampling. a terminated
+  // generation is incomplete, so no pieces are returned.
+  std::vector<midi::Piece> output;
   if (!terminated) {
-    scon[0]->enc->tokens_to_json_array(seqs, output);
+    output.resize(batch_size);
+    for (int i=0; i<batch_size; i++) {
+      scon[i]->get_piece(seqs[i], &output[i]);
+    }
     scon[0]->finalize(&output[0]); // batch size should be 1 anyways
   }
   return output;
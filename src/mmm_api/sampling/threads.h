@@ -0,0 +1,140 @@
+#pragma once
+
+#include <torch/script.h>
+#include <ATen/Parallel.h>
+
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "../protobuf/midi.pb.h"
+
+// START OF NAMESPACE
+namespace mmm {
+
+// libtorch only allows the inter-op pool size to be set once, before any
+// inter-op work has been scheduled. later requests for a different size are
+// ignored with a warning.
+void set_inter_op_threads(int num_threads) {
+  static std::mutex m;
+  static int current = 0;
+  std::lock_guard<std::mutex> lock(m);
+  if ((num_threads <= 0) || (num_threads == current)) {
+    return;
+  }
+  if (current > 0) {
+    std::cout << "WARNING : INTER-OP THREADS ALREADY SET TO " << current << std::endl;
+    return;
+  }
+  try {
+    at::set_num_interop_threads(num_threads);
+    current = num_threads;
+  }
+  catch (const c10::Error &e) {
+    current = at::get_num_interop_threads();
+    std::cout << "WARNING : INTER-OP THREADS ALREADY SET TO " << current << std::endl;
+  }
+}
+
+// global thread configuration for inference. intra_op is the number of
+// threads used inside a single op (i.e. a matmul), inter_op the number of
+// threads used to run independent ops. values <= 0 leave the libtorch
+// defaults in place.
+void set_inference_threads(int intra_op, int inter_op) {
+  if (intra_op > 0) {
+    at::set_num_threads(intra_op);
+  }
+  set_inter_op_threads(inter_op);
+}
+
+// at::set_num_threads only applies to the calling thread with the OpenMP
+// backend. with the native and TBB backends it sets a process wide value,
+// so a per-call setting would race with concurrent calls.
+constexpr bool intra_op_threads_per_thread() {
+#if AT_PARALLEL_OPENMP
+  return true;
+#else
+  return false;
+#endif
+}
+
+// restrict the calling thread to a set of cores. threads started from it
+// afterwards inherit the core set, but libtorch keeps its intra-op workers
+// alive once they are started (for each calling thread with OpenMP, for
+// the process otherwise), so workers that already exist are not pinned.
+// returns false if pinning is not supported on this platform.
+bool pin_current_thread(const std::vector<int> &cores) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (const auto core : cores) {
+    CPU_SET(core, &set);
+  }
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+  return false;
+#endif
+}
+
+// applies the thread settings in SampleParam to the calling thread for the
+// lifetime of the object, so that concurrent requests running on different
+// threads can each use their own share of the machine. the previous
+// settings are restored on destruction. only the calling thread is
+// pinned, the intra-op workers are only pinned too when this is the first
+// request that starts them (see pin_current_thread). intra_op_threads is ignored unless
+// it is per-thread (see intra_op_threads_per_thread), use
+// set_inference_threads to change it for the whole process instead.
+class ThreadScope {
+public:
+  ThreadScope(midi::SampleParam *param) {
+    prev_intra_op = at::get_num_threads();
+    set_intra_op = false;
+    pinned = false;
+    set_inter_op_threads(param->inter_op_threads());
+    if (param->intra_op_threads() > 0) {
+      if (intra_op_threads_per_thread()) {
+        at::set_num_threads(param->intra_op_threads());
+        set_intra_op = true;
+      }
+      else if (param->verbose()) {
+        std::cout << "WARNING : INTRA-OP THREADS CAN ONLY BE SET PER CALL WITH THE OPENMP BACKEND" << std::endl;
+      }
+    }
+    if (param->cpu_cores_size()) {
+      std::vector<int> cores(
+        param->cpu_cores().begin(), param->cpu_cores().end());
+#ifdef __linux__
+      pthread_getaffinity_np(pthread_self(), sizeof(prev_cores), &prev_cores);
+#endif
+      pinned = pin_current_thread(cores);
+      if ((!pinned) && (param->verbose())) {
+        std::cout << "WARNING : COULD NOT PIN THREAD TO CORES" << std::endl;
+      }
+    }
+  }
+  ~ThreadScope() {
+    if (set_intra_op) {
+      at::set_num_threads(prev_intra_op);
+    }
+#ifdef __linux__
+    if (pinned) {
+      pthread_setaffinity_np(pthread_self(), sizeof(prev_cores), &prev_cores);
+    }
+#endif
+  }
+
+  int prev_intra_op;
+  bool set_intra_op;
+  bool pinned;
+#ifdef __linux__
+  cpu_set_t prev_cores;
+#endif
+};
+
+}
+// END OF NAMESPACE
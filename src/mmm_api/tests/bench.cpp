@@ -0,0 +1,485 @@
+#include <vector>
+#include <string>
+#include <map>
+#include <tuple>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <thread>
+
+#include "../midi_io.h"
+#include "../piano_roll.h"
+#include "../dataset/jagged.h"
+#include "../sampling/sample_internal.h"
+#include "../sampling/multi_step_sample.h"
+#include "../sampling/util.h"
+#include "../protobuf/util.h"
+#include "../protobuf/midi.pb.h"
+#include "../random.h"
+#include "../version.h"
+
+using namespace mmm;
+
+// =========================================
+// a small benchmark runner in the spirit of google benchmark. each
+// benchmark is a function that runs its body once per iteration of
+// state.keep_running(). the runner calls it with a growing number of
+// iterations until the timed part takes at least min_time seconds, and
+// reports the mean time per iteration. with --json the results are written
+// in the google benchmark json format, so they can be compared across
+// commits with its tools/compare.py.
+//
+// usage : ./mmm_bench [--filter substring] [--min_time seconds] [--json path]
+//                     [--ckpt path]
+
+class BenchState {
+public:
+  BenchState(int64_t n) {
+    iterations = n;
+    remaining = n;
+    items_processed = 0;
+    elapsed = std::chrono::nanoseconds(0);
+    running = false;
+  }
+
+  bool keep_running() {
+    if (remaining == iterations) {
+      resume();
+    }
+    if (remaining == 0) {
+      pause();
+      return false;
+    }
+    remaining--;
+    return true;
+  }
+
+  // exclude setup done inside the loop from the timing
+  void pause() {
+    if (running) {
+      elapsed += std::chrono::steady_clock::now() - start;
+      running = false;
+    }
+  }
+  void resume() {
+    if (!running) {
+      start = std::chrono::steady_clock::now();
+      running = true;
+    }
+  }
+
+  void set_items_processed(int64_t n) {
+    items_processed = n;
+  }
+
+  double seconds() const {
+    return std::chrono::duration<double>(elapsed).count();
+  }
+
+  int64_t iterations;
+  int64_t remaining;
+  int64_t items_processed;
+  std::chrono::steady_clock::duration elapsed;
+  std::chrono::steady_clock::time_point start;
+  bool running;
+};
+
+using BENCHMARK_FN = std::function<void(BenchState &)>;
+
+// the inputs of every round of every benchmark are drawn from this engine
+// after seeding it with the same value
+std::mt19937 e;
+
+struct BenchResult {
+  std::string name;
+  int64_t iterations;
+  double ns_per_iter;
+  double items_per_second;
+};
+
+BenchResult run_benchmark(const std::string &name, BENCHMARK_FN fn, double min_time) {
+  int64_t n = 1;
+  while (true) {
+    BenchState state(n);
+    e.seed(0);
+    fn(state);
+    double secs = state.seconds();
+    if ((secs >= min_time) || (n >= 1000000000)) {
+      BenchResult r;
+      r.name = name;
+      r.iterations = n;
+      r.ns_per_iter = 1e9 * secs / n;
+      r.items_per_second = (secs > 0) ? state.items_processed / secs : 0;
+      return r;
+    }
+    // aim a little past min_time, growing by at most 10x per round
+    double scale = (secs > 0) ? 1.4 * min_time / secs : 10.;
+    n = std::max(n + 1, (int64_t)(n * std::min(scale, 10.)));
+  }
+}
+
+std::string bench_results_to_json(const std::vector<BenchResult> &results) {
+  std::ostringstream ss;
+  ss << "{\n  \"context\": {\n";
+  ss << "    \"library\": \"mmm_api\",\n";
+  ss << "    \"num_cpus\": " << std::thread::hardware_concurrency() << "\n";
+  ss << "  },\n  \"benchmarks\": [\n";
+  for (int i=0; i<results.size(); i++) {
+    const BenchResult &r = results[i];
+    ss << "    {\"name\": \"" << r.name << "\", \"run_name\": \"" << r.name;
+    ss << "\", \"run_type\": \"iteration\", \"iterations\": " << r.iterations;
+    ss << ", \"real_time\": " << r.ns_per_iter;
+    ss << ", \"cpu_time\": " << r.ns_per_iter;
+    ss << ", \"time_unit\": \"ns\"";
+    if (r.items_per_second > 0) {
+      ss << ", \"items_per_second\": " << r.items_per_second;
+    }
+    ss << "}" << (i+1 < results.size() ? "," : "") << "\n";
+  }
+  ss << "  ]\n}\n";
+  return ss.str();
+}
+
+// =========================================
+// inputs shared by the benchmarks. everything is generated from a fixed
+// seed so that runs on different commits see the same data.
+
+const std::string BENCH_ENCODER = "EL_VELOCITY_DURATION_POLYPHONY_YELLOW_FIXED_ENCODER";
+const int BENCH_TRACKS = 4;
+const int BENCH_BARS = 8;
+const int BENCH_DATASET_SIZE = 64;
+
+const int BENCH_NOTES_PER_BAR = 8;
+
+// random_piece only lays out the tracks and bars, so the notes are added
+// here. each bar holds a few random notes that end within the bar.
+midi::Piece bench_piece(int num_tracks, int num_bars) {
+  std::vector<std::tuple<int,int>> timesigs(num_bars, std::make_tuple(4,4));
+  midi::Piece p = random_piece(num_tracks, num_bars, false, timesigs, &e);
+  int max_time = 4 * p.resolution();
+  for (auto &track : *p.mutable_tracks()) {
+    for (auto &bar : *track.mutable_bars()) {
+      bar.set_internal_beat_length(4);
+      for (int i=0; i<BENCH_NOTES_PER_BAR; i++) {
+        int pitch = 24 + random_on_range(80, &e);
+        int start = random_on_range(max_time - 1, &e);
+        int end = start + random_on_range(max_time - start, &e) + 1;
+        bar.add_events( p.events_size() );
+        midi::Event *event = p.add_events();
+        event->set_pitch( pitch );
+        event->set_time( start );
+        event->set_velocity( 8 + random_on_range(120, &e) );
+        bar.add_events( p.events_size() );
+        event = p.add_events();
+        event->set_pitch( pitch );
+        event->set_time( end );
+        event->set_velocity( 0 );
+      }
+    }
+  }
+  sort_piece_events(&p);
+  return p;
+}
+
+std::string temp_path(const std::string &name) {
+  return "/tmp/mmm_bench_" + name;
+}
+
+// a midi file for the benchmarks that parse midi
+std::string bench_midi_file() {
+  midi::Piece p = bench_piece(BENCH_TRACKS, BENCH_BARS);
+  std::string path = temp_path("piece.mid");
+  write_midi(&p, path);
+  return path;
+}
+
+// a jagged dataset of random pieces, with valid segments for training
+std::string bench_dataset() {
+  std::string path = temp_path("dataset.arr");
+  Jagged jag(path);
+  for (int i=0; i<BENCH_DATASET_SIZE; i++) {
+    midi::Piece p = bench_piece(BENCH_TRACKS, BENCH_BARS);
+    update_valid_segments(&p, 4, 1, false);
+    std::string s = p.SerializeAsString();
+    jag.append(s, 0);
+  }
+  jag.close();
+  return path;
+}
+
+// a token sequence sampled at random under the constraints of
+// SAMPLE_CONTROL, for bar infilling on a piece
+std::vector<int> bench_infill_tokens(midi::Piece *piece, midi::Status *status, midi::SampleParam *param, midi::ModelMetadata *meta) {
+  SAMPLE_CONTROL sc(piece, status, param, meta);
+  std::vector<int> tokens = sc.prompt;
+  for (int i=0; i<4096; i++) {
+    std::vector<int> mask = sc.get_mask(tokens);
+    if (sc.finished) {
+      break;
+    }
+    std::vector<int> choices;
+    for (int j=0; j<mask.size(); j++) {
+      if (mask[j]) {
+        choices.push_back(j);
+      }
+    }
+    tokens.push_back( choices[random_on_range(choices.size(), &e)] );
+  }
+  return tokens;
+}
+
+void infill_inputs(midi::Piece *piece, midi::Status *status, midi::SampleParam *param, midi::ModelMetadata *meta) {
+  *piece = bench_piece(BENCH_TRACKS, BENCH_BARS);
+  status_from_piece(piece, status);
+  for (auto &track : *status->mutable_tracks()) {
+    for (int bar=0; bar<BENCH_BARS; bar++) {
+      track.set_selected_bars(bar, random_on_range(3, &e) == 0);
+    }
+  }
+  status->mutable_tracks(0)->set_selected_bars(0, true);
+  *param = default_sample_param();
+  param->set_model_dim(BENCH_BARS);
+  meta->set_encoder(BENCH_ENCODER);
+}
+
+// =========================================
+// microbenchmarks
+
+void bench_parse_new(BenchState &state) {
+  std::string path = bench_midi_file();
+  std::unique_ptr<ENCODER> enc = getEncoder(getEncoderType(BENCH_ENCODER));
+  while (state.keep_running()) {
+    midi::Piece p;
+    parse_new(path, &p, enc->config);
+  }
+}
+
+void bench_fast_bit_roll64(BenchState &state) {
+  std::string path = bench_midi_file();
+  while (state.keep_running()) {
+    fast_bit_roll64(path, 12, BENCH_BARS, 0);
+  }
+}
+
+void bench_fast_min_hash(BenchState &state) {
+  std::string path = bench_midi_file();
+  std::vector<int> seeds = arange(8);
+  while (state.keep_running()) {
+    fast_min_hash(path, 12, BENCH_BARS, 0, seeds, 8);
+  }
+}
+
+void bench_to_performance_w_tracks_dev(BenchState &state) {
+  std::unique_ptr<ENCODER> enc = getEncoder(getEncoderType(BENCH_ENCODER));
+  midi::Piece p = bench_piece(BENCH_TRACKS, BENCH_BARS);
+  enc->preprocess_piece(&p);
+  int64_t num_tokens = 0;
+  while (state.keep_running()) {
+    TokenSequence ts = to_performance_w_tracks_dev(&p, enc->rep, enc->config);
+    num_tokens += ts.tokens.size();
+  }
+  state.set_items_processed(num_tokens);
+}
+
+void bench_decode_track_dev(BenchState &state) {
+  std::unique_ptr<ENCODER> enc = getEncoder(getEncoderType(BENCH_ENCODER));
+  midi::Piece p = bench_piece(BENCH_TRACKS, BENCH_BARS);
+  std::vector<int> tokens = enc->encode(&p);
+  int64_t num_tokens = 0;
+  while (state.keep_running()) {
+    midi::Piece q;
+    decode_track_dev(tokens, &q, enc->rep, enc->config);
+    num_tokens += tokens.size();
+  }
+  state.set_items_processed(num_tokens);
+}
+
+void bench_update_valid_segments(BenchState &state) {
+  midi::Piece p = bench_piece(8, 32);
+  while (state.keep_running()) {
+    update_valid_segments(&p, 4, 1, false);
+  }
+}
+
+void bench_jagged_read(BenchState &state) {
+  Jagged jag(bench_dataset());
+  int index = 0;
+  while (state.keep_running()) {
+    jag.read(index, 0);
+    index = (index + 1) % BENCH_DATASET_SIZE;
+  }
+}
+
+void bench_read_batch_v2(BenchState &state) {
+  const int batch_size = 8;
+  Jagged jag(bench_dataset());
+  jag.set_seed(0);
+  jag.set_num_bars(4);
+  jag.set_min_tracks(1);
+  jag.set_max_tracks(BENCH_TRACKS);
+  TrainConfig tc;
+  tc.num_bars = 4;
+  tc.min_tracks = 1;
+  tc.max_tracks = BENCH_TRACKS;
+  ENCODER_TYPE et = getEncoderType(BENCH_ENCODER);
+  while (state.keep_running()) {
+    jag.read_batch_v2(batch_size, 0, et, &tc);
+  }
+  state.set_items_processed(state.iterations * batch_size);
+}
+
+// the controller is built outside the timing, so this only measures the
+// masks over a whole sampled sequence
+void bench_get_mask(BenchState &state) {
+  midi::Piece piece;
+  midi::Status status;
+  midi::SampleParam param;
+  midi::ModelMetadata meta;
+  infill_inputs(&piece, &status, &param, &meta);
+  std::vector<int> tokens = bench_infill_tokens(&piece, &status, &param, &meta);
+  int start = SAMPLE_CONTROL(&piece, &status, &param, &meta).prompt.size();
+  int64_t num_masks = 0;
+  while (state.keep_running()) {
+    state.pause();
+    SAMPLE_CONTROL sc(&piece, &status, &param, &meta);
+    std::vector<int> prefix(tokens.begin(), tokens.begin() + start);
+    state.resume();
+    for (int i=start; i<tokens.size(); i++) {
+      sc.get_mask(prefix);
+      prefix.push_back( tokens[i] );
+    }
+    num_masks += tokens.size() - start;
+  }
+  state.set_items_processed(num_masks);
+}
+
+// =========================================
+// end-to-end benchmarks. these run sample in internal_random_sample_mode,
+// where the model is replaced by uniform logits, so no checkpoint is needed
+// and only the cost of the sampler itself is measured. with --ckpt they run
+// the given model instead (scripts/make_tiny_model.py writes a small one).
+
+std::string bench_ckpt;
+
+void set_bench_model(midi::SampleParam *param) {
+  if (bench_ckpt.size()) {
+    param->set_ckpt(bench_ckpt);
+  }
+  else {
+    param->set_ckpt(BENCH_ENCODER);
+    param->set_internal_random_sample_mode(true);
+  }
+}
+
+void bench_sample_infill(BenchState &state) {
+  while (state.keep_running()) {
+    state.pause();
+    midi::Piece piece;
+    midi::Status status;
+    midi::SampleParam param;
+    midi::ModelMetadata meta;
+    infill_inputs(&piece, &status, &param, &meta);
+    set_bench_model(&param);
+    state.resume();
+    sample(&piece, &status, &param);
+  }
+}
+
+void bench_sample_autoregressive(BenchState &state) {
+  std::vector<midi::GM_TYPE> insts = {
+    midi::piano, midi::bass, midi::guitar, midi::organ};
+  while (state.keep_running()) {
+    state.pause();
+    midi::Piece piece;
+    midi::Status status;
+    autoregressive_inputs(insts, BENCH_BARS, &piece, &status);
+    midi::SampleParam param = default_sample_param();
+    param.set_model_dim(BENCH_BARS);
+    set_bench_model(&param);
+    state.resume();
+    sample(&piece, &status, &param);
+  }
+}
+
+void bench_sample_multi_step(BenchState &state) {
+  while (state.keep_running()) {
+    state.pause();
+    midi::Piece piece = bench_piece(8, 32);
+    midi::Status status;
+    status_from_piece(&piece, &status);
+    for (auto &track : *status.mutable_tracks()) {
+      for (int bar=0; bar<32; bar++) {
+        track.set_selected_bars(bar, random_on_range(2, &e) == 0);
+      }
+    }
+    midi::SampleParam param = default_sample_param();
+    param.set_model_dim(4);
+    param.set_bars_per_step(2);
+    param.set_tracks_per_step(2);
+    set_bench_model(&param);
+    state.resume();
+    sample(&piece, &status, &param);
+  }
+}
+
+std::vector<std::tuple<std::string,BENCHMARK_FN>> BENCHMARKS = {
+  { "parse_new", bench_parse_new },
+  { "fast_bit_roll64", bench_fast_bit_roll64 },
+  { "fast_min_hash", bench_fast_min_hash },
+  { "to_performance_w_tracks_dev", bench_to_performance_w_tracks_dev },
+  { "decode_track_dev", bench_decode_track_dev },
+  { "update_valid_segments", bench_update_valid_segments },
+  { "jagged_read", bench_jagged_read },
+  { "read_batch_v2", bench_read_batch_v2 },
+  { "get_mask", bench_get_mask },
+  { "sample_infill", bench_sample_infill },
+  { "sample_autoregressive", bench_sample_autoregressive },
+  { "sample_multi_step", bench_sample_multi_step },
+};
+
+int main(int argc, char **argv) {
+  std::string filter;
+  std::string json_path;
+  double min_time = 0.5;
+  for (int i=1; i<argc; i++) {
+    std::string arg(argv[i]);
+    if ((arg == "--filter") && (i+1 < argc)) {
+      filter = argv[++i];
+    }
+    else if ((arg == "--min_time") && (i+1 < argc)) {
+      min_time = std::stod(argv[++i]);
+    }
+    else if ((arg == "--json") && (i+1 < argc)) {
+      json_path = argv[++i];
+    }
+    else if ((arg == "--ckpt") && (i+1 < argc)) {
+      bench_ckpt = argv[++i];
+    }
+    else {
+      std::cout << "usage : " << argv[0] << " [--filter substring] [--min_time seconds] [--json path] [--ckpt path]" << std::endl;
+      return 1;
+    }
+  }
+
+  // keep the sampler on one thread so that runs are comparable
+  set_inference_threads(1, 1);
+
+  std::vector<BenchResult> results;
+  printf("%-32s %16s %14s %16s\n", "BENCHMARK", "NS/ITER", "ITERATIONS", "ITEMS/S");
+  for (const auto &b : BENCHMARKS) {
+    const std::string &name = std::get<0>(b);
+    if (name.find(filter) == std::string::npos) {
+      continue;
+    }
+    BenchResult r = run_benchmark(name, std::get<1>(b), min_time);
+    printf("%-32s %16.0f %14lld %16.0f\n", r.name.c_str(), r.ns_per_iter,
+      (long long)r.iterations, r.items_per_second);
+    results.push_back( r );
+  }
+
+  if (json_path.size()) {
+    std::ofstream out(json_path);
+    out << bench_results_to_json(results);
+  }
+  return 0;
+}
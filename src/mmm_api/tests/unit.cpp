@@ -3,8 +3,12 @@
 #include <string>
 #include <map>
 #include <tuple>
+#include <chrono>
+#include <cstdlib>
+#include <thread>
 
 #include "../midi_io.h" // only needed for MIDI input/output
+#include "../dataset/jagged.h"
 #include "../sampling/sample_internal.h"
 #include "../sampling/multi_step_sample.h"
 #include "../sampling/util.h"
@@ -18,6 +22,34 @@
 
 using namespace mmm;
 
+// heap profiler hook. when built with -DMMM_COUNT_ALLOCATIONS every heap
+// allocation in the process is counted (see test_arena_speed).
+#ifdef MMM_COUNT_ALLOCATIONS
+#include <atomic>
+#include <cstdlib>
+std::atomic<size_t> num_allocations(0);
+void* operator new(size_t size) {
+  num_allocations++;
+  if (void *ptr = std::malloc(size)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+void operator delete(void *ptr) noexcept {
+  std::free(ptr);
+}
+void operator delete(void *ptr, size_t size) noexcept {
+  std::free(ptr);
+}
+size_t allocation_count() {
+  return num_allocations;
+}
+#else
+size_t allocation_count() {
+  return 0;
+}
+#endif
+
 // =========================================
 // configuration
 //
@@ -29,6 +61,8 @@ using namespace mmm;
 // 
 // NOTE : CKPT_TO_TEST is used for other evaluation measures (not unit tests).
 // NOTE : I believe the tests which generate MIDIs (el_test and opz_test) may require a folder to be created beforehand.
+// NOTE : scripts/make_tiny_model.py writes a small random model with the same interface as the checkpoints. it can stand in for them where only the interface or the timing matters.
+// NOTE : tests which need these tiny models look them up in the folder given by the MMM_TEST_MODELS environment variable, then in the working directory (see find_test_model). they are skipped when the models are missing. scripts/make_test_models.sh writes all of them to build/test_models, build_unit.sh runs it.
 
 const std::string MODEL_FOLDER = "/users/jeff/CODE/MMM_TRAINING/models/";
 std::vector<int> MODEL_DIMS_TO_TEST = {1,2,4,8};
@@ -234,13 +268,26 @@ std::unique_ptr<ENCODER> encoder_from_ckpt(midi::SampleParam *param) {
 void add_checkpoint_to_param(const char *ckpt_str, midi::SampleParam *param) {
   std::string ckpt(ckpt_str);
   bool random_sample_mode = !(ends_with(ckpt, std::string(".pt")));
-  if (!random_sample_mode) {
+  if ((!random_sample_mode) && (!file_exists(ckpt))) {
     ckpt = MODEL_FOLDER + ckpt;
   }
   param->set_ckpt(ckpt);
   param->set_internal_random_sample_mode(random_sample_mode);
 }
 
+// the path of a test model (i.e. tiny.pt from scripts/make_tiny_model.py)
+// in $MMM_TEST_MODELS or the working directory, empty when it is missing
+std::string find_test_model(const std::string &name) {
+  const char *folder = std::getenv("MMM_TEST_MODELS");
+  if ((folder) && (file_exists(std::string(folder) + "/" + name))) {
+    return std::string(folder) + "/" + name;
+  }
+  if (file_exists(name)) {
+    return name;
+  }
+  return "";
+}
+
 // this is a helper function that converts a midi::Piece into a midi::Status
 void status_from_piece(midi::Status *status, midi::Piece *piece, std::mt19937 *e=NULL) {
   status->Clear();
@@ -263,6 +310,36 @@ void status_from_piece(midi::Status *status, midi::Piece *piece, std::mt19937 *e
   }
 }
 
+// random_piece leaves the bars empty, this adds up to max_notes notes to
+// every bar
+void add_random_notes(midi::Piece *p, int max_notes, std::mt19937 *engine) {
+  if (!p->resolution()) {
+    p->set_resolution(12);
+  }
+  for (auto &track : *p->mutable_tracks()) {
+    for (auto &bar : *track.mutable_bars()) {
+      double beat_length = (double)bar.ts_numerator() / bar.ts_denominator() * 4;
+      int max_time = beat_length * p->resolution();
+      int num_notes = random_on_range(max_notes + 1, engine);
+      for (int i=0; i<num_notes; i++) {
+        int pitch = random_on_range(128, engine);
+        int start = random_on_range(max_time - 1, engine);
+        int end = start + random_on_range(max_time - start, engine) + 1;
+        bar.add_events( p->events_size() );
+        midi::Event *event = p->add_events();
+        event->set_pitch( pitch );
+        event->set_time( start );
+        event->set_velocity( 8 + random_on_range(120, engine) );
+        bar.add_events( p->events_size() );
+        event = p->add_events();
+        event->set_pitch( pitch );
+        event->set_time( end );
+        event->set_velocity( 0 );
+      }
+    }
+  }
+}
+
 bool contains_token(int token, std::vector<int> &tokens) {
   return std::find(tokens.begin(), tokens.end(), token) != tokens.end();
 }
@@ -337,6 +414,14 @@ generation_inputs build_generation_inputs(std::string estr, bool opz, int num_tr
   g.param.set_internal_disable_masking(false);
   g.param.set_max_steps(0);
   g.param.set_model_dim(g.model_dim);
+  g.param.set_intra_op_threads(0);
+  g.param.set_inter_op_threads(0);
+  g.param.set_top_k(0);
+  g.param.set_top_p(0);
+  g.param.set_timeout_ms(0);
+  g.param.set_use_quantized_model(false);
+  g.param.set_draft_tokens(0);
+  g.param.set_collect_metrics(false);
 
   return g;
 }
@@ -375,6 +460,51 @@ generation_inputs random_generation_inputs(int max_tracks=4, int max_bars=16, bo
   return random_generation_inputs_inner(estr, opz, max_tracks, max_bars);
 }
 
+// inputs for a random walk through one step of track generation (a random
+// subset of the tracks is resampled) or of bar infilling. the encoder is
+// one of ENCODERS_TO_TEST unless it is given.
+generation_inputs random_walk_inputs(bool autoregressive, std::string estr="") {
+  if (!estr.size()) {
+    estr = random_element(ENCODERS_TO_TEST, &e);
+  }
+  generation_inputs g = random_generation_inputs_inner(
+    estr, is_opz_encoder(estr), 4, 8, true);
+  add_random_notes(&g.piece, 4, &e);
+  set_polyphony_hard_limit(&g.status, random_on_range(1, 4, &e));
+  if (autoregressive) {
+    std::vector<int> track_nums = arange(g.num_tracks);
+    set_resample_tracks(&g.status, random_subset(track_nums, &e));
+  }
+  else {
+    BOOL_MATRIX m = random_boolean_matrix(g.num_tracks, g.num_bars, &e);
+    m[0][0] = true;
+    set_selected_bars(&g.status, m);
+  }
+  return g;
+}
+
+// the controller sample_step builds for a step covering the whole piece
+std::unique_ptr<SAMPLE_CONTROL> control_from_inputs(generation_inputs *g) {
+  midi::ModelMetadata meta;
+  meta.set_encoder(g->param.ckpt());
+  g->piece.set_resolution(
+    getEncoder(getEncoderType(meta.encoder()))->config->resolution);
+  add_timesigs_to_status(&g->piece, &g->status);
+  return std::make_unique<SAMPLE_CONTROL>(
+    &g->piece, &g->status, &g->param, &meta);
+}
+
+// one of the tokens allowed by the mask, chosen uniformly
+int random_legal_token(std::vector<int> &mask, std::mt19937 *engine) {
+  std::vector<int> choices;
+  for (int i=0; i<mask.size(); i++) {
+    if (mask[i]) {
+      choices.push_back(i);
+    }
+  }
+  return random_element(choices, engine);
+}
+
 // =====================================================================
 
 void set_random_seed(void) {  
@@ -482,9 +612,17 @@ void test_paths() {
 
 class MyCallback : public CallbackManager {
 public:
+  MyCallback () {
+    stream_bars = true;
+  }
   void on_bar_end(float progress) {
     std::cout << "BAR HAS ENDED :: " << progress << std::endl;
   }
+  void on_bar(int track_num, int bar_num, const midi::Piece &bar) {
+    std::cout << "BAR STREAMED :: " << track_num << " " << bar_num << std::endl;
+    streamed.push_back( std::make_tuple(track_num, bar_num) );
+  }
+  std::vector<std::tuple<int,int>> streamed;
 };
 
 void test_callbacks() {
@@ -498,8 +636,108 @@ void test_callbacks() {
   print_protobuf(&g.param);
   mmm::sample_w_debug(&g.piece, &g.status, &g.param, &g.debug, &callbacks);
 
+  // only selected bars are generated
+  for (const auto &pos : callbacks.streamed) {
+    TEST_CHECK( m[std::get<0>(pos)][std::get<1>(pos)] );
+  }
+}
+
+
+// cancels the generation after a number of bars, or waits after each bar so
+// that the deadline passes
+class StopCallback : public CallbackManager {
+public:
+  StopCallback (CancellationToken *t, int n, int ms) {
+    token = t;
+    cancel_after = n;
+    wait_ms = ms;
+  }
+  void on_bar_end(float progress) {
+    if (progress_count == cancel_after) {
+      token->cancel();
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(wait_ms));
+  }
+  CancellationToken *token;
+  int cancel_after;
+  int wait_ms;
+};
+
+void test_cancellation() {
+
+  set_random_seed();
+  for (int i=0; i<num_trials; i++) {
+
+    // a cancelled token stops sampling before the first step
+    generation_inputs g = random_generation_inputs(4,8);
+    BOOL_MATRIX m(g.num_tracks, std::vector<bool>(g.num_bars, true));
+    set_selected_bars(&g.status, m);
+    CancellationToken token;
+    token.cancel();
+    SAMPLE_STATUS status = mmm::sample_w_debug(&g.piece, &g.status, &g.param, &g.debug, NULL, &token);
+    TEST_CHECK( status == SAMPLE_CANCELLED );
+    TEST_CHECK( g.debug.tokens.size() == 0 );
+
+    // cancelling during a step drops that step and the ones after it
+    generation_inputs h = random_generation_inputs(4,8);
+    m = BOOL_MATRIX(h.num_tracks, std::vector<bool>(h.num_bars, true));
+    set_selected_bars(&h.status, m);
+    token.reset();
+    StopCallback callbacks(&token, 1, 0);
+    status = mmm::sample_w_debug(&h.piece, &h.status, &h.param, &h.debug, &callbacks, &token);
+    TEST_CHECK( status == SAMPLE_CANCELLED );
+    TEST_CHECK( h.debug.tokens.size() == 1 );
+
+    // the deadline passes during the first step
+    generation_inputs d = random_generation_inputs(4,8);
+    m = BOOL_MATRIX(d.num_tracks, std::vector<bool>(d.num_bars, true));
+    set_selected_bars(&d.status, m);
+    d.param.set_timeout_ms(1);
+    StopCallback slow_callbacks(&token, -1, 2);
+    status = mmm::sample_w_debug(&d.piece, &d.status, &d.param, &d.debug, &slow_callbacks);
+    TEST_CHECK( status == SAMPLE_DEADLINE_EXCEEDED );
+    TEST_CHECK( d.debug.tokens.size() <= 1 );
+  }
 }
 
+// the timing breakdown covers each part of sampling once metrics are on
+void test_metrics() {
+
+  set_random_seed();
+  generation_inputs g = random_generation_inputs(4,8);
+  BOOL_MATRIX m = random_boolean_matrix(g.num_tracks, g.num_bars, &e);
+  m[0][0] = true;
+  set_selected_bars(&g.status, m);
+  g.param.set_collect_metrics(true);
+  midi::SampleMetrics metrics;
+  mmm::sample_w_debug(&g.piece, &g.status, &g.param, &g.debug, NULL, NULL, &metrics);
+
+  std::map<std::string,int> counts;
+  for (const auto &t : metrics.timings()) {
+    counts[t.name()] = t.count();
+    TEST_CHECK( t.total_ms() <= metrics.total_ms() );
+  }
+  int num_steps = g.debug.tokens.size();
+  TEST_CHECK( counts["sample"] == 1 );
+  TEST_CHECK( counts["find_steps"] == 1 );
+  TEST_CHECK( counts["generate"] == num_steps );
+  TEST_CHECK( counts["piece_subset"] == num_steps );
+  TEST_CHECK( counts["decode"] == num_steps );
+  TEST_CHECK( counts["get_mask"] > 0 );
+  TEST_CHECK( metrics.events_size() > 0 );
+  TEST_CHECK( g.debug.metrics.timings_size() == metrics.timings_size() );
+
+  std::string trace = metrics_to_chrome_trace(metrics);
+  TEST_CHECK( trace.find("\"name\":\"get_mask\"") != std::string::npos );
+
+  // nothing is recorded when metrics are off
+  generation_inputs h = random_generation_inputs(4,8);
+  m = random_boolean_matrix(h.num_tracks, h.num_bars, &e);
+  m[0][0] = true;
+  set_selected_bars(&h.status, m);
+  mmm::sample_w_debug(&h.piece, &h.status, &h.param, &h.debug);
+  TEST_CHECK( h.debug.metrics.timings_size() == 0 );
+}
 
 // time_sig mismatch should throw invalid argument error
 void test_time_sig_mismatch() {
@@ -1123,9 +1361,1200 @@ void opz_test(void) {
   }
 }
 
+// measure decoding throughput on token sequences from random pieces
+void test_decode_speed(void) {
+
+  set_random_seed();
+  const int num_sequences = 100;
+  const int num_repeats = 10;
+
+  for (const auto estr : ENCODERS_TO_TEST) {
+    std::unique_ptr<ENCODER> enc = getEncoder(getEncoderType(estr));
+    bool opz = enc->config->te;
+
+    std::vector<std::vector<int>> sequences;
+    int num_tokens = 0;
+    while (sequences.size() < num_sequences) {
+      auto timesigs = one_random_time_sig(8, estr, true, &e);
+      midi::Piece p = random_piece(4, 8, opz, timesigs, &e);
+      try {
+        sequences.push_back( enc->encode(&p) );
+        num_tokens += sequences.back().size();
+      }
+      catch (const std::exception &exc) {
+        // skip pieces which can not be encoded
+      }
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i=0; i<num_repeats; i++) {
+      for (auto &tokens : sequences) {
+        midi::Piece p;
+        enc->decode(tokens, &p);
+      }
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    double secs = std::chrono::duration<double>(end - start).count();
+
+    std::cout << estr << " : DECODED " << num_tokens * num_repeats << " TOKENS IN " << secs << "s (" << (num_tokens * num_repeats / secs) << " TOKENS/s)" << std::endl;
+  }
+}
+
+// generation throughput with a model state that grows by concatenation
+// versus a preallocated static cache. the two checkpoints should only differ
+// in their state, e.g. scripts/make_tiny_model.py run without and with
+// --static_state. they are found with find_test_model, and skipped when
+// missing. mmm_bench --ckpt runs the end-to-end benchmarks with either one
+// as well.
+std::vector<std::string> STATE_SPEED_CKPTS = {
+  "tiny.pt",
+  "tiny_static.pt"
+};
+
+void test_state_speed(void) {
+
+  for (const auto &name : STATE_SPEED_CKPTS) {
+    std::string ckpt = find_test_model(name);
+    if (!ckpt.size()) {
+      std::cout << "SKIPPING : " << name << " NOT FOUND" << std::endl;
+      continue;
+    }
+    set_random_seed();
+    generation_inputs g = random_generation_inputs_inner(
+      ckpt, false, 4, 8, true, false);
+    set_resample_tracks(&g.status, arange(g.num_tracks));
+    g.param.set_temperature(1.);
+    g.param.set_bars_per_step(g.model_dim);
+    g.param.set_collect_metrics(true);
+
+    midi::SampleMetrics metrics;
+    mmm::sample_w_debug(
+      &g.piece, &g.status, &g.param, NULL, NULL, NULL, &metrics);
+
+    // sampled tokens per second, and the mean cost of a forward pass
+    // after the prompt, which is where the state update happens
+    int64_t num_tokens = 0;
+    double forward_ms = 0;
+    int64_t num_forward = 0;
+    for (const auto &t : metrics.timings()) {
+      if (t.name() == "sample_token") {
+        num_tokens = t.count();
+      }
+      if (t.name() == "forward_token") {
+        forward_ms = t.total_ms();
+        num_forward = t.count();
+      }
+    }
+    double secs = metrics.total_ms() / 1000.;
+
+    std::cout << ckpt << " : " << num_tokens << " TOKENS IN " << secs << "s (" << (num_tokens / secs) << " TOKENS/s) FORWARD : " << (forward_ms / std::max(num_forward, (int64_t)1)) << "ms" << std::endl;
+  }
+}
+
+// latency and throughput of concurrent generations for different thread
+// configurations. each of the concurrent generations gets its own disjoint
+// set of cores.
+void test_thread_speed(void) {
+
+  set_random_seed();
+  const int num_cores = default_num_threads();
+  const int num_rounds = 3;
+
+  generation_inputs g = random_generation_inputs_inner(
+    CKPT_TO_TEST, false, 4, 8, true, false);
+  set_resample_tracks(&g.status, arange(g.num_tracks));
+  g.param.set_temperature(1.);
+  g.param.set_bars_per_step(g.model_dim);
+  g.param.set_max_steps(256);
+
+  for (int concurrent=1; concurrent<=num_cores; concurrent*=2) {
+    for (int intra_op=1; intra_op*concurrent<=num_cores; intra_op*=2) {
+      std::vector<double> latency(concurrent * num_rounds, 0);
+      auto start = std::chrono::high_resolution_clock::now();
+      parallel_for(concurrent * num_rounds, concurrent, [&](int i) {
+        generation_inputs h(g);
+        h.param.set_intra_op_threads(intra_op);
+        int first_core = (i % concurrent) * intra_op;
+        for (int c=first_core; c<first_core+intra_op; c++) {
+          h.param.add_cpu_cores(c);
+        }
+        auto t0 = std::chrono::high_resolution_clock::now();
+        mmm::sample_w_debug(&h.piece, &h.status, &h.param, NULL);
+        auto t1 = std::chrono::high_resolution_clock::now();
+        latency[i] = std::chrono::duration<double>(t1 - t0).count();
+      });
+      auto end = std::chrono::high_resolution_clock::now();
+      double secs = std::chrono::duration<double>(end - start).count();
+
+      std::cout << "CONCURRENT : " << concurrent << " INTRA-OP : " << intra_op << " LATENCY : " << mean(latency) << "s THROUGHPUT : " << (latency.size() / secs) << " REQUESTS/s" << std::endl;
+    }
+  }
+}
+
+// latency and drift of the int8 variant of CKPT_TO_TEST (or of tiny.pt,
+// see find_test_model, when it is not available) against the original
+// model. drift is the mean KL divergence between the next token
+// distributions of the two models over every position of the prompt.
+void test_quantized(void) {
+
+  set_random_seed();
+  std::string ckpt = MODEL_FOLDER + CKPT_TO_TEST;
+  if (!file_exists(ckpt)) {
+    ckpt = find_test_model("tiny.pt");
+  }
+  if (!ckpt.size()) {
+    std::cout << "SKIPPING : " << CKPT_TO_TEST << " AND tiny.pt NOT FOUND" << std::endl;
+    return;
+  }
+  ModelMeta *fp32 = get_shared_model(ckpt, false);
+  ModelMeta *int8 = get_shared_model(ckpt, true);
+  if (!int8->meta.quantized()) {
+    std::cout << "NO QUANTIZED VARIANT OF " << ckpt << std::endl;
+    return;
+  }
+  std::unique_ptr<ENCODER> enc = getEncoder(
+    getEncoderType(fp32->meta.encoder()));
+
+  std::vector<double> secs(2, 0);
+  std::vector<double> kl;
+  int num_tokens = 0;
+  for (int i=0; i<num_trials; i++) {
+    generation_inputs g = random_generation_inputs_inner(
+      ckpt, false, 4, 8, true, false);
+    std::vector<int> tokens;
+    try {
+      tokens = enc->encode(&g.piece);
+    }
+    catch (const std::exception &exc) {
+      continue; // skip pieces which can not be encoded
+    }
+
+    std::vector<torch::Tensor> logp;
+    for (int k=0; k<2; k++) {
+      ModelRunner runner(k ? int8 : fp32);
+      auto start = std::chrono::high_resolution_clock::now();
+      logp.push_back( runner.forward(tokens).log_softmax(1) );
+      auto end = std::chrono::high_resolution_clock::now();
+      secs[k] += std::chrono::duration<double>(end - start).count();
+    }
+    kl.push_back(
+      (logp[0].exp() * (logp[0] - logp[1])).sum(1).mean().item<double>() );
+    num_tokens += tokens.size();
+  }
+
+  std::cout << "FP32 : " << (num_tokens / secs[0]) << " TOKENS/s" << std::endl;
+  std::cout << "INT8 : " << (num_tokens / secs[1]) << " TOKENS/s" << std::endl;
+  std::cout << "MEAN KL DIVERGENCE : " << mean(kl) << std::endl;
+}
+
+// with top_k = 1, or a top_p below the probability of any single token,
+// only one candidate is left at each step, so the generated tokens must
+// not depend on the seed
+void test_truncation(void) {
+
+  set_random_seed();
+  for (int i=0; i<num_trials; i++) {
+    generation_inputs g = random_generation_inputs(4,8);
+    BOOL_MATRIX m = random_boolean_matrix(g.num_tracks, g.num_bars, &e);
+    m[0][0] = true;
+    set_selected_bars(&g.status, m);
+    if (i % 2) {
+      g.param.set_top_k(1);
+    }
+    else {
+      g.param.set_top_p(1e-4);
+    }
+
+    std::vector<std::vector<std::vector<int>>> tokens;
+    for (int k=0; k<2; k++) {
+      generation_inputs h(g);
+      at::manual_seed(random_on_range(std::numeric_limits<int>::max(), &e));
+      mmm::sample_w_debug(&h.piece, &h.status, &h.param, &h.debug);
+      tokens.push_back( h.debug.tokens );
+    }
+    TEST_CHECK( tokens[0] == tokens[1] );
+  }
+}
+
+// the candidate kernel must match the dense masked softmax and respect
+// top-k and top-p
+void test_candidate_probs(void) {
+
+  set_random_seed();
+  const int vocab_size = 512;
+  for (int i=0; i<num_trials; i++) {
+    torch::Tensor logits = torch::randn({vocab_size});
+    std::vector<int> mask(vocab_size, 0);
+    for (int j=0; j<vocab_size; j++) {
+      mask[j] = (int)(random_on_range(8, &e) == 0);
+    }
+    mask[random_on_range(vocab_size, &e)] = 1;
+    float temperature = random_on_range(0.5, 2.0, &e);
+
+    torch::Tensor keep = torch::tensor(mask).to(torch::kBool);
+    torch::Tensor dense = (logits.masked_fill(keep.logical_not(),
+      -1 * std::numeric_limits<float>::max()) / temperature).softmax(0);
+
+    auto cand = candidate_probs(
+      logits.data_ptr<float>(), mask, temperature, 0, 0);
+    TEST_CHECK( cand.size() == std::count(mask.begin(), mask.end(), 1) );
+    for (const auto &c : cand) {
+      TEST_CHECK( mask[c.first] == 1 );
+      TEST_CHECK( std::abs(c.second - dense[c.first].item<float>()) < 1e-5 );
+    }
+
+    int top_k = random_on_range(1, 8, &e);
+    cand = candidate_probs(
+      logits.data_ptr<float>(), mask, temperature, top_k, 0);
+    TEST_CHECK( cand.size() == std::min(top_k,
+      (int)std::count(mask.begin(), mask.end(), 1)) );
+
+    float top_p = random_on_range(0.1, 0.9, &e);
+    cand = candidate_probs(
+      logits.data_ptr<float>(), mask, temperature, 0, top_p);
+    float mass = 0;
+    for (int j=0; j<cand.size(); j++) {
+      mass += dense[cand[j].first].item<float>();
+      // every token but the last is needed to reach top_p
+      if (j < cand.size() - 1) {
+        TEST_CHECK( mass < top_p + 1e-5 );
+      }
+    }
+    TEST_CHECK( mass >= top_p - 1e-5 );
+  }
+}
+
+// sampling from the candidate kernel versus a dense masked softmax and
+// multinomial over the whole vocabulary, with typical masks that allow a
+// few tokens
+void test_sampling_speed(void) {
+
+  set_random_seed();
+  const int vocab_size = 512;
+  const int num_samples = 10000;
+  std::mt19937 engine(0);
+
+  for (const int num_legal : {1, 4, 16, 64}) {
+    torch::Tensor logits = torch::randn({vocab_size});
+    std::vector<int> mask(vocab_size, 0);
+    for (int j=0; j<num_legal; j++) {
+      mask[random_on_range(vocab_size, &e)] = 1;
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i=0; i<num_samples; i++) {
+      torch::Tensor masked = logits.clone();
+      for (int j=0; j<mask.size(); j++) {
+        if (mask[j] == 0) {
+          masked[j] = -1 * std::numeric_limits<float>::max();
+        }
+      }
+      masked.softmax(0).multinomial(1).item<int64_t>();
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    double dense_secs = std::chrono::duration<double>(end - start).count();
+
+    start = std::chrono::high_resolution_clock::now();
+    for (int i=0; i<num_samples; i++) {
+      sample_candidates(candidate_probs(
+        logits.data_ptr<float>(), mask, 1., 0, 0), &engine);
+    }
+    end = std::chrono::high_resolution_clock::now();
+    double kernel_secs = std::chrono::duration<double>(end - start).count();
+
+    std::cout << "LEGAL TOKENS : " << num_legal << " DENSE : " << (num_samples / dense_secs) << " SAMPLES/s CANDIDATES : " << (num_samples / kernel_secs) << " SAMPLES/s" << std::endl;
+  }
+}
+
+// pruning moves the kept tracks and bars, their events must be unchanged
+void test_prune_tracks(void) {
+  set_random_seed();
+  std::vector<std::tuple<int,int>> timesigs = {{4,4},{4,4},{4,4},{4,4}};
+  for (int i=0; i<num_trials; i++) {
+    midi::Piece p = random_piece(4, 4, false, timesigs, &e);
+    midi::Piece orig(p);
+    std::vector<int> indices = arange(4);
+    std::vector<int> tracks = random_subset(indices, &e);
+    std::vector<int> bars = random_subset(indices, &e);
+    prune_tracks_dev2(&p, tracks, bars);
+
+    TEST_CHECK( p.tracks_size() == tracks.size() );
+    for (int t=0; t<tracks.size(); t++) {
+      const midi::Track &track = orig.tracks(tracks[t]);
+      TEST_CHECK( p.tracks(t).instrument() == track.instrument() );
+      TEST_CHECK( p.tracks(t).bars_size() == bars.size() );
+      for (int b=0; b<bars.size(); b++) {
+        const midi::Bar &bar = track.bars(bars[b]);
+        TEST_CHECK( p.tracks(t).bars(b).events_size() == bar.events_size() );
+        for (int j=0; j<bar.events_size(); j++) {
+          TEST_CHECK( p.events(p.tracks(t).bars(b).events(j)).SerializeAsString() == orig.events(bar.events(j)).SerializeAsString() );
+        }
+      }
+    }
+  }
+}
+
+// compacting the events must not change the events of any bar
+void test_compact_events(void) {
+  set_random_seed();
+  std::vector<std::tuple<int,int>> timesigs = {{4,4},{4,4},{4,4},{4,4}};
+  for (int i=0; i<num_trials; i++) {
+    midi::Piece p = random_piece(4, 4, false, timesigs, &e);
+
+    // replace the events of some bars like piece_insert does
+    midi::Piece x = random_piece(4, 4, false, timesigs, &e);
+    std::vector<std::tuple<int,int,int,int>> bar_mapping;
+    for (int j=0; j<8; j++) {
+      int track = random_on_range(4, &e);
+      int bar = random_on_range(4, &e);
+      bar_mapping.push_back( std::make_tuple(track, bar, track, bar) );
+    }
+    piece_insert(&p, &x, bar_mapping, false);
+
+    std::vector<std::string> before;
+    for (const auto &track : p.tracks()) {
+      for (const auto &bar : track.bars()) {
+        for (const auto index : bar.events()) {
+          before.push_back( p.events(index).SerializeAsString() );
+        }
+      }
+    }
+    int num_events = p.events_size();
+    int removed = compact_events(&p);
+
+    std::vector<std::string> after;
+    for (const auto &track : p.tracks()) {
+      for (const auto &bar : track.bars()) {
+        for (const auto index : bar.events()) {
+          after.push_back( p.events(index).SerializeAsString() );
+        }
+      }
+    }
+    TEST_CHECK( before == after );
+    TEST_CHECK( p.events_size() == num_events - removed );
+    TEST_CHECK( compact_events(&p) == 0 );
+  }
+}
+
+// the vector<bool> step planner that find_steps_inner replaced. it is kept
+// here as a reference, the packed planner must produce identical steps.
+struct REFERENCE_STEP {
+  int start;
+  int end;
+  BOOL_MATRIX step;
+  BOOL_MATRIX context;
+};
+
+void find_steps_reference_inner(std::vector<REFERENCE_STEP> &steps, BOOL_MATRIX &selection_matrix, std::vector<bool> &resample_mask, std::vector<bool> &ignore_mask, bool autoregressive, BOOL_MATRIX &generated, midi::SampleParam *param) {
+
+  int tracks_per_step = param->tracks_per_step();
+  int bars_per_step = param->bars_per_step();
+  int model_dim = param->model_dim();
+  int current_num_steps = steps.size();
+
+  BOOL_MATRIX sel(selection_matrix);
+  int nt = sel.size();
+  int nb = sel[0].size();
+  for (int i=0; i<sel.size(); i++) {
+    for (int j=0; j<sel[i].size(); j++) {
+      if (autoregressive) {
+        sel[i][j] = sel[i][j] & resample_mask[i];
+      }
+      else {
+        sel[i][j] = sel[i][j] & ~resample_mask[i];
+      }
+    }
+  }
+
+  BOOL_MATRIX covered(nt, std::vector<bool>(nb,false));
+  tracks_per_step = std::max(std::min(tracks_per_step, nt), 1);
+  bars_per_step = std::max(std::min(bars_per_step, model_dim), 1);
+  int num_context = (model_dim - bars_per_step) / 2;
+
+  for (int i=0; i<nt; i=i+tracks_per_step) {
+    for (int j=0; j<nb; j=j+bars_per_step) {
+      int num_tracks = std::min(tracks_per_step, nt-i);
+      // one extra bars_per_step of columns, the kernel can run past the
+      // window at the end of the piece
+      BOOL_MATRIX kernel(num_tracks, std::vector<bool>(model_dim+bars_per_step,false));
+      int t = 0;
+      if (autoregressive) {
+        int right_offset = std::max((j + model_dim) - nb,0);
+        t = std::min(j, nb - model_dim);
+        for (int k=(j>0)*(num_context+right_offset); k<model_dim; k++) {
+          for (int n=0; n<num_tracks; n++) {
+            kernel[n][k] = true;
+          }
+        }
+      }
+      else {
+        t = std::min(std::max(j - num_context,0), nb - model_dim);
+        for (int k=j-t; k<j-t+bars_per_step; k++) {
+          for (int n=0; n<num_tracks; n++) {
+            kernel[n][k] = true;
+          }
+        }
+      }
+
+      BOOL_MATRIX step(nt, std::vector<bool>(nb,false));
+      BOOL_MATRIX context(nt, std::vector<bool>(nb,false));
+      for (int k=i; k<i+num_tracks; k++) {
+        for (int n=t; n<t+model_dim; n++) {
+          step[k][n] = sel[k][n] * kernel[k-i][n-t];
+          if (autoregressive) {
+            step[k][n] = step[k][n] & (!generated[k][n]);
+          }
+        }
+      }
+      for (int k=0; k<nt; k++) {
+        for (int n=t; n<t+model_dim; n++) {
+          context[k][n] = ~ignore_mask[k] & ~step[k][n];
+        }
+      }
+      if (autoregressive) {
+        for (int k=0; k<nt; k++) {
+          if (any(sel[k])) {
+            for (int n=t; n<t+model_dim; n++) {
+              context[k][n] = generated[k][n];
+            }
+          }
+        }
+      }
+      if (any(step)) {
+        steps.push_back({t, t+model_dim, step, context});
+      }
+      for (int k=i; k<i+num_tracks; k++) {
+        for (int n=t; n<t+model_dim; n++) {
+          generated[k][n] = std::max(generated[k][n], step[k][n]);
+          covered[k][n] = std::max(covered[k][n], kernel[k-i][n-t]);
+        }
+      }
+    }
+  }
+
+  if (!all(covered)) {
+    throw std::runtime_error("PIECE IS ONLY PARTIALLY COVERED");
+  }
+  if ((!autoregressive) && (param->percentage() < 100) && (steps.size() > current_num_steps)) {
+    int non_autoreg_steps = steps.size() - current_num_steps;
+    int new_size = non_autoreg_steps * ((float)param->percentage() / 100.);
+    steps.resize(current_num_steps + std::max(new_size,1));
+  }
+}
+
+std::vector<REFERENCE_STEP> find_steps_reference(BOOL_MATRIX &sel, std::vector<bool> &resample_mask, std::vector<bool> &ignore_mask, midi::SampleParam *param) {
+  std::vector<REFERENCE_STEP> steps;
+  BOOL_MATRIX generated(sel.size(), std::vector<bool>(sel[0].size(),false));
+  find_steps_reference_inner(
+    steps, sel, resample_mask, ignore_mask, true, generated, param);
+  find_steps_reference_inner(
+    steps, sel, resample_mask, ignore_mask, false, generated, param);
+  return steps;
+}
+
+// the packed planner must produce the same steps as the reference planner
+// on random selections, including pieces spanning several 64 bar words
+void test_find_steps(void) {
+  set_random_seed();
+  for (int i=0; i<100; i++) {
+    midi::SampleParam param;
+    param.set_model_dim( random_on_range(1, 8, &e) );
+    param.set_tracks_per_step( random_on_range(1, 4, &e) );
+    param.set_bars_per_step( random_on_range(1, param.model_dim(), &e) );
+    param.set_percentage( random_on_unit(&e) < .5 ? 100 : random_on_range(1, 100, &e) );
+    param.set_shuffle( false );
+
+    int nt = random_on_range(1, 24, &e);
+    int nb = random_on_range(param.model_dim(), 200, &e);
+    BOOL_MATRIX sel = random_boolean_matrix(nt, nb, &e);
+    std::vector<bool> resample_mask(nt);
+    std::vector<bool> ignore_mask(nt);
+    for (int t=0; t<nt; t++) {
+      resample_mask[t] = random_on_unit(&e) < .5;
+      ignore_mask[t] = random_on_unit(&e) < .2;
+    }
+
+    std::vector<REFERENCE_STEP> expected = find_steps_reference(
+      sel, resample_mask, ignore_mask, &param);
+    std::vector<STEP> steps = find_steps(
+      sel, resample_mask, ignore_mask, &param);
+
+    TEST_CHECK( steps.size() == expected.size() );
+    for (int j=0; j<std::min(steps.size(), expected.size()); j++) {
+      TEST_CHECK( steps[j].start == expected[j].start );
+      TEST_CHECK( steps[j].end == expected[j].end );
+      TEST_CHECK( steps[j].step.to_matrix() == expected[j].step );
+      TEST_CHECK( steps[j].context.to_matrix() == expected[j].context );
+    }
+  }
+}
+
+// the onsets of a bar as (time, pitch, velocity), in order
+std::vector<std::tuple<int,int,int>> bar_onsets(const midi::Piece &p, const midi::Bar &bar) {
+  std::vector<std::tuple<int,int,int>> onsets;
+  for (const auto index : bar.events()) {
+    const midi::Event &event = p.events(index);
+    if (event.velocity() > 0) {
+      onsets.push_back(
+        std::make_tuple(event.time(), event.pitch(), event.velocity()) );
+    }
+  }
+  std::sort(onsets.begin(), onsets.end());
+  return onsets;
+}
+
+// the bars streamed while tokens are appended must match the bars of the
+// decoded sequence, both for track generation and for bar infilling
+void test_stream_bars(void) {
+  set_random_seed();
+  for (const auto estr : ENCODERS_TO_TEST) {
+    std::unique_ptr<ENCODER> enc = getEncoder(getEncoderType(estr));
+    for (int i=0; i<num_trials; i++) {
+      auto timesigs = one_random_time_sig(8, estr, true, &e);
+      midi::Piece p = random_piece(4, 8, enc->config->te, timesigs, &e);
+      std::vector<int> tokens;
+      try {
+        midi::Piece q(p);
+        tokens = enc->encode(&q);
+      }
+      catch (const std::exception &exc) {
+        continue; // skip pieces which can not be encoded
+      }
+      midi::Piece decoded;
+      enc->decode(tokens, &decoded);
+
+      int count = 0;
+      midi::Piece streamed;
+      IncrementalDecoder<> decoder(&streamed, enc->rep, enc->config);
+      decoder.on_bar = [&](int track_num, int bar_num) {
+        midi::Piece bar;
+        decoder.copy_bar(track_num, bar_num, &bar);
+        TEST_CHECK( bar_onsets(bar, bar.tracks(0).bars(0)) == bar_onsets(decoded, decoded.tracks(track_num).bars(bar_num)) );
+        count++;
+      };
+      decoder.push(tokens);
+      TEST_CHECK( count == 4 * 8 );
+
+      std::set<std::tuple<int,int>> fills;
+      for (int j=0; j<4; j++) {
+        fills.insert(
+          std::make_tuple(random_on_range(4, &e), random_on_range(8, &e)) );
+      }
+      midi::Piece q(p);
+      enc->config->do_multi_fill = true;
+      enc->config->multi_fill = fills;
+      tokens = enc->encode(&q);
+      enc->config->do_multi_fill = false;
+      enc->config->multi_fill.clear();
+
+      // only the filled bars are streamed, at their position in the piece
+      count = 0;
+      midi::Piece fill_streamed;
+      IncrementalDecoder<> fill_decoder(
+        &fill_streamed, enc->rep, enc->config, true);
+      fill_decoder.on_bar = [&](int track_num, int bar_num) {
+        TEST_CHECK( fills.find(std::make_tuple(track_num,bar_num)) != fills.end() );
+        midi::Piece bar;
+        fill_decoder.copy_bar(track_num, bar_num, &bar);
+        TEST_CHECK( bar_onsets(bar, bar.tracks(0).bars(0)) == bar_onsets(decoded, decoded.tracks(track_num).bars(bar_num)) );
+        count++;
+      };
+      fill_decoder.push(tokens);
+      TEST_CHECK( count == fills.size() );
+    }
+  }
+}
+
+// decoding a sequence in chunks must give the same piece as decoding it
+// all at once, with and without bar infilling
+void test_incremental_decode(void) {
+  set_random_seed();
+  for (const auto estr : ENCODERS_TO_TEST) {
+    std::unique_ptr<ENCODER> enc = getEncoder(getEncoderType(estr));
+    for (int i=0; i<num_trials; i++) {
+      auto timesigs = one_random_time_sig(8, estr, true, &e);
+      midi::Piece p = random_piece(4, 8, enc->config->te, timesigs, &e);
+      for (const auto multi_fill : {false, true}) {
+        std::set<std::tuple<int,int>> fills;
+        for (int j=0; j<4 && multi_fill; j++) {
+          fills.insert(
+            std::make_tuple(random_on_range(4, &e), random_on_range(8, &e)) );
+        }
+        std::vector<int> tokens;
+        enc->config->do_multi_fill = multi_fill;
+        enc->config->multi_fill = fills;
+        try {
+          midi::Piece q(p);
+          tokens = enc->encode(&q);
+        }
+        catch (const std::exception &exc) {
+          enc->config->do_multi_fill = false;
+          enc->config->multi_fill.clear();
+          continue; // skip pieces which can not be encoded
+        }
+        midi::Piece decoded;
+        std::vector<int> copy(tokens);
+        enc->decode(copy, &decoded);
+        enc->config->do_multi_fill = false;
+        enc->config->multi_fill.clear();
+
+        midi::Piece incremental;
+        IncrementalDecoder<> decoder(
+          &incremental, enc->rep, enc->config, multi_fill);
+        int pos = 0;
+        while (pos < tokens.size()) {
+          int chunk = std::min(
+            random_on_range(16, &e) + 1, (int)tokens.size() - pos);
+          decoder.push(std::vector<int>(
+            tokens.begin() + pos, tokens.begin() + pos + chunk));
+          pos += chunk;
+        }
+        decoder.finish();
+        TEST_CHECK( incremental.SerializeAsString() == decoded.SerializeAsString() );
+      }
+    }
+  }
+}
+
+// a dataset in the chunked layout must give back the original piece, and
+// the same segments as pruning the original piece
+void test_chunked_jagged(void) {
+  set_random_seed();
+  std::string path = "/tmp/mmm_test_chunked.arr";
+  std::vector<midi::Piece> pieces;
+  Jagged writer(path);
+  writer.set_chunk_bars(random_on_range(1, 4, &e));
+  for (int i=0; i<num_trials; i++) {
+    int num_bars = random_on_range(1, 12, &e);
+    std::vector<std::tuple<int,int>> timesigs(
+      num_bars, std::make_tuple(4,4));
+    midi::Piece p = random_piece(
+      random_on_range(1, 4, &e), num_bars, false, timesigs, &e);
+    add_random_notes(&p, 4, &e);
+    std::string s = p.SerializeAsString();
+    writer.append(s, 0);
+    update_has_notes(&p);
+    pieces.push_back( p );
+  }
+  writer.close();
+
+  Jagged reader(path);
+  for (int i=0; i<pieces.size(); i++) {
+    midi::Piece whole;
+    whole.ParseFromString( reader.read(i, 0) );
+    TEST_CHECK( whole.SerializeAsString() == pieces[i].SerializeAsString() );
+
+    std::vector<int> track_indices = arange(pieces[i].tracks_size());
+    std::vector<int> bar_indices = arange(get_num_bars(&pieces[i]));
+    std::vector<int> tracks = random_subset(track_indices, &e);
+    std::vector<int> bars = random_subset(bar_indices, &e);
+    midi::Piece segment;
+    reader.load_segment(i, 0, tracks, bars, &segment);
+    midi::Piece expected(pieces[i]);
+    prune_tracks_dev2(&expected, tracks, bars);
+    TEST_CHECK( segment.SerializeAsString() == expected.SerializeAsString() );
+  }
+  std::remove( path.c_str() );
+  std::remove( (path + ".header").c_str() );
+}
+
+// the (time, pitch) pairs in the queue in the order they expire
+std::vector<std::pair<int,int>> expiry_list(NOTE_EXPIRY_QUEUE queue) {
+  std::vector<std::pair<int,int>> items;
+  while (!queue.empty()) {
+    items.push_back( queue.top() );
+    queue.pop();
+  }
+  return items;
+}
+
+// the note tracking SAMPLE_CONTROL used to do, with a map from expiry time
+// to pitches and a set of sounding pitches
+struct REFERENCE_NOTES {
+  std::map<int,std::vector<int>> note_expiry;
+  std::set<int> onsets;
+  int last_token;
+
+  // sc has already been updated with the token
+  void update(SAMPLE_CONTROL *sc, int token) {
+    REPRESENTATION *rep = sc->rep;
+    int absolute_timestep = sc->absolute_timestep;
+    switch (rep->get_token_type(token)) {
+      case TRACK:
+        onsets.clear();
+        note_expiry.clear();
+        break;
+      case NOTE_ONSET:
+        onsets.insert( rep->decode(token) );
+        if ((is_drum_track(sc->current_track_type)) && (!sc->enc->config->use_drum_offsets)) {
+          note_expiry[1 + absolute_timestep].push_back( rep->decode(token) );
+        }
+        break;
+      case NOTE_OFFSET:
+        onsets.erase( rep->decode(token) );
+        break;
+      case NOTE_DURATION:
+        note_expiry[rep->decode(token) + 1 + absolute_timestep].push_back(
+          rep->decode(last_token) );
+        break;
+      default:
+        break;
+    }
+    std::vector<int> to_remove;
+    for (const auto &kv : note_expiry) {
+      if (kv.first <= absolute_timestep) {
+        for (const auto pitch : kv.second) {
+          onsets.erase( pitch );
+        }
+        to_remove.push_back( kv.first );
+      }
+    }
+    for (const auto t : to_remove) {
+      note_expiry.erase( t );
+    }
+    last_token = token;
+  }
+};
+
+// the expiry queue and onset bitset of SAMPLE_CONTROL must track the same
+// notes as the reference, and the mask must follow from them, on random
+// walks through track generation
+void test_note_tracking(void) {
+  set_random_seed();
+  for (int i=0; i<num_trials; i++) {
+    generation_inputs g = random_walk_inputs(true);
+    std::unique_ptr<SAMPLE_CONTROL> sc = control_from_inputs(&g);
+    REPRESENTATION *rep = sc->rep;
+    REFERENCE_NOTES ref;
+
+    std::vector<int> tokens = sc->prompt;
+    for (int t=0; t<tokens.size()-1; t++) {
+      sc->update( tokens[t] );
+      ref.update( sc.get(), tokens[t] );
+    }
+    while (tokens.size() < 2048) {
+      std::vector<int> mask = sc->get_mask( tokens.back() );
+      ref.update( sc.get(), tokens.back() );
+      if (sc->finished) {
+        break;
+      }
+
+      std::vector<std::pair<int,int>> expiry;
+      for (const auto &kv : ref.note_expiry) {
+        for (const auto pitch : kv.second) {
+          expiry.push_back( std::make_pair(kv.first, pitch) );
+        }
+      }
+      std::sort(expiry.begin(), expiry.end());
+      TEST_CHECK( expiry_list(sc->note_expiry) == expiry );
+
+      int hard_limit = sc->polyphony_hard_limits[
+        std::min(sc->track_count, sc->num_tracks-1)];
+      bool any_onset = false;
+      for (int pitch=0; pitch<128; pitch++) {
+        bool sounding = ref.onsets.find(pitch) != ref.onsets.end();
+        TEST_CHECK( sc->onsets.test(pitch) == sounding );
+        int onset = rep->encode_int(NOTE_ONSET, pitch);
+        TEST_CHECK( !(sounding && mask[onset]) );
+        any_onset |= (bool)mask[onset];
+        if (rep->has_token_type(NOTE_OFFSET)) {
+          TEST_CHECK( sounding || !mask[rep->encode_int(NOTE_OFFSET, pitch)] );
+        }
+      }
+      TEST_CHECK( !(ref.onsets.size() >= hard_limit && any_onset) );
+
+      tokens.push_back( random_legal_token(mask, &e) );
+    }
+  }
+}
+
+// the state restored at each FILL_IN_START must be that of a controller
+// which has only seen the prompt up to the matching placeholder. the
+// track_count (and so the temperature) is that of the filled bar until
+// FILL_IN_END. notes still sounding from the previous fill on the same
+// track may be carried over, otherwise the mask is the one of the replay.
+void test_infill_state(void) {
+  set_random_seed();
+  for (int i=0; i<num_trials; i++) {
+    generation_inputs g = random_walk_inputs(false);
+    generation_inputs orig(g);
+    std::unique_ptr<SAMPLE_CONTROL> sc = control_from_inputs(&g);
+    REPRESENTATION *rep = sc->rep;
+    int fill_start = rep->encode(FILL_IN_START,0);
+    int fill_end = rep->encode(FILL_IN_END,0);
+
+    std::vector<int> prompt = sc->prompt;
+    std::vector<int> placeholders;
+    for (int t=0; t<prompt.size(); t++) {
+      if (prompt[t] == rep->encode(FILL_IN_PLACEHOLDER,0)) {
+        placeholders.push_back( t );
+      }
+    }
+    TEST_ASSERT( placeholders.size() == sc->num_infill_bars );
+
+    std::vector<int> tokens = prompt;
+    for (int t=0; t<tokens.size()-1; t++) {
+      sc->update( tokens[t] );
+    }
+    int fill_track = -1;
+    int previous_track = -1;
+    while (tokens.size() < 4096) {
+      std::bitset<128> sounding = sc->onsets;
+      std::vector<int> mask = sc->get_mask( tokens.back() );
+      if (sc->finished) {
+        break;
+      }
+
+      if (tokens.back() == fill_start) {
+        int k = sc->infill_bar_count;
+        generation_inputs h(orig);
+        std::unique_ptr<SAMPLE_CONTROL> replay = control_from_inputs(&h);
+        int track_ends = 0;
+        for (int t=0; t<=placeholders[k]; t++) {
+          replay->update( prompt[t] );
+          track_ends += (int)(prompt[t] == rep->encode(TRACK_END,0));
+        }
+        TEST_CHECK( sc->track_count == track_ends );
+        TEST_CHECK( sc->track_count == replay->track_count );
+        TEST_CHECK( sc->bar_count == replay->bar_count );
+        TEST_CHECK( sc->barlength == replay->barlength );
+        TEST_CHECK( sc->timestep == replay->timestep );
+        TEST_CHECK( sc->absolute_timestep == replay->absolute_timestep );
+        TEST_CHECK( sc->bar_start_timestep == replay->bar_start_timestep );
+        TEST_CHECK( sc->current_track_type == replay->current_track_type );
+
+        fill_track = sc->track_count;
+        if (fill_track != previous_track) {
+          TEST_CHECK( sc->onsets == replay->onsets );
+          TEST_CHECK( expiry_list(sc->note_expiry) == expiry_list(replay->note_expiry) );
+          replay->infill_bar_count = k;
+          std::vector<int> expected(rep->max_token(), 0);
+          replay->set_mask(fill_start, expected);
+          TEST_CHECK( mask == expected );
+        }
+        else {
+          TEST_CHECK( (sc->onsets & ~(replay->onsets | sounding)).none() );
+        }
+        previous_track = fill_track;
+      }
+      if (fill_track >= 0) {
+        TEST_CHECK( sc->track_count == fill_track );
+        TEST_CHECK( sc->get_temperature() == orig.status.tracks(fill_track).temperature() );
+      }
+      if (tokens.back() == fill_end) {
+        fill_track = -1;
+      }
+
+      tokens.push_back( random_legal_token(mask, &e) );
+    }
+    TEST_CHECK( sc->finished );
+  }
+}
+
+// the graph mask as REP_GRAPH::set_mask used to build it, by expanding
+// each edge of the node through the representation
+std::vector<int> rep_graph_mask_reference(REP_GRAPH *rg, int last_token) {
+  std::vector<int> mask(rg->rep->max_token(), 0);
+  auto it = rg->nodes.find(rg->rep->get_token_type(last_token));
+  if (it != rg->nodes.end()) {
+    for (const auto tt : it->second.edges) {
+      rg->rep->set_mask(tt, {-1}, mask, 1);
+    }
+  }
+  return mask;
+}
+
+// the shared, compiled graph must give the same masks and edges as a graph
+// built from the controller's own encoder, on random walks through track
+// generation and bar infilling
+void test_rep_graph(void) {
+  set_random_seed();
+  for (int i=0; i<num_trials; i++) {
+    generation_inputs g = random_walk_inputs(i % 2 == 0);
+    std::unique_ptr<SAMPLE_CONTROL> sc = control_from_inputs(&g);
+    REP_GRAPH graph(sc->enc.get(), sc->model_type);
+    TEST_CHECK( sc->rg == get_shared_rep_graph(sc->enc.get(), sc->model_type) );
+
+    for (int u=0; u<=NONE; u++) {
+      auto it = graph.nodes.find(static_cast<TOKEN_TYPE>(u));
+      TEST_CHECK( sc->rg->has_node.test(u) == (it != graph.nodes.end()) );
+      for (int v=0; v<=NONE && it != graph.nodes.end(); v++) {
+        bool edge = it->second.edges.count(static_cast<TOKEN_TYPE>(v)) > 0;
+        TEST_CHECK( sc->rg->edge_matrix[u].test(v) == edge );
+      }
+    }
+
+    std::vector<int> tokens = sc->prompt;
+    while (tokens.size() < 4096) {
+      std::vector<int> mask = sc->get_mask( tokens );
+      if (sc->finished) {
+        break;
+      }
+      TEST_CHECK( sc->rg->get_mask(tokens.back()) == rep_graph_mask_reference(&graph, tokens.back()) );
+      tokens.push_back( random_legal_token(mask, &e) );
+    }
+  }
+}
+
+// a batch of random walks where the forced runs are appended by
+// append_forced_tokens. replaying each sequence one token at a time, as
+// when every token was sampled, every appended token must be the only
+// legal token and the masks of the sampled tokens must be the same.
+void test_forced_tokens(void) {
+  set_random_seed();
+  for (int i=0; i<num_trials; i++) {
+    generation_inputs g = random_walk_inputs(i % 2 == 0);
+    std::vector<generation_inputs> inputs(2, g);
+    std::vector<std::unique_ptr<SAMPLE_CONTROL>> scon;
+    std::vector<std::vector<int>> seqs;
+    for (auto &h : inputs) {
+      scon.push_back( control_from_inputs(&h) );
+      seqs.push_back( scon.back()->prompt );
+    }
+    int prompt_size = seqs[0].size();
+    std::vector<std::vector<int>> runs(seqs.size());
+    std::vector<std::set<int>> forced(seqs.size());
+    std::vector<std::map<int,std::vector<int>>> masks(seqs.size());
+
+    while (seqs[0].size() < 4096) {
+      std::vector<int> sizes;
+      for (const auto &seq : seqs) {
+        sizes.push_back( seq.size() );
+      }
+      int run_length = append_forced_tokens(scon, seqs, runs, NULL);
+      bool active = false;
+      for (int j=0; j<seqs.size(); j++) {
+        TEST_CHECK( (seqs[j].size() == sizes[j] + run_length) || (scon[j]->finished) );
+        for (int t=sizes[j]; t<seqs[j].size(); t++) {
+          forced[j].insert( t );
+        }
+        if (scon[j]->finished) {
+          continue;
+        }
+        std::vector<int> mask = scon[j]->get_mask( seqs[j] );
+        if (scon[j]->finished) {
+          continue;
+        }
+        masks[j][seqs[j].size()] = mask;
+        seqs[j].push_back( random_legal_token(mask, &e) );
+        active = true;
+      }
+      if (!active) {
+        break;
+      }
+    }
+
+    for (int j=0; j<seqs.size(); j++) {
+      TEST_CHECK( scon[j]->finished );
+      TEST_CHECK( runs[j].size() == forced[j].size() );
+      generation_inputs h(g);
+      std::unique_ptr<SAMPLE_CONTROL> replay = control_from_inputs(&h);
+      std::vector<int> prefix(seqs[j].begin(), seqs[j].begin() + prompt_size);
+      for (int t=prompt_size; t<seqs[j].size(); t++) {
+        std::vector<int> mask = replay->get_mask( prefix );
+        TEST_CHECK( mask[seqs[j][t]] == 1 );
+        if (forced[j].count(t)) {
+          TEST_CHECK( std::count(mask.begin(), mask.end(), 1) == 1 );
+        }
+        else {
+          TEST_CHECK( mask == masks[j][t] );
+        }
+        prefix.push_back( seqs[j][t] );
+      }
+    }
+  }
+}
+
+// speculative sampling with tiny.pt. when the draft is the target and
+// sampling is greedy, every proposal must be accepted and the tokens must
+// be those of sampling one token at a time. with a perturbed draft some
+// proposals are rejected, and after each rejection the controller that was
+// rolled back must have the state and mask of a controller which has only
+// seen the tokens that were kept.
+void test_speculative(void) {
+  std::string ckpt = find_test_model("tiny.pt");
+  if (!ckpt.size()) {
+    std::cout << "SKIPPING : tiny.pt NOT FOUND" << std::endl;
+    return;
+  }
+  ModelMeta *model = get_shared_model(ckpt);
+  ModelMeta perturbed;
+  load_model(ckpt, &perturbed);
+  {
+    torch::NoGradGuard no_grad;
+    for (auto p : perturbed.model.parameters()) {
+      p.add_( torch::randn_like(p) );
+    }
+  }
+
+  set_random_seed();
+  int num_rejected = 0;
+  for (int i=0; i<num_trials; i++) {
+    generation_inputs g = random_walk_inputs(i % 2 == 0, model->meta.encoder());
+    g.param.set_temperature(1.);
+    g.param.set_use_per_track_temperature(false);
+    g.param.set_top_k(1);
+    g.param.set_top_p(0);
+    g.param.set_draft_tokens(random_on_range(1, 4, &e));
+    generation_inputs orig(g);
+
+    // greedy, one token at a time
+    generation_inputs h(orig);
+    std::unique_ptr<SAMPLE_CONTROL> sc = control_from_inputs(&h);
+    ModelRunner runner(model);
+    std::vector<int> expected = sc->prompt;
+    while (expected.size() < 512) {
+      std::vector<int> mask = sc->get_mask(expected);
+      if (sc->finished) {
+        break;
+      }
+      torch::Tensor probs = masked_probs(runner.forward(expected)[-1], mask,
+        sample_temperature(sc.get(), &g.param), &g.param);
+      expected.push_back( sample_dense(probs, &sc->engine) );
+    }
+
+    // greedy, with the model as its own draft
+    h = orig;
+    sc = control_from_inputs(&h);
+    ModelRunner target(model);
+    ModelRunner drafter(model);
+    std::vector<int> seq = sc->prompt;
+    int num_proposed = 0;
+    int num_accepted = 0;
+    while ((seq.size() < expected.size()) && (!sc->finished)) {
+      num_proposed += sample_speculative(
+        sc.get(), seq, target, drafter, &g.param, NULL, &num_accepted);
+    }
+    TEST_CHECK( num_accepted == num_proposed );
+    TEST_CHECK( seq.size() >= expected.size() );
+    TEST_CHECK( std::equal(expected.begin(), expected.end(), seq.begin()) );
+
+    // sampled, with the perturbed draft
+    g.param.set_top_k(0);
+    h = orig;
+    sc = control_from_inputs(&h);
+    ModelRunner noisy_target(model);
+    ModelRunner noisy_drafter(&perturbed);
+    seq = sc->prompt;
+    while ((seq.size() < 512) && (!sc->finished)) {
+      int accepted = 0;
+      int proposed = sample_speculative(
+        sc.get(), seq, noisy_target, noisy_drafter, &g.param, NULL, &accepted);
+      if (accepted == proposed) {
+        continue;
+      }
+      num_rejected++;
+      generation_inputs r(orig);
+      std::unique_ptr<SAMPLE_CONTROL> replay = control_from_inputs(&r);
+      std::vector<int> replay_mask = replay->get_mask(seq);
+      TEST_CHECK( sc->get_mask(seq) == replay_mask );
+      TEST_CHECK( sc->history == replay->history );
+      TEST_CHECK( sc->token_position == replay->token_position );
+      TEST_CHECK( sc->finished == replay->finished );
+      TEST_CHECK( sc->onsets == replay->onsets );
+      TEST_CHECK( expiry_list(sc->note_expiry) == expiry_list(replay->note_expiry) );
+      TEST_CHECK( sc->timestep == replay->timestep );
+      TEST_CHECK( sc->absolute_timestep == replay->absolute_timestep );
+      TEST_CHECK( sc->bar_count == replay->bar_count );
+      TEST_CHECK( sc->track_count == replay->track_count );
+      TEST_CHECK( sc->infill_bar_count == replay->infill_bar_count );
+      TEST_CHECK( sc->placeholder_states.size() == replay->placeholder_states.size() );
+    }
+  }
+  TEST_CHECK( num_rejected > 0 );
+}
+
+// latency and heap allocations of building the step inputs of a multi-step
+// generation on the heap versus on an arena. allocations are only counted
+// when built with -DMMM_COUNT_ALLOCATIONS.
+void test_arena_speed(void) {
+
+  set_random_seed();
+  const int num_repeats = 1000;
+  std::vector<std::tuple<int,int>> timesigs(16, std::make_tuple(4,4));
+  midi::Piece piece = random_piece(8, 16, false, timesigs, &e);
+  midi::Status status;
+  status_from_piece(&status, &piece, &e);
+  add_timesigs_to_status(&piece, &status);
+  std::vector<int> tracks = arange(4);
+
+  for (const bool use_arena : {false, true}) {
+    size_t start_count = allocation_count();
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i=0; i<num_repeats; i++) {
+      int bar = i % 12;
+      if (use_arena) {
+        google::protobuf::Arena arena;
+        midi::Status *s =
+          google::protobuf::Arena::CreateMessage<midi::Status>(&arena);
+        midi::Piece *p =
+          google::protobuf::Arena::CreateMessage<midi::Piece>(&arena);
+        status_subset(&status, bar, bar + 4, tracks, s);
+        piece_subset(&piece, bar, bar + 4, tracks, p);
+      }
+      else {
+        midi::Status s = status_subset(&status, bar, bar + 4, tracks);
+        midi::Piece p = piece_subset(&piece, bar, bar + 4, tracks);
+      }
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    double secs = std::chrono::duration<double>(end - start).count();
+    size_t count = allocation_count() - start_count;
+
+    std::cout << (use_arena ? "ARENA" : "HEAP") << " : " << (secs / num_repeats * 1e6) << "us PER STEP " << ((double)count / num_repeats) << " ALLOCATIONS PER STEP" << std::endl;
+  }
+}
+
+// batch encode/decode must match encoding/decoding one piece at a time
+void test_batch_encode_decode(void) {
+
+  set_random_seed();
+  const int num_pieces = 50;
+
+  for (const auto estr : ENCODERS_TO_TEST) {
+    std::unique_ptr<ENCODER> enc = getEncoder(getEncoderType(estr));
+    bool opz = enc->config->te;
+
+    std::vector<midi::Piece> pieces;
+    std::vector<std::vector<int>> expected;
+    while (pieces.size() < num_pieces) {
+      auto timesigs = one_random_time_sig(8, estr, true, &e);
+      midi::Piece p = random_piece(4, 8, opz, timesigs, &e);
+      midi::Piece q(p);
+      try {
+        expected.push_back( enc->encode(&q) );
+        pieces.push_back( p );
+      }
+      catch (const std::exception &exc) {
+        // skip pieces which can not be encoded
+      }
+    }
+
+    TokenBatch batch = enc->encode_batch(pieces, 4);
+    TEST_CHECK( batch.offsets.size() == num_pieces + 1 );
+    for (int i=0; i<num_pieces; i++) {
+      std::vector<int> seq(
+        batch.tokens.begin() + batch.offsets[i], 
+        batch.tokens.begin() + batch.offsets[i+1]);
+      TEST_CHECK( seq == expected[i] );
+    }
+
+    std::vector<midi::Piece> decoded;
+    enc->decode_batch(batch.tokens, batch.offsets, decoded, 4);
+    TEST_CHECK( decoded.size() == num_pieces );
+    for (int i=0; i<num_pieces; i++) {
+      midi::Piece p;
+      enc->decode(expected[i], &p);
+      TEST_CHECK( p.SerializeAsString() == decoded[i].SerializeAsString() );
+    }
+  }
+}
+
 TEST_LIST = {
   { "test_paths", test_paths},
   { "test_callbacks", test_callbacks},
+  { "test_cancellation", test_cancellation },
+  { "test_metrics", test_metrics },
   { "test_time_sig_mismatch", test_time_sig_mismatch },
   { "test_single_step", test_single_step },
   { "test_infill", test_infill },
@@ -1133,6 +2562,20 @@ TEST_LIST = {
   { "test_autoreg", test_autoreg },
   { "test_random_status", test_random_status },
   { "test_ignore", test_ignore },
+  { "test_batch_encode_decode", test_batch_encode_decode },
+  { "test_candidate_probs", test_candidate_probs },
+  { "test_truncation", test_truncation },
+  { "test_compact_events", test_compact_events },
+  { "test_prune_tracks", test_prune_tracks },
+  { "test_find_steps", test_find_steps },
+  { "test_stream_bars", test_stream_bars },
+  { "test_incremental_decode", test_incremental_decode },
+  { "test_chunked_jagged", test_chunked_jagged },
+  { "test_note_tracking", test_note_tracking },
+  { "test_infill_state", test_infill_state },
+  { "test_rep_graph", test_rep_graph },
+  { "test_forced_tokens", test_forced_tokens },
+  { "test_speculative", test_speculative },
 
   // the following aren't really unit test just useful for general evaluation 
   // of the models
@@ -1141,6 +2584,12 @@ TEST_LIST = {
   { "test_density", test_density }, // measure accuracy of density control
   { "opz_test", opz_test }, // generate some MIDIs
   { "el_test", el_test }, // generate some MIDIs
+  { "test_decode_speed", test_decode_speed }, // decoding throughput
+  { "test_state_speed", test_state_speed }, // growing vs static state generation throughput
+  { "test_thread_speed", test_thread_speed }, // thread configuration sweep
+  { "test_quantized", test_quantized }, // int8 model latency and drift
+  { "test_sampling_speed", test_sampling_speed }, // candidate vs dense sampling
+  { "test_arena_speed", test_arena_speed }, // heap vs arena step inputs
 
   { NULL, NULL }     /* zeroed record marking the end of the list */
 };